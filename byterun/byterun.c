@@ -5,82 +5,36 @@
 # include <errno.h>
 # include <malloc.h>
 # include "../runtime/runtime.h"
+# include "../interpreter/loader.h"
 
 void *__start_custom_data;
 void *__stop_custom_data;
 
-/* The unpacked representation of bytecode file */
-typedef struct {
-  char *string_ptr;              /* A pointer to the beginning of the string table */
-  int  *public_ptr;              /* A pointer to the beginning of publics table    */
-  char *code_ptr;                /* A pointer to the bytecode itself               */
-  int  *global_ptr;              /* A pointer to the global area                   */
-  int   stringtab_size;          /* The size (in bytes) of the string table        */
-  int   global_area_size;        /* The size (in words) of global area             */
-  int   public_symbols_number;   /* The number of public symbols                   */
-  char  buffer[0];               
-} bytefile;
-
 /* Gets a string from a string table by an index */
-char* get_string (bytefile *f, int pos) {
+const char* get_string (const bytefile *f, int pos) {
   return &f->string_ptr[pos];
 }
 
 /* Gets a name for a public symbol */
-char* get_public_name (bytefile *f, int i) {
+const char* get_public_name (const bytefile *f, int i) {
   return get_string (f, f->public_ptr[i*2]);
 }
 
 /* Gets an offset for a publie symbol */
-int get_public_offset (bytefile *f, int i) {
+int get_public_offset (const bytefile *f, int i) {
   return f->public_ptr[i*2+1];
 }
 
-/* Reads a binary bytecode file by name and unpacks it */
-bytefile* read_file (char *fname) {
-  FILE *f = fopen (fname, "rb");
-  long size;
-  bytefile *file;
-
-  if (f == 0) {
-    failure ("%s\n", strerror (errno));
-  }
-  
-  if (fseek (f, 0, SEEK_END) == -1) {
-    failure ("%s\n", strerror (errno));
-  }
-
-  file = (bytefile*) malloc (sizeof(int)*4 + (size = ftell (f)));
-
-  if (file == 0) {
-    failure ("*** FAILURE: unable to allocate memory.\n");
-  }
-  
-  rewind (f);
-
-  if (size != fread (&file->stringtab_size, 1, size, f)) {
-    failure ("%s\n", strerror (errno));
-  }
-  
-  fclose (f);
-  
-  file->string_ptr  = &file->buffer [file->public_symbols_number * 2 * sizeof(int)];
-  file->public_ptr  = (int*) file->buffer;
-  file->code_ptr    = &file->string_ptr [file->stringtab_size];
-  file->global_ptr  = (int*) malloc (file->global_area_size * sizeof (int));
-  
-  return file;
-}
-
 /* Disassembles the bytecode pool */
-void disassemble (FILE *f, bytefile *bf) {
+void disassemble (FILE *f, const bytefile *bf) {
   
 # define INT    (ip += sizeof (int), *(int*)(ip - sizeof (int)))
 # define BYTE   *ip++
 # define STRING get_string (bf, INT)
 # define FAIL   failure ("ERROR: invalid opcode %d-%d\n", h, l)
   
-  char *ip     = bf->code_ptr;
+  const char *code = (const char*) bf->code_ptr;
+  const char *ip   = code;
   char *ops [] = {"+", "-", "*", "/", "%", "<", "<=", ">", ">=", "==", "!=", "&&", "!!"};
   char *pats[] = {"=str", "#string", "#array", "#sexp", "#ref", "#val", "#fun"};
   char *lds [] = {"LD", "LDA", "ST"};
@@ -89,7 +43,7 @@ void disassemble (FILE *f, bytefile *bf) {
          h = (x & 0xF0) >> 4,
          l = x & 0x0F;
 
-    fprintf (f, "0x%.8x:\t", ip-bf->code_ptr-1);
+    fprintf (f, "0x%.8x:\t", ip-code-1);
     
     switch (h) {
     case 15:
@@ -262,6 +216,11 @@ void disassemble (FILE *f, bytefile *bf) {
         fprintf (f, "CALL\tBarray\t%d", INT);
         break;
 
+      case 5:
+        fprintf (f, "CALL\t%s ", STRING);
+        fprintf (f, "%d", INT);
+        break;
+
       default:
         FAIL;
       }
@@ -279,10 +238,10 @@ void disassemble (FILE *f, bytefile *bf) {
 }
 
 /* Dumps the contents of the file */
-void dump_file (FILE *f, bytefile *bf) {
+void dump_file (FILE *f, const bytefile *bf) {
   int i;
   
-  fprintf (f, "String table size       : %d\n", bf->stringtab_size);
+  fprintf (f, "String table size       : %d\n", bf->string_table_size);
   fprintf (f, "Global area size        : %d\n", bf->global_area_size);
   fprintf (f, "Number of public symbols: %d\n", bf->public_symbols_number);
   fprintf (f, "Public symbols          :\n");
@@ -297,5 +256,6 @@ void dump_file (FILE *f, bytefile *bf) {
 int main (int argc, char* argv[]) {
   bytefile *f = read_file (argv[1]);
   dump_file (stdout, f);
+  close_file (f);
   return 0;
 }
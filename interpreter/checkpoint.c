@@ -0,0 +1,212 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../runtime/gc.h"
+#include "../runtime/runtime.h"
+
+#define CHECKPOINT_MAGIC "LAMACKP1"
+
+// A checkpoint file is this header followed by the call frames, the operand
+// stack and the objects of the heap. Addresses are the ones of the run the
+// checkpoint has been taken in, the restoring run relocates them.
+typedef struct {
+    char magic[8];
+    // of the bytecode image, the checkpoint only suits the same file
+    uint32_t image_hash;
+    // index of the instruction to resume at
+    uint32_t ip;
+    uint32_t fp;
+    uint32_t frames_number;
+    // the operand stack is saved from the stack pointer up to its end
+    uint32_t stack_words;
+    uint32_t stack_end;
+    uint32_t heap_size;
+    uint32_t heap_begin;
+} checkpoint_header;
+
+typedef struct {
+    // index of the instruction plus one, 0 for none
+    uint32_t return_ip;
+    uint32_t caller_fp;
+    uint32_t closure;
+    int32_t n_args;
+    int32_t n_locals;
+} saved_frame;
+
+// Where the saved addresses have pointed to and where they point to now
+typedef struct {
+    uint32_t heap_begin, heap_end, stack_begin, stack_end;
+    uint32_t heap_delta, stack_delta;
+} relocation;
+
+// FNV-1a of the whole image. It is computed by the first save or restore of the
+// process only (once per process under --serve, not once per job), and not by
+// the loader, which would read every page of the mapping on every start.
+static uint32_t image_hash(const bytefile* bf) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static const bytefile* hashed = NULL;
+    static uint32_t hash;
+
+    pthread_mutex_lock(&lock);
+    if (hashed != bf) {
+        hash = 2166136261u;
+        for (size_t i = 0; i < bf->image_size; i++) {
+            hash = (hash ^ bf->image[i]) * 16777619u;
+        }
+        hashed = bf;
+    }
+    uint32_t result = hash;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
+
+static uint32_t relocate(const relocation* r, uint32_t value) {
+    if (UNBOXED(value)) {
+        return value;
+    }
+    if (value >= r->heap_begin && value < r->heap_end) {
+        return value + r->heap_delta;
+    }
+    if (value >= r->stack_begin && value <= r->stack_end) {
+        return value + r->stack_delta;
+    }
+    return value;
+}
+
+const instruction* checkpoint_marker(const bytefile* bf, const program* p) {
+    for (unsigned int i = 0; i < bf->public_symbols_number; i++) {
+        if (strcmp(&bf->string_ptr[bf->public_ptr[2 * i]], CHECKPOINT_SYMBOL) == 0) {
+            return instruction_at_offset(p, bf->public_ptr[2 * i + 1]);
+        }
+    }
+    return NULL;
+}
+
+static void write_section(FILE* f, const char* path, const void* data, size_t size) {
+    if (fwrite(data, 1, size, f) != size) {
+        failure("ERROR: unable to write checkpoint %s: %s\n", path, strerror(errno));
+    }
+}
+
+void save_checkpoint(const char* path, const bytefile* bf, const program* p, const machine_state* m) {
+    // only the live objects are worth saving, old ones included
+    gc_full_collection(0);
+    size_t heap_size;
+    void* objects = __gc_objects(&heap_size);
+
+    checkpoint_header header = {
+        .image_hash = image_hash(bf),
+        .ip = m->ip - p->code,
+        .fp = (uint32_t)m->fp,
+        .frames_number = m->frame - m->frames + 1,
+        .stack_words = m->stack_end - (m->sp + 1),
+        .stack_end = (uint32_t)m->stack_end,
+        .heap_size = heap_size,
+        .heap_begin = (uint32_t)objects,
+    };
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        failure("ERROR: unable to create checkpoint %s: %s\n", path, strerror(errno));
+    }
+    write_section(f, path, &header, sizeof(header));
+    for (uint32_t i = 0; i < header.frames_number; i++) {
+        const call_frame* frame = &m->frames[i];
+        saved_frame saved = {
+            .return_ip = frame->return_ip ? frame->return_ip - p->code + 1 : 0,
+            .caller_fp = (uint32_t)frame->caller_fp,
+            .closure = (uint32_t)frame->closure,
+            .n_args = frame->n_args,
+            .n_locals = frame->n_locals,
+        };
+        write_section(f, path, &saved, sizeof(saved));
+    }
+    write_section(f, path, m->sp + 1, header.stack_words * sizeof(int32_t));
+    write_section(f, path, objects, heap_size);
+    if (fclose(f) != 0) {
+        failure("ERROR: unable to write checkpoint %s: %s\n", path, strerror(errno));
+    }
+}
+
+void restore_checkpoint(const char* path, const bytefile* bf, const program* p, machine_state* m) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        failure("ERROR: unable to open checkpoint %s: %s\n", path, strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        failure("ERROR: unable to get file size %s: %s\n", path, strerror(errno));
+    }
+    size_t size = st.st_size;
+    if (size < sizeof(checkpoint_header)) {
+        failure("ERROR: invalid checkpoint %s: the header is truncated.\n", path);
+    }
+    const uint8_t* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        failure("ERROR: unable to map checkpoint %s: %s\n", path, strerror(errno));
+    }
+    close(fd);
+
+    checkpoint_header header;
+    memcpy(&header, image, sizeof(header));
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+        failure("ERROR: %s is not a checkpoint.\n", path);
+    }
+    if (header.image_hash != image_hash(bf)) {
+        failure("ERROR: checkpoint %s has been taken of another bytecode file.\n", path);
+    }
+    size_t frames_size = (size_t)header.frames_number * sizeof(saved_frame);
+    size_t stack_size = (size_t)header.stack_words * sizeof(int32_t);
+    if (header.ip >= p->length || header.frames_number == 0 ||
+        size - sizeof(header) != frames_size + stack_size + header.heap_size) {
+        failure("ERROR: invalid checkpoint %s: the sections do not match the file.\n", path);
+    }
+    if (header.frames_number > m->frames_capacity) {
+        failure("ERROR: checkpoint %s needs a call depth of %u.\n", path, header.frames_number - 1);
+    }
+    if (header.stack_words >= (size_t)(m->stack_end - m->stack_begin)) {
+        failure("ERROR: checkpoint %s needs a larger operand stack.\n", path);
+    }
+    const saved_frame* frames = (const saved_frame*)(image + sizeof(header));
+    const int32_t* stack = (const int32_t*)(image + sizeof(header) + frames_size);
+    const uint8_t* objects = image + sizeof(header) + frames_size + stack_size;
+
+    uint32_t heap_begin = (uint32_t)__gc_restore_objects(objects, header.heap_size, header.heap_begin);
+    int32_t* sp = m->stack_end - header.stack_words - 1;
+    // the frame pointer may be the stack pointer itself, so the old stack is
+    // taken to start there
+    relocation r = {
+        .heap_begin = header.heap_begin,
+        .heap_end = header.heap_begin + header.heap_size,
+        .stack_begin = header.stack_end - (header.stack_words + 1) * sizeof(int32_t),
+        .stack_end = header.stack_end,
+        .heap_delta = heap_begin - header.heap_begin,
+        .stack_delta = (uint32_t)m->stack_end - header.stack_end,
+    };
+    for (uint32_t i = 0; i < header.stack_words; i++) {
+        sp[i + 1] = relocate(&r, stack[i]);
+    }
+    for (uint32_t i = 0; i < header.frames_number; i++) {
+        call_frame* frame = &m->frames[i];
+        frame->return_ip = frames[i].return_ip ? p->code + frames[i].return_ip - 1 : NULL;
+        frame->caller_fp = (int32_t*)relocate(&r, frames[i].caller_fp);
+        frame->closure = (int32_t*)relocate(&r, frames[i].closure);
+        frame->n_args = frames[i].n_args;
+        frame->n_locals = frames[i].n_locals;
+    }
+    munmap((void*)image, size);
+
+    m->ip = p->code + header.ip;
+    m->sp = sp;
+    m->fp = (int32_t*)relocate(&r, header.fp);
+    m->frame = &m->frames[header.frames_number - 1];
+}
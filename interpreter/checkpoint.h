@@ -0,0 +1,43 @@
+#ifndef __LAMA_CHECKPOINT__
+#define __LAMA_CHECKPOINT__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+#include "loader.h"
+
+// A checkpoint is taken when the program enters its public function `checkpoint`
+// (exported as this label), e.g. once its tables are built, and holds everything
+// needed to resume from there: the objects of the heap, the operand stack with
+// the globals, the call frames and the registers of the machine.
+#define CHECKPOINT_SYMBOL "Lcheckpoint"
+
+// The machine a checkpoint is taken of or restored into
+typedef struct {
+    const instruction* ip;
+    int32_t* sp;
+    int32_t* fp;
+    call_frame* frame;
+    // the operand stack, growing down from right before `stack_end`; frames[0]
+    // is the record of the main function
+    int32_t* stack_begin;
+    int32_t* stack_end;
+    call_frame* frames;
+    size_t frames_capacity;
+} machine_state;
+
+// The instruction the checkpoint is taken at, NULL if the program has no
+// `checkpoint` function
+const instruction* checkpoint_marker(const bytefile* bf, const program* p);
+
+// Collects the garbage and writes the heap and the machine to `path`; the
+// registers must have been saved for the collector, see SAVE_REGISTERS
+void save_checkpoint(const char* path, const bytefile* bf, const program* p, const machine_state* m);
+
+// Replaces the heap and the stacks of `m` by the ones saved in `path` for the
+// same bytecode file, relocating the pointers, and sets the registers to resume
+// the program at the instruction the checkpoint has been taken at
+void restore_checkpoint(const char* path, const bytefile* bf, const program* p, machine_state* m);
+
+#endif
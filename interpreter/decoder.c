@@ -0,0 +1,396 @@
+#include "decoder.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../runtime/runtime.h"
+#include "../runtime/runtime_common.h"
+
+extern int LtagHash(char*);
+
+typedef struct {
+    const bytefile* bf;
+    const uint8_t* ip;
+    program* prog;
+    // false during the first pass, which only numbers the instructions
+    bool emit;
+    size_t count;
+    int32_t line;
+    // number of arguments of the function being decoded
+    int32_t n_args;
+    // boxed hash of every string pool entry used as a tag, 0 if not computed yet
+    int32_t* tag_hashes;
+} decoder;
+
+static const char* const opcode_names[OPCODES_NUMBER] = {
+#define BINOP_NAME(n, op) [OP_BINOP_##n] = "BINOP_" #n,
+    BINOPS(BINOP_NAME)
+#undef BINOP_NAME
+#define OPCODE_NAME(name) [OP_##name] = #name,
+    DECODED_OPCODES(OPCODE_NAME)
+    FUSED_OPCODES(OPCODE_NAME)
+    REGISTER_OPCODES(OPCODE_NAME)
+#undef OPCODE_NAME
+#define QUICKENED_NAME(name, generic) [OP_##name] = #name,
+    QUICKENED_OPCODES(QUICKENED_NAME)
+#undef QUICKENED_NAME
+#define REGISTER_BINOP_NAMES(n, op) [OP_REG_##n] = "REG_" #n, [OP_REG_CONST_##n] = "REG_CONST_" #n,
+    BINOPS(REGISTER_BINOP_NAMES)
+#undef REGISTER_BINOP_NAMES
+#define FUSED_BINOP_NAMES(n, op) [OP_FRAME_FRAME_##n] = "FRAME_FRAME_" #n, [OP_FRAME_CONST_##n] = "FRAME_CONST_" #n,
+    BINOPS(FUSED_BINOP_NAMES)
+#undef FUSED_BINOP_NAMES
+#define INTEGER_BINOP_NAMES(n, op)                                                                     \
+    [OP_INT_FRAME_FRAME_##n] = "INT_FRAME_FRAME_" #n, [OP_INT_FRAME_CONST_##n] = "INT_FRAME_CONST_" #n, \
+    [OP_INT_REG_##n] = "INT_REG_" #n, [OP_INT_REG_CONST_##n] = "INT_REG_CONST_" #n,
+    BINOPS(INTEGER_BINOP_NAMES)
+#undef INTEGER_BINOP_NAMES
+};
+
+const char* opcode_name(int32_t opcode) {
+    if (opcode < 0 || opcode >= OPCODES_NUMBER || !opcode_names[opcode]) {
+        return "UNKNOWN";
+    }
+    return opcode_names[opcode];
+}
+
+int32_t generic_opcode(int32_t opcode) {
+    switch (opcode) {
+#define GENERIC_OPCODE(name, generic) \
+    case OP_##name:                   \
+        return OP_##generic;
+        QUICKENED_OPCODES(GENERIC_OPCODE)
+#undef GENERIC_OPCODE
+#define INTEGER_BINOP_OPCODE(n, op)   \
+    case OP_INT_FRAME_FRAME_##n:      \
+        return OP_FRAME_FRAME_##n;    \
+    case OP_INT_FRAME_CONST_##n:      \
+        return OP_FRAME_CONST_##n;    \
+    case OP_INT_REG_##n:              \
+        return OP_REG_##n;            \
+    case OP_INT_REG_CONST_##n:        \
+        return OP_REG_CONST_##n;
+        BINOPS(INTEGER_BINOP_OPCODE)
+#undef INTEGER_BINOP_OPCODE
+        default:
+            return opcode;
+    }
+}
+
+void stack_effect(const instruction* insn, bool sta_to_reference, int32_t* pops, int32_t* pushes) {
+    *pops = 0;
+    *pushes = 1;
+    if (insn->opcode >= OP_BINOP_PLUS && insn->opcode <= OP_BINOP_OR) {
+        *pops = 2;
+        return;
+    }
+    switch (insn->opcode) {
+        case OP_SEXP:
+            *pops = insn->b.n;
+            break;
+        case OP_BARRAY:
+            *pops = insn->a.n;
+            break;
+        case OP_STA:
+            *pops = sta_to_reference ? 2 : 3;
+            break;
+        case OP_STI:
+        case OP_ELEM:
+        case OP_PATT_STR:
+            *pops = 2;
+            break;
+        case OP_SWAP:
+            *pops = 2;
+            *pushes = 2;
+            break;
+        case OP_CALLC:
+            *pops = insn->a.n + 1;
+            break;
+        case OP_CALL:
+        case OP_CALL_EXTERN:
+            *pops = insn->b.n;
+            break;
+        case OP_TAG:
+        case OP_ARRAY:
+        case OP_PATT_STRING:
+        case OP_PATT_ARRAY:
+        case OP_PATT_SEXP:
+        case OP_PATT_REF:
+        case OP_PATT_VAL:
+        case OP_PATT_CLOSURE:
+        case OP_WRITE:
+        case OP_LENGTH:
+        case OP_TO_STRING:
+        case OP_FIBER_SPAWN:
+        case OP_FIBER_JOIN:
+            *pops = 1;
+            break;
+        case OP_END:
+        case OP_RET:
+        case OP_DROP:
+        case OP_CJMPZ:
+        case OP_CJMPNZ:
+        case OP_FAIL:
+            *pops = 1;
+            *pushes = 0;
+            break;
+        case OP_ST_GLOBAL:
+        case OP_ST_LOCAL:
+        case OP_ST_ARGUMENT:
+        case OP_ST_CLOSURE:
+        case OP_JMP:
+        case OP_BEGIN:
+        case OP_CBEGIN:
+        case OP_STOP:
+            *pushes = 0;
+            break;
+        default:
+            // CONST, STRING, DUP, LD_*, LDA_*, CLOSURE, READ, FIBER_YIELD
+            break;
+    }
+}
+
+static inline uint8_t read_byte(decoder* d) { return *d->ip++; }
+
+static inline int32_t read_int(decoder* d) {
+    int32_t value;
+    memcpy(&value, d->ip, sizeof(int32_t));
+    d->ip += sizeof(int32_t);
+    return value;
+}
+
+static inline const char* read_string(decoder* d) { return &d->bf->string_ptr[read_int(d)]; }
+
+// Reads a tag operand and resolves it to its boxed hash, so that SEXP and TAG
+// compare plain integers at run time
+static int32_t read_tag(decoder* d) {
+    int32_t pos = read_int(d);
+    if (!d->emit) {
+        return 0;
+    }
+    if (!d->tag_hashes[pos]) {
+        d->tag_hashes[pos] = LtagHash((char*)&d->bf->string_ptr[pos]);
+    }
+    return d->tag_hashes[pos];
+}
+
+static inline const instruction* read_target(decoder* d) {
+    int32_t offset = read_int(d);
+    return d->emit ? instruction_at_offset(d->prog, offset) : NULL;
+}
+
+static instruction* emit(decoder* d, int32_t opcode) {
+    static instruction scratch;
+    instruction* insn = d->emit ? &d->prog->code[d->count] : &scratch;
+
+    memset(insn, 0, sizeof(instruction));
+    insn->opcode = opcode;
+    if (d->emit) {
+        d->prog->lines[d->count] = d->line;
+    }
+    d->count++;
+    return insn;
+}
+
+// Emits an instruction addressing a variable; `base` is the LD_GLOBAL-like
+// opcode of the group, location kinds follow it in the GLOBAL, LOCAL, ARGUMENT,
+// CLOSURE order both in bytecode and in the decoded opcodes.
+static void emit_location(decoder* d, int32_t base, uint8_t location, int32_t idx) {
+    instruction* insn = emit(d, base + location);
+    switch (location) {
+        case LOCATION_GLOBAL:
+            insn->a.n = idx;
+            break;
+        case LOCATION_LOCAL:
+            insn->a.n = -idx;
+            break;
+        case LOCATION_ARGUMENT:
+            insn->a.n = d->n_args - idx;
+            break;
+        case LOCATION_CLOSURE:
+            insn->a.n = idx + 1;
+            insn->b.n = d->n_args + 1;
+            break;
+    }
+}
+
+static void decode_h1(decoder* d, uint8_t low) {
+    instruction* insn;
+    switch (low) {
+        case CONST:
+            emit(d, OP_CONST)->a.n = BOX(read_int(d));
+            break;
+        case BSTRING:
+            emit(d, OP_STRING)->a.string = read_string(d);
+            break;
+        case BSEXP:
+            insn = emit(d, OP_SEXP);
+            insn->a.n = read_tag(d);
+            insn->b.n = read_int(d);
+            break;
+        case JMP:
+            emit(d, OP_JMP)->a.target = read_target(d);
+            break;
+        default:
+            // STI, STA, END, RET, DROP, DUP, SWAP, ELEM have no operands
+            emit(d, OP_STI + (low - STI));
+    }
+}
+
+static void decode_h5(decoder* d, uint8_t low) {
+    instruction* insn;
+    switch (low) {
+        case CJMPZ:
+            emit(d, OP_CJMPZ)->a.target = read_target(d);
+            break;
+        case CJMPNZ:
+            emit(d, OP_CJMPNZ)->a.target = read_target(d);
+            break;
+        case BEGIN:
+        case CBEGIN:
+            insn = emit(d, low == BEGIN ? OP_BEGIN : OP_CBEGIN);
+            insn->c.n = d->ip - d->bf->code_ptr - 1;
+            insn->a.n = d->n_args = read_int(d);
+            insn->b.n = read_int(d);
+            break;
+        case BCLOSURE: {
+            insn = emit(d, OP_CLOSURE);
+            insn->a.n = read_int(d);
+            insn->b.n = read_int(d);
+            for (int32_t i = 0, n = insn->b.n; i < n; i++) {
+                uint8_t location = read_byte(d);
+                emit_location(d, OP_LD_GLOBAL, location, read_int(d));
+            }
+            break;
+        }
+        case CALLC:
+            emit(d, OP_CALLC)->a.n = read_int(d);
+            break;
+        case CALL:
+            insn = emit(d, OP_CALL);
+            insn->a.target = read_target(d);
+            insn->b.n = read_int(d);
+            break;
+        case TAG:
+            insn = emit(d, OP_TAG);
+            insn->a.n = read_tag(d);
+            insn->b.n = BOX(read_int(d));
+            break;
+        case ARRAY_KEY:
+            emit(d, OP_ARRAY)->a.n = BOX(read_int(d));
+            break;
+        case FAIL:
+            insn = emit(d, OP_FAIL);
+            insn->a.n = read_int(d);
+            insn->b.n = read_int(d);
+            break;
+        case LINE:
+            d->line = read_int(d);
+            break;
+    }
+}
+
+// Decodes a single bytecode instruction, returns false after the STOP marker
+static bool decode_instruction(decoder* d) {
+    int32_t offset = d->ip - d->bf->code_ptr;
+    uint8_t opcode = read_byte(d);
+    uint8_t high = OPCODE_HIGH(opcode);
+    uint8_t low = OPCODE_LOW(opcode);
+
+    if (!d->emit) {
+        d->prog->index_by_offset[offset] = d->count;
+    } else {
+        d->prog->offsets[d->count] = offset;
+    }
+
+    if (opcode == STOP_OPCODE) {
+        emit(d, OP_STOP);
+        return false;
+    }
+
+    switch (high) {
+        case BINOP:
+            emit(d, OP_BINOP_PLUS + low - 1);
+            break;
+        case H1_OPS:
+            decode_h1(d, low);
+            break;
+        case LD:
+            emit_location(d, OP_LD_GLOBAL, low, read_int(d));
+            break;
+        case LDA:
+            emit_location(d, OP_LDA_GLOBAL, low, read_int(d));
+            break;
+        case ST:
+            emit_location(d, OP_ST_GLOBAL, low, read_int(d));
+            break;
+        case H5_OPS:
+            decode_h5(d, low);
+            break;
+        case PATT:
+            emit(d, OP_PATT_STR + low);
+            break;
+        case HI_BUILTIN:
+            if (low == BUILTIN_ARRAY) {
+                emit(d, OP_BARRAY)->a.n = read_int(d);
+            } else if (low == BUILTIN_EXTERN) {
+                const extern_function* f = resolve_extern(read_string(d));
+                // FIBER_SPAWN, FIBER_YIELD and FIBER_JOIN follow each other
+                int32_t opcode = f == NULL || f->kind == EXTERN_CALL ? OP_CALL_EXTERN
+                                                                     : OP_FIBER_SPAWN + f->kind - EXTERN_SPAWN;
+                instruction* insn = emit(d, opcode);
+                insn->a.function = f;
+                insn->b.n = read_int(d);
+            } else {
+                emit(d, OP_READ + low);
+            }
+            break;
+    }
+    return true;
+}
+
+static void* allocate(size_t size) {
+    void* p = malloc(size);
+    if (!p) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    return p;
+}
+
+program* decode_bytefile(const bytefile* bf) {
+    program* prog = allocate(sizeof(program));
+    decoder d = {.bf = bf, .prog = prog};
+
+    prog->code_size = bf->code_end - bf->code_ptr;
+    prog->index_by_offset = allocate(prog->code_size * sizeof(int32_t));
+    memset(prog->index_by_offset, -1, prog->code_size * sizeof(int32_t));
+
+    // the first pass numbers the instructions so that targets can be resolved
+    // to instruction pointers during the second one
+    d.ip = bf->code_ptr;
+    while (decode_instruction(&d)) {
+    }
+
+    prog->length = d.count;
+    prog->code = allocate(prog->length * sizeof(instruction));
+    prog->offsets = allocate(prog->length * sizeof(int32_t));
+    prog->lines = allocate(prog->length * sizeof(int32_t));
+
+    // every possible tag hash is boxed and thus non-zero
+    d.tag_hashes = calloc(bf->string_table_size + 1, sizeof(int32_t));
+    if (!d.tag_hashes) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+
+    d.ip = bf->code_ptr;
+    d.emit = true;
+    d.count = 0;
+    d.line = 0;
+    d.n_args = 0;
+    while (decode_instruction(&d)) {
+    }
+    free(d.tag_hashes);
+    return prog;
+}
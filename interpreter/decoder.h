@@ -0,0 +1,208 @@
+#ifndef __LAMA_DECODER__
+#define __LAMA_DECODER__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "externs.h"
+#include "interpreter.h"
+
+// Internal instruction set executed by the interpreter. Unlike on-disk bytecode
+// every location kind of LD/LDA/ST and every BINOP operator and PATT kind is a
+// separate opcode, so handlers never decode anything at run time.
+#define DECODED_OPCODES(op)                                                                       \
+    op(CONST) op(STRING) op(SEXP) op(STI) op(STA) op(JMP) op(END) op(RET) op(DROP) op(DUP)       \
+    op(SWAP) op(ELEM)                                                                             \
+    op(LD_GLOBAL) op(LD_LOCAL) op(LD_ARGUMENT) op(LD_CLOSURE)                                     \
+    op(LDA_GLOBAL) op(LDA_LOCAL) op(LDA_ARGUMENT) op(LDA_CLOSURE)                                 \
+    op(ST_GLOBAL) op(ST_LOCAL) op(ST_ARGUMENT) op(ST_CLOSURE)                                     \
+    op(CJMPZ) op(CJMPNZ) op(BEGIN) op(CBEGIN) op(CLOSURE) op(CALLC) op(CALL) op(TAG) op(ARRAY)   \
+    op(FAIL)                                                                                      \
+    op(PATT_STR) op(PATT_STRING) op(PATT_ARRAY) op(PATT_SEXP) op(PATT_REF) op(PATT_VAL)          \
+    op(PATT_CLOSURE)                                                                              \
+    op(READ) op(WRITE) op(LENGTH) op(TO_STRING) op(BARRAY) op(CALL_EXTERN)                       \
+    op(FIBER_SPAWN) op(FIBER_YIELD) op(FIBER_JOIN)                                                \
+    op(STOP)
+
+// Superinstructions produced by fuse_superinstructions and tail calls produced by
+// mark_tail_calls (see superinstructions.h), along with a FRAME_FRAME_<op> and a
+// FRAME_CONST_<op> opcode per binary operator
+#define FUSED_OPCODES(op)                                                                         \
+    op(DUP_CONST_ELEM) op(CONST_ELEM) op(DROP_DROP)                                               \
+    op(ST_GLOBAL_DROP) op(ST_LOCAL_DROP) op(ST_ARGUMENT_DROP) op(ST_CLOSURE_DROP)                 \
+    op(DUP_TAG_CJMPZ) op(DUP_TAG_CJMPNZ) op(DUP_ARRAY_CJMPZ) op(DUP_ARRAY_CJMPNZ)                 \
+    op(TAIL_CALL) op(TAIL_CALLC)
+
+// Quickened forms of instructions, which the interpreter rewrites an instruction
+// into once it has run it, listed along with the opcode they specialize (see
+// generic_opcode). The _ABS forms address a global directly; the _ARRAY and _SEXP
+// forms index an aggregate of the kind the first run has met without calling the
+// runtime, and turn back into the generic instruction for good on another kind.
+#define QUICKENED_OPCODES(op)                                                                     \
+    op(LD_GLOBAL_ABS, LD_GLOBAL) op(ST_GLOBAL_ABS, ST_GLOBAL)                                     \
+    op(ST_GLOBAL_DROP_ABS, ST_GLOBAL_DROP)                                                        \
+    op(ELEM_ARRAY, ELEM) op(ELEM_SEXP, ELEM) op(CONST_ELEM_ARRAY, CONST_ELEM)                     \
+    op(CONST_ELEM_SEXP, CONST_ELEM) op(DUP_CONST_ELEM_ARRAY, DUP_CONST_ELEM)                      \
+    op(DUP_CONST_ELEM_SEXP, DUP_CONST_ELEM) op(STA_ARRAY, STA) op(STA_SEXP, STA)
+
+// Register instructions produced by translate_to_registers (see registers.h),
+// along with a REG_<op> and a REG_CONST_<op> opcode per binary operator
+#define REGISTER_OPCODES(op)                                                                      \
+    op(REG_MOVE) op(REG_CONST) op(REG_LD_GLOBAL) op(REG_LD_CLOSURE) op(REG_ST_GLOBAL)            \
+    op(REG_ST_CLOSURE) op(REG_CJMPZ) op(REG_CJMPNZ) op(REG_SP)
+
+typedef enum {
+#define BINOP_OPCODE(n, op) OP_BINOP_##n,
+    BINOPS(BINOP_OPCODE)
+#undef BINOP_OPCODE
+#define DECODED_OPCODE(name) OP_##name,
+    DECODED_OPCODES(DECODED_OPCODE)
+    FUSED_OPCODES(DECODED_OPCODE)
+    REGISTER_OPCODES(DECODED_OPCODE)
+#undef DECODED_OPCODE
+#define QUICKENED_OPCODE(name, generic) OP_##name,
+    QUICKENED_OPCODES(QUICKENED_OPCODE)
+#undef QUICKENED_OPCODE
+#define REGISTER_BINOP_OPCODES(n, op) OP_REG_##n, OP_REG_CONST_##n,
+    BINOPS(REGISTER_BINOP_OPCODES)
+#undef REGISTER_BINOP_OPCODES
+#define FUSED_BINOP_OPCODES(n, op) OP_FRAME_FRAME_##n, OP_FRAME_CONST_##n,
+    BINOPS(FUSED_BINOP_OPCODES)
+#undef FUSED_BINOP_OPCODES
+// FRAME_FRAME_<op>, FRAME_CONST_<op>, REG_<op> and REG_CONST_<op> over locals
+// which only ever hold integers, which skip the tag test (see integers.h)
+#define INTEGER_BINOP_OPCODES(n, op) \
+    OP_INT_FRAME_FRAME_##n, OP_INT_FRAME_CONST_##n, OP_INT_REG_##n, OP_INT_REG_CONST_##n,
+    BINOPS(INTEGER_BINOP_OPCODES)
+#undef INTEGER_BINOP_OPCODES
+    OPCODES_NUMBER
+} decoded_opcode;
+
+typedef struct instruction instruction;
+
+typedef union {
+    int32_t n;
+    const char* string;
+    const instruction* target;
+    const extern_function* function;
+    int32_t* address;
+} operand;
+
+// Fixed-width, aligned instruction. Operands are stored ready to use:
+//  CONST                  a.n = boxed constant
+//  STRING                 a.string
+//  SEXP, TAG              a.n = boxed tag hash, b.n = number of fields (boxed for TAG)
+//  JMP, CJMPZ, CJMPNZ     a.target
+//  LD/LDA/ST_GLOBAL       a.n = index in the global area
+//  LD/LDA/ST_LOCAL,
+//  LD/LDA/ST_ARGUMENT     a.n = offset of the variable from fp
+//  LD/LDA/ST_CLOSURE      a.n = index in the closure contents, b.n = offset of the closure from fp
+//  BEGIN, CBEGIN          a.n = number of arguments, b.n = number of locals, c.n = bytecode offset
+//  CLOSURE                a.n = bytecode offset of the function, b.n = number of captured values;
+//                         followed by b.n LD_* instructions describing the captured variables
+//  CALL                   a.target = function entry, b.n = number of arguments
+//  CALLC                  a.n = number of arguments, c.target = entry called last (or NULL)
+//  ARRAY                  a.n = boxed array length
+//  FAIL                   a.n = line, b.n = column
+//  BARRAY                 a.n = number of elements
+//  CALL_EXTERN            a.function = runtime function, b.n = number of arguments
+//  FIBER_*                as CALL_EXTERN, see fibers.h
+// Superinstructions keep the operands of their components:
+//  DUP_CONST_ELEM,
+//  CONST_ELEM             a.n = boxed index
+//  ST_*_DROP              as ST_*
+//  DUP_TAG_CJMP*          a.n = boxed tag hash, b.n = boxed number of fields, c.target
+//  DUP_ARRAY_CJMP*        a.n = boxed array length, c.target
+//  TAIL_CALL, TAIL_CALLC  as CALL and CALLC
+// Quickened instructions keep the operands of their generic form:
+//  LD/ST_GLOBAL_ABS,
+//  ST_GLOBAL_DROP_ABS     b.address = address of the global
+//  ELEM, CONST_ELEM,
+//  DUP_CONST_ELEM, STA    c.n = 1 once the instruction is not quickened any more
+//  FRAME_FRAME_<op>       a.n, b.n = offsets of both operands from fp
+//  FRAME_CONST_<op>       a.n = offset of the left operand from fp, b.n = boxed constant
+// Register instructions name frame slots by their offsets from fp (registers):
+//  REG_MOVE               a.n = destination register, b.n = source register
+//  REG_CONST              a.n = destination register, b.n = boxed constant
+//  REG_LD_GLOBAL          a.n = destination register, b.n = index in the global area
+//  REG_LD_CLOSURE         a.n = destination register, b.n = index in the closure contents,
+//                         c.n = offset of the closure from fp
+//  REG_ST_GLOBAL          a.n = index in the global area, b.n = source register
+//  REG_ST_CLOSURE         a.n, b.n as LD_CLOSURE, c.n = source register
+//  REG_CJMPZ, REG_CJMPNZ  a.target, b.n = register of the condition
+//  REG_SP                 a.n = offset of the new stack pointer from fp
+//  REG_<op>               a.n = destination register, b.n, c.n = registers of the operands
+//  REG_CONST_<op>         a.n = destination register, b.n = register of the left operand,
+//                         c.n = boxed right operand
+// Integer forms keep the operands of the form they specialize:
+//  INT_FRAME_FRAME_<op>,
+//  INT_FRAME_CONST_<op>,
+//  INT_REG_<op>,
+//  INT_REG_CONST_<op>     as FRAME_FRAME_<op>, FRAME_CONST_<op>, REG_<op>, REG_CONST_<op>
+struct instruction {
+    // address of the handler in the direct-threaded engine, filled in by the engine itself
+    const void* handler;
+    int32_t opcode;
+    operand a;
+    operand b;
+    operand c;
+};
+
+typedef struct {
+    instruction* code;
+    size_t length;
+    // bytecode offset of every decoded instruction
+    int32_t* offsets;
+    // source line every decoded instruction belongs to, 0 if unknown (LINE markers
+    // carry no run-time semantics, so they are kept here instead of being executed)
+    int32_t* lines;
+    // index of the decoded instruction for every bytecode offset of an instruction start
+    int32_t* index_by_offset;
+    size_t code_size;
+} program;
+
+// Activation record of a function call, pushed and popped as a whole
+typedef struct {
+    // where END continues in the caller
+    const instruction* return_ip;
+    // frame pointer of the caller
+    int32_t* caller_fp;
+    // operand stack slot holding the closure the function has been called
+    // through, NULL for a plain CALL
+    int32_t* closure;
+    int32_t n_args;
+    int32_t n_locals;
+} call_frame;
+
+// Name of a decoded opcode as spelled in DECODED_OPCODES, e.g. "LD_LOCAL"
+const char* opcode_name(int32_t opcode);
+
+// The opcode a quickened instruction or an integer form has been rewritten from,
+// any other opcode as it is. Whatever reads instructions the interpreter may have
+// run goes through it.
+int32_t generic_opcode(int32_t opcode);
+
+// Number of values a decoded instruction pops and pushes, the way the compiler
+// counts them: DUP and ST_* only look at the topmost value and pop none. STA pops
+// two values if its destination is a reference made by LDA, three otherwise.
+// Only for the opcodes of DECODED_OPCODES, before any other pass has run.
+void stack_effect(const instruction* insn, bool sta_to_reference, int32_t* pops, int32_t* pushes);
+
+// Translates a verified bytecode image into the internal instruction format:
+// jump and call targets become instruction pointers, string operands become
+// C strings, tags become their hashes, variable locations become separate
+// opcodes with frame offsets.
+program* decode_bytefile(const bytefile* bf);
+
+static inline const instruction* instruction_at_offset(const program* p, int32_t offset) {
+    return p->code + p->index_by_offset[offset];
+}
+
+// Number of slots taken by an instruction: CLOSURE is followed by its
+// captured variable descriptors, which are data rather than code.
+static inline size_t instruction_width(const instruction* insn) {
+    return insn->opcode == OP_CLOSURE ? 1 + insn->b.n : 1;
+}
+
+#endif
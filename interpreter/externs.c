@@ -0,0 +1,47 @@
+#include "externs.h"
+
+#include <string.h>
+
+#include "../runtime/runtime_common.h"
+
+// The runtime does not declare its primitives in a header; they are all called
+// through a pointer to a function with unspecified parameters
+#define FUNCTION(name) extern int32_t name();
+#define PROCEDURE(name) extern int32_t name();
+#define FIBER(name, ...) extern int32_t name();
+#include "externs.def"
+#undef FUNCTION
+#undef PROCEDURE
+#undef FIBER
+
+static const extern_function externs[] = {
+#define FUNCTION(name) {#name, name, true, EXTERN_CALL, 0},
+#define PROCEDURE(name) {#name, name, false, EXTERN_CALL, 0},
+#define FIBER(name, kind, n_args) {#name, name, true, EXTERN_##kind, n_args},
+#include "externs.def"
+#undef FUNCTION
+#undef PROCEDURE
+#undef FIBER
+};
+
+const extern_function* resolve_extern(const char* name) {
+    for (size_t i = 0; i < sizeof(externs) / sizeof(externs[0]); i++) {
+        if (strcmp(externs[i].name, name) == 0) {
+            return &externs[i];
+        }
+    }
+    return NULL;
+}
+
+int32_t call_extern(const extern_function* f, const int32_t* sp, int32_t n_args) {
+    int32_t a[MAX_EXTERN_ARGS] = {0};
+    for (int32_t i = 0; i < n_args; i++) {
+        a[i] = sp[n_args - i];
+    }
+    // The runtime follows the cdecl convention: the caller pops the arguments,
+    // so the ones a function does not expect are harmless, and the variadic
+    // ones (Lsprintf, Lprintf, ...) find theirs where they look for them
+    int32_t result = f->function(a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7], a[8], a[9],
+                                 a[10], a[11], a[12], a[13], a[14], a[15]);
+    return f->has_result ? result : BOX(0);
+}
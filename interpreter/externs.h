@@ -0,0 +1,35 @@
+#ifndef __LAMA_EXTERNS__
+#define __LAMA_EXTERNS__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Largest number of arguments a call of a runtime function may pass
+#define MAX_EXTERN_ARGS 16
+
+// What a call of a runtime function does: calls the C function, unless the
+// interpreter implements it itself, as the fiber primitives it decodes into
+// FIBER_SPAWN, FIBER_YIELD and FIBER_JOIN
+typedef enum { EXTERN_CALL, EXTERN_SPAWN, EXTERN_YIELD, EXTERN_JOIN } extern_kind;
+
+// Foreign call table: the primitives of the runtime listed in externs.def that
+// bytecode calls by name with CALL_EXTERN, resolved once at decoding time.
+typedef struct {
+    const char* name;
+    int32_t (*function)();
+    // Procedures leave no meaningful value, an empty one is pushed instead
+    bool has_result;
+    extern_kind kind;
+    // the number of arguments the interpreter's own implementation takes
+    int32_t n_args;
+} extern_function;
+
+// Returns the runtime function called `name` (e.g. "Lhash"), NULL if unknown
+const extern_function* resolve_extern(const char* name);
+
+// Calls `f` with the `n_args` topmost stack values, the deepest one being the
+// first argument, and returns its result. The values are left on the stack, so
+// the GC sees them during the call.
+int32_t call_extern(const extern_function* f, const int32_t* sp, int32_t n_args);
+
+#endif
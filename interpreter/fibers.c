@@ -0,0 +1,217 @@
+#include "fibers.h"
+
+#include <stdlib.h>
+
+#include "../runtime/gc.h"
+#include "../runtime/runtime.h"
+#include "../runtime/runtime_common.h"
+#include "stacks.h"
+
+extern _Thread_local size_t __gc_stack_top;
+extern _Thread_local size_t __gc_stack_bottom;
+
+size_t fiber_stack_size = DEFAULT_FIBER_STACK_SIZE;
+
+typedef enum { RUNNABLE, RUNNING, WAITING, FINISHED } fiber_status;
+
+typedef struct {
+    // saved while the fiber is not running
+    fiber_registers registers;
+    fiber_status status;
+    // the end of the roots of its operand stack
+    int32_t* stack_bottom;
+    // as reserved, NULL for the main fiber
+    int32_t* stack;
+    int32_t result;
+    // the next fiber in the run queue or among the ones joining the same fiber
+    int32_t next;
+    // the first of the fibers waiting for this one to return
+    int32_t joiners;
+} fiber;
+
+typedef struct {
+    int32_t* stack;
+    call_frame* frames;
+} fiber_stacks;
+
+#define NO_FIBER (-1)
+
+// Fibers belong to the machine of the thread; fibers[0] is the main one, made
+// along with the first other one. Ids are indices and stay valid once the
+// fiber has returned, so that it can still be joined.
+static _Thread_local fiber* fibers;
+static _Thread_local int32_t fibers_count;
+static _Thread_local int32_t fibers_capacity;
+static _Thread_local int32_t running;
+static _Thread_local int32_t queue_head = NO_FIBER, queue_tail = NO_FIBER;
+
+// Stacks of returned fibers, reused by the next ones
+static _Thread_local fiber_stacks* free_stacks;
+static _Thread_local int32_t free_stacks_count;
+static _Thread_local int32_t free_stacks_capacity;
+
+static size_t frames_capacity(void) { return fiber_stack_size / (4 * sizeof(int32_t)); }
+
+static void* grow(void* array, int32_t* capacity, size_t element_size) {
+    *capacity = *capacity == 0 ? 16 : 2 * *capacity;
+    array = realloc(array, *capacity * element_size);
+    if (!array) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    return array;
+}
+
+static fiber_stacks take_stacks(void) {
+    if (free_stacks_count > 0) {
+        return free_stacks[--free_stacks_count];
+    }
+    return (fiber_stacks){
+        .stack = reserve_stack(fiber_stack_size, true, "ERROR: fiber operands stack overflow\n"),
+        .frames = reserve_stack(frames_capacity() * sizeof(call_frame), false, "ERROR: fiber call stack overflow\n"),
+    };
+}
+
+static void drop_stacks(fiber* f) {
+    if (free_stacks_count == free_stacks_capacity) {
+        free_stacks = grow(free_stacks, &free_stacks_capacity, sizeof(fiber_stacks));
+    }
+    free_stacks[free_stacks_count++] = (fiber_stacks){.stack = f->stack, .frames = f->registers.frames};
+    f->stack = NULL;
+}
+
+static void enqueue(int32_t id) {
+    fibers[id].status = RUNNABLE;
+    fibers[id].next = NO_FIBER;
+    if (queue_tail == NO_FIBER) {
+        queue_head = id;
+    } else {
+        fibers[queue_tail].next = id;
+    }
+    queue_tail = id;
+}
+
+// Makes the fiber at the head of the run queue the running one
+static void resume_next(fiber_registers* r) {
+    int32_t id = queue_head;
+    if (id == NO_FIBER) {
+        failure("ERROR: deadlock, every fiber waits for another one to return.\n");
+    }
+    queue_head = fibers[id].next;
+    if (queue_head == NO_FIBER) {
+        queue_tail = NO_FIBER;
+    }
+    running = id;
+    fibers[id].status = RUNNING;
+    *r = fibers[id].registers;
+    __gc_stack_top = (size_t)r->sp;
+    __gc_stack_bottom = (size_t)fibers[id].stack_bottom;
+}
+
+// The roots of the fibers but the running one, whose stack is the one of the machine
+static void visit_fibers(stack_visitor visit, void* context) {
+    for (int32_t i = 0; i < fibers_count; i++) {
+        fiber* f = &fibers[i];
+        if (f->status == FINISHED) {
+            visit(context, (size_t*)&f->result, (size_t*)&f->result + 1);
+        } else if (i != running) {
+            visit(context, (size_t*)f->registers.sp + 1, (size_t*)f->stack_bottom);
+        }
+    }
+}
+
+int32_t spawn_fiber(int32_t closure, const instruction* entry) {
+    if (entry->a.n != 0) {
+        failure("ERROR: spawn expects a function of no arguments.\n");
+    }
+    // room for the new fiber, and for the main one along with the first
+    if (fibers_count + 2 > fibers_capacity) {
+        fibers = grow(fibers, &fibers_capacity, sizeof(fiber));
+    }
+    if (fibers_count == 0) {
+        fibers[0] = (fiber){.status = RUNNING, .stack_bottom = (int32_t*)__gc_stack_bottom, .joiners = NO_FIBER};
+        fibers_count = 1;
+        running = 0;
+        __gc_extra_stacks = visit_fibers;
+    }
+
+    // the function is entered as if by a CALLC from an empty stack, which the
+    // closure is the only value of
+    fiber_stacks stacks = take_stacks();
+    int32_t* bottom = stacks.stack + fiber_stack_size / sizeof(int32_t);
+    bottom[-1] = closure;
+    stacks.frames[0] = (call_frame){.return_ip = NULL, .caller_fp = NULL, .closure = &bottom[-1]};
+
+    int32_t id = fibers_count++;
+    fibers[id] = (fiber){
+        .registers = {.ip = entry, .sp = bottom - 2, .fp = NULL, .frame = stacks.frames,
+                      .frames = stacks.frames, .stack_empty = bottom - 1},
+        .stack_bottom = bottom,
+        .stack = stacks.stack,
+        .joiners = NO_FIBER,
+    };
+    enqueue(id);
+    return BOX(id);
+}
+
+void yield_fiber(fiber_registers* r) {
+    if (queue_head == NO_FIBER) {
+        return;
+    }
+    fibers[running].registers = *r;
+    enqueue(running);
+    resume_next(r);
+}
+
+bool join_fiber(int32_t id, fiber_registers* r, int32_t* result) {
+    if (!UNBOXED(id) || UNBOX(id) < 0 || UNBOX(id) >= fibers_count) {
+        failure("ERROR: join of an unknown fiber.\n");
+    }
+    fiber* f = &fibers[UNBOX(id)];
+    if (f->status == FINISHED) {
+        *result = f->result;
+        return true;
+    }
+    if (UNBOX(id) == running) {
+        failure("ERROR: a fiber cannot join itself.\n");
+    }
+
+    fiber* joiner = &fibers[running];
+    joiner->registers = *r;
+    joiner->status = WAITING;
+    joiner->next = f->joiners;
+    f->joiners = running;
+    resume_next(r);
+    return false;
+}
+
+void finish_fiber(int32_t result, fiber_registers* r) {
+    fiber* f = &fibers[running];
+    f->status = FINISHED;
+    f->result = result;
+    for (int32_t id = f->joiners, next; id != NO_FIBER; id = next) {
+        next = fibers[id].next;
+        *fibers[id].registers.sp-- = result;
+        enqueue(id);
+    }
+    f->joiners = NO_FIBER;
+    drop_stacks(f);
+    resume_next(r);
+}
+
+void reset_fibers(void) {
+    if (fibers_count == 0) {
+        return;
+    }
+    for (int32_t i = 1; i < fibers_count; i++) {
+        if (fibers[i].stack != NULL) {
+            drop_stacks(&fibers[i]);
+        }
+    }
+    __gc_stack_bottom = (size_t)fibers[0].stack_bottom;
+    __gc_extra_stacks = NULL;
+    fibers_count = 0;
+    running = 0;
+    queue_head = queue_tail = NO_FIBER;
+}
+
+bool fibers_spawned(void) { return fibers_count > 0; }
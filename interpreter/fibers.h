@@ -0,0 +1,61 @@
+#ifndef __LAMA_FIBERS__
+#define __LAMA_FIBERS__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+
+// Cooperative fibers. `spawn (f)` makes a fiber calling the function of no
+// arguments f and returns its id, `yield ()` lets the other fibers run,
+// `join (fiber)` waits for a fiber to return and gives its result. Every fiber
+// has an operand stack and a call stack of its own, the main function runs on
+// the ones of the machine; the fibers of a machine take turns in the order of
+// a run queue, switching at `yield` and at `join` of a fiber which has not
+// returned yet only. The program ends when its main function returns, whatever
+// the other fibers are doing.
+
+#define DEFAULT_FIBER_STACK_SIZE (256 << 10)
+
+// Size of the operand stack of every fiber but the main one
+extern size_t fiber_stack_size;
+
+// Machine registers of a fiber
+typedef struct {
+    const instruction* ip;
+    int32_t* sp;
+    int32_t* fp;
+    call_frame* frame;
+    // the record of the first function of the fiber and the first free slot of
+    // its empty operand stack
+    call_frame* frames;
+    int32_t* stack_empty;
+} fiber_registers;
+
+// Makes a runnable fiber calling `closure`, whose function starts at `entry`,
+// and returns its boxed id. The running fiber goes on.
+int32_t spawn_fiber(int32_t closure, const instruction* entry);
+
+// Suspends the running fiber, whose registers are `r`, at the end of the run
+// queue and replaces `r` by the registers of the fiber at its head
+void yield_fiber(fiber_registers* r);
+
+// If `fiber` has returned, sets `*result` to its result and returns true.
+// Otherwise suspends the running fiber until then, its result is pushed on the
+// stack of the running fiber then, and replaces `r` by the registers of the next
+// fiber to run; fails if no fiber is left to run.
+bool join_fiber(int32_t fiber, fiber_registers* r, int32_t* result);
+
+// Ends the running fiber (not the main one) with `result`, resumes the fibers
+// which have joined it and replaces `r` by the registers of the next fiber to run
+void finish_fiber(int32_t result, fiber_registers* r);
+
+// Drops all the fibers but the main one, which becomes the running one, for
+// the program to be run once more
+void reset_fibers(void);
+
+// Whether the program has spawned fibers
+bool fibers_spawned(void);
+
+#endif
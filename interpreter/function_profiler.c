@@ -0,0 +1,317 @@
+#include "function_profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../runtime/runtime.h"
+#include "profiler.h"
+
+// Calling contexts deeper than this are merged into their ancestor at this
+// depth, which keeps deep recursion from blowing up the folded stacks
+#define MAX_CONTEXT_DEPTH 256
+
+typedef struct {
+    int32_t offset;
+    const char* name;
+    uint64_t calls;
+    uint64_t inclusive;
+    uint64_t exclusive;
+    // activations on the shadow stack, inclusive time is only counted for the
+    // outermost one of a recursive function
+    int32_t active;
+} function_stats;
+
+// Node of the calling context tree, node 0 is the root above the main function
+typedef struct {
+    int32_t function;
+    int32_t parent;
+    int32_t first_child;
+    int32_t next_sibling;
+    int32_t depth;
+    uint64_t self;
+} context_node;
+
+typedef struct {
+    int32_t function;
+    int32_t node;
+    uint64_t start;
+    // time spent in the callees
+    uint64_t children;
+} activation;
+
+typedef struct {
+    int32_t caller;
+    int32_t callee;
+    uint64_t calls;
+    uint64_t time;
+} call_edge;
+
+bool function_profiler_enabled = false;
+
+static const char* folded_path;
+static size_t top_n;
+
+static function_stats* functions;
+static size_t functions_count;
+// function index for every instruction index, -1 for non-BEGIN instructions
+static int32_t* function_by_insn;
+
+static context_node* nodes;
+static size_t nodes_count, nodes_capacity;
+
+static activation* activations;
+static size_t activations_count, activations_capacity;
+
+// open addressing hash table of caller/callee edges, empty slots have calls == 0
+static call_edge* edges;
+static size_t edges_capacity, edges_count;
+
+static void* grow(void* array, size_t* capacity, size_t element_size) {
+    *capacity = *capacity ? *capacity * 2 : 1024;
+    array = realloc(array, *capacity * element_size);
+    if (!array) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    return array;
+}
+
+static int32_t add_node(int32_t function, int32_t parent) {
+    if (nodes_count == nodes_capacity) {
+        nodes = grow(nodes, &nodes_capacity, sizeof(context_node));
+    }
+    context_node* node = &nodes[nodes_count];
+    *node = (context_node){.function = function, .parent = parent, .first_child = -1, .next_sibling = -1};
+    if (parent >= 0) {
+        node->depth = nodes[parent].depth + 1;
+        node->next_sibling = nodes[parent].first_child;
+        nodes[parent].first_child = nodes_count;
+    }
+    return nodes_count++;
+}
+
+static int32_t child_node(int32_t parent, int32_t function) {
+    if (nodes[parent].depth >= MAX_CONTEXT_DEPTH) {
+        return parent;
+    }
+    for (int32_t child = nodes[parent].first_child; child >= 0; child = nodes[child].next_sibling) {
+        if (nodes[child].function == function) {
+            return child;
+        }
+    }
+    return add_node(function, parent);
+}
+
+static size_t edge_slot(call_edge* table, size_t capacity, int32_t caller, int32_t callee) {
+    size_t slot = ((size_t)caller * 31 + (size_t)callee) & (capacity - 1);
+    while (table[slot].calls && (table[slot].caller != caller || table[slot].callee != callee)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+static call_edge* find_edge(int32_t caller, int32_t callee) {
+    if (2 * (edges_count + 1) > edges_capacity) {
+        size_t capacity = edges_capacity ? edges_capacity * 2 : 256;
+        call_edge* table = calloc(capacity, sizeof(call_edge));
+        if (!table) {
+            failure("ERROR: unable to allocate memory.\n");
+        }
+        for (size_t i = 0; i < edges_capacity; i++) {
+            if (edges[i].calls) {
+                table[edge_slot(table, capacity, edges[i].caller, edges[i].callee)] = edges[i];
+            }
+        }
+        free(edges);
+        edges = table;
+        edges_capacity = capacity;
+    }
+    call_edge* edge = &edges[edge_slot(edges, edges_capacity, caller, callee)];
+    if (!edge->calls) {
+        *edge = (call_edge){.caller = caller, .callee = callee};
+        edges_count++;
+    }
+    return edge;
+}
+
+void profile_function_entry(size_t insn_index) {
+    int32_t function = function_by_insn[insn_index];
+    int32_t parent = activations_count ? activations[activations_count - 1].node : 0;
+
+    if (activations_count == activations_capacity) {
+        activations = grow(activations, &activations_capacity, sizeof(activation));
+    }
+    if (activations_count) {
+        find_edge(activations[activations_count - 1].function, function)->calls++;
+    }
+    functions[function].calls++;
+    functions[function].active++;
+    activations[activations_count++] =
+        (activation){.function = function, .node = child_node(parent, function), .start = read_cycles()};
+}
+
+void profile_function_exit(void) {
+    uint64_t now = read_cycles();
+    activation* a = &activations[--activations_count];
+    function_stats* f = &functions[a->function];
+    uint64_t elapsed = now - a->start;
+    uint64_t self = elapsed - a->children;
+
+    nodes[a->node].self += self;
+    f->exclusive += self;
+    if (--f->active == 0) {
+        f->inclusive += elapsed;
+    }
+    if (activations_count) {
+        activation* caller = &activations[activations_count - 1];
+        caller->children += elapsed;
+        find_edge(caller->function, a->function)->time += elapsed;
+    }
+}
+
+static void print_function_name(FILE* f, int32_t function) {
+    if (functions[function].name) {
+        fprintf(f, "%s", functions[function].name);
+    } else {
+        fprintf(f, "L%d", functions[function].offset);
+    }
+}
+
+static void write_folded_stacks(void) {
+    FILE* f = fopen(folded_path, "w");
+    int32_t* path = malloc((MAX_CONTEXT_DEPTH + 1) * sizeof(int32_t));
+
+    if (!f || !path) {
+        fprintf(stderr, "ERROR: unable to write folded stacks to %s\n", folded_path);
+        if (f) {
+            fclose(f);
+        }
+        free(path);
+        return;
+    }
+    for (size_t i = 1; i < nodes_count; i++) {
+        if (!nodes[i].self) {
+            continue;
+        }
+        int32_t depth = 0;
+        for (int32_t node = i; node > 0; node = nodes[node].parent) {
+            path[depth++] = nodes[node].function;
+        }
+        for (int32_t k = depth - 1; k >= 0; k--) {
+            print_function_name(f, path[k]);
+            fputc(k ? ';' : ' ', f);
+        }
+        fprintf(f, "%llu\n", (unsigned long long)nodes[i].self);
+    }
+    free(path);
+    fclose(f);
+}
+
+static int compare_functions(const void* x, const void* y) {
+    const function_stats *a = &functions[*(const int32_t*)x], *b = &functions[*(const int32_t*)y];
+    if (a->exclusive != b->exclusive) {
+        return a->exclusive < b->exclusive ? 1 : -1;
+    }
+    return (a->calls < b->calls) - (a->calls > b->calls);
+}
+
+static int compare_edges(const void* x, const void* y) {
+    const call_edge *a = x, *b = y;
+    if (a->time != b->time) {
+        return a->time < b->time ? 1 : -1;
+    }
+    return (a->calls < b->calls) - (a->calls > b->calls);
+}
+
+static double percent(uint64_t part, uint64_t total) { return total ? 100.0 * part / total : 0.0; }
+
+static void print_summary(void) {
+    int32_t* order = malloc((functions_count + 1) * sizeof(int32_t));
+    call_edge* sorted_edges = malloc((edges_count + 1) * sizeof(call_edge));
+    uint64_t total = 0;
+    size_t n = 0;
+
+    if (!order || !sorted_edges) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    for (size_t i = 0; i < functions_count; i++) {
+        total += functions[i].exclusive;
+        if (functions[i].calls) {
+            order[n++] = i;
+        }
+    }
+    qsort(order, n, sizeof(int32_t), compare_functions);
+
+    fprintf(stderr, "%-32s %12s %16s %8s %16s %8s\n", "function", "calls", "inclusive", "%", "exclusive", "%");
+    for (size_t i = 0; i < n && i < top_n; i++) {
+        const function_stats* s = &functions[order[i]];
+        char name[32];
+        if (s->name) {
+            snprintf(name, sizeof(name), "%s", s->name);
+        } else {
+            snprintf(name, sizeof(name), "L%d", s->offset);
+        }
+        fprintf(stderr, "%-32s %12llu %16llu %8.2f %16llu %8.2f\n", name, (unsigned long long)s->calls,
+                (unsigned long long)s->inclusive, percent(s->inclusive, total), (unsigned long long)s->exclusive,
+                percent(s->exclusive, total));
+    }
+
+    size_t m = 0;
+    for (size_t i = 0; i < edges_capacity; i++) {
+        if (edges[i].calls) {
+            sorted_edges[m++] = edges[i];
+        }
+    }
+    qsort(sorted_edges, m, sizeof(call_edge), compare_edges);
+
+    fprintf(stderr, "\ncall edges:\n");
+    for (size_t i = 0; i < m && i < top_n; i++) {
+        fprintf(stderr, "  ");
+        print_function_name(stderr, sorted_edges[i].caller);
+        fprintf(stderr, " -> ");
+        print_function_name(stderr, sorted_edges[i].callee);
+        fprintf(stderr, ": %llu calls, %llu cycles\n", (unsigned long long)sorted_edges[i].calls,
+                (unsigned long long)sorted_edges[i].time);
+    }
+    free(order);
+    free(sorted_edges);
+}
+
+static void write_report(void) {
+    // the program may stop inside any number of functions, e.g. through failure()
+    while (activations_count) {
+        profile_function_exit();
+    }
+    print_summary();
+    write_folded_stacks();
+}
+
+void start_function_profiler(const bytefile* bf, const program* p, const char* path, size_t top) {
+    function_by_insn = malloc(p->length * sizeof(int32_t));
+    functions = malloc((p->length + 1) * sizeof(function_stats));
+    if (!function_by_insn || !functions) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+
+    for (size_t i = 0; i < p->length; i++) {
+        function_by_insn[i] = -1;
+    }
+    for (size_t i = 0; i < p->length; i += instruction_width(&p->code[i])) {
+        if (p->code[i].opcode == OP_BEGIN || p->code[i].opcode == OP_CBEGIN) {
+            function_by_insn[i] = functions_count;
+            functions[functions_count++] = (function_stats){.offset = p->offsets[i]};
+        }
+    }
+    for (unsigned int i = 0; i < bf->public_symbols_number; i++) {
+        int32_t function = function_by_insn[p->index_by_offset[bf->public_ptr[2 * i + 1]]];
+        if (function >= 0) {
+            functions[function].name = &bf->string_ptr[bf->public_ptr[2 * i]];
+        }
+    }
+
+    add_node(-1, -1);
+    folded_path = path;
+    top_n = top;
+    function_profiler_enabled = true;
+    atexit(write_report);
+}
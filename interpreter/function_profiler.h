@@ -0,0 +1,26 @@
+#ifndef __LAMA_FUNCTION_PROFILER__
+#define __LAMA_FUNCTION_PROFILER__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+#include "interpreter.h"
+
+extern bool function_profiler_enabled;
+
+// Enables the function profiler for the given program. Functions are told
+// apart by their BEGIN/CBEGIN instructions and named after the public symbols
+// pointing to them, or L<offset> otherwise. At exit a summary of the `top`
+// hottest functions and call edges is printed to stderr and the folded stacks
+// (the input of flame graph scripts) are written to `folded_path`.
+void start_function_profiler(const bytefile* bf, const program* p, const char* folded_path, size_t top);
+
+// Called on every BEGIN/CBEGIN with the index of the instruction
+void profile_function_entry(size_t insn_index);
+
+// Called on every END and before every tail call, which leaves the caller for good
+void profile_function_exit(void);
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE 1
+
+#include "instances.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../runtime/runtime.h"
+#include "server.h"
+
+#define INPUT_CHUNK 4096
+
+typedef struct {
+    char* input;
+    size_t input_length;
+    int status;
+    char* output;
+    size_t output_length;
+    char* errors;
+    size_t errors_length;
+} outcome;
+
+// The instances are handed out to the threads in order through `next`
+static struct {
+    void (*init_thread)(void);
+    void (*run_instance)(void);
+    // the input all the instances share, if they have none of their own
+    char* input;
+    outcome* outcomes;
+    size_t instances;
+    size_t next;
+} pool;
+
+static _Thread_local sigjmp_buf instance_failed;
+
+// A failure of the program (possibly reported from the stack overflow handler,
+// hence the signal mask saved along) abandons the instance, not the process
+static void abandon_instance(void) {
+    siglongjmp(instance_failed, 1);
+}
+
+// Reads the whole standard input into a buffer the caller frees
+static char* read_input(size_t* length) {
+    size_t capacity = INPUT_CHUNK;
+    // fmemopen wants a buffer even for an empty input
+    char* input = malloc(capacity);
+    *length = 0;
+    while (input != NULL) {
+        *length += fread(input + *length, 1, capacity - *length, stdin);
+        if (*length < capacity) {
+            return input;
+        }
+        capacity *= 2;
+        input = realloc(input, capacity);
+    }
+    failure("ERROR: no memory for the standard input of the instances.\n");
+    return NULL;
+}
+
+static void run_instance(outcome* o) {
+    program_stdin = fmemopen(o->input, o->input_length, "r");
+    program_stdout = open_memstream(&o->output, &o->output_length);
+    program_stderr = open_memstream(&o->errors, &o->errors_length);
+    if (program_stdin == NULL || program_stdout == NULL || program_stderr == NULL) {
+        program_stdin = program_stdout = program_stderr = NULL;
+        failure("ERROR: cannot set up the streams of an instance: %s.\n", strerror(errno));
+    }
+
+    failure_hook = abandon_instance;
+    if (sigsetjmp(instance_failed, 1) == 0) {
+        pool.run_instance();
+    } else {
+        o->status = 255;
+    }
+    failure_hook = NULL;
+
+    fclose(program_stdin);
+    fclose(program_stdout);
+    fclose(program_stderr);
+    program_stdin = program_stdout = program_stderr = NULL;
+}
+
+static void* work(void* spawned) {
+    if (spawned != NULL) {
+        pool.init_thread();
+    }
+    size_t i;
+    while ((i = __atomic_fetch_add(&pool.next, 1, __ATOMIC_RELAXED)) < pool.instances) {
+        run_instance(&pool.outcomes[i]);
+    }
+    return NULL;
+}
+
+int run_instances(size_t instances, size_t threads, bool own_inputs, void (*init_thread)(void),
+                  void (*run_instance)(void)) {
+    if (threads == 0) {
+        failure("ERROR: instances need at least one thread.\n");
+    }
+    if (threads > instances) {
+        threads = instances;
+    }
+    pool.init_thread = init_thread;
+    pool.run_instance = run_instance;
+    pool.outcomes = calloc(instances, sizeof(outcome));
+    pool.instances = instances;
+    pool.next = 0;
+    pthread_t* workers = calloc(threads, sizeof(pthread_t));
+    if (pool.outcomes == NULL || workers == NULL) {
+        failure("ERROR: no memory for %zu instances.\n", instances);
+    }
+    if (own_inputs) {
+        pool.input = NULL;
+        for (size_t i = 0; i < instances; i++) {
+            outcome* o = &pool.outcomes[i];
+            if (!read_job(stdin, &o->input, &o->input_length)) {
+                failure("ERROR: the standard input holds %zu inputs for %zu instances.\n", i, instances);
+            }
+        }
+    } else {
+        size_t length;
+        pool.input = read_input(&length);
+        for (size_t i = 0; i < instances; i++) {
+            pool.outcomes[i].input = pool.input;
+            pool.outcomes[i].input_length = length;
+        }
+    }
+
+    for (size_t i = 1; i < threads; i++) {
+        int error = pthread_create(&workers[i], NULL, work, &pool);
+        if (error != 0) {
+            failure("ERROR: cannot start a thread: %s.\n", strerror(error));
+        }
+    }
+    work(NULL);
+    for (size_t i = 1; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < instances; i++) {
+        outcome* o = &pool.outcomes[i];
+        fwrite(o->output, 1, o->output_length, stdout);
+        fflush(stdout);
+        fwrite(o->errors, 1, o->errors_length, stderr);
+        if (o->status != 0) {
+            status = o->status;
+        }
+        free(o->output);
+        free(o->errors);
+        if (own_inputs) {
+            free(o->input);
+        }
+    }
+    free(workers);
+    free(pool.outcomes);
+    free(pool.input);
+    return status;
+}
@@ -0,0 +1,22 @@
+#ifndef __LAMA_INSTANCES__
+#define __LAMA_INSTANCES__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Instance mode: the program is loaded once and run as many independent
+// instances on a pool of threads, each of which has a machine and a heap of its
+// own. Every instance reads a copy of the standard input of the process, or with
+// `own_inputs` an input of its own, framed as a job of the batch mode (see
+// server.h); what it writes is buffered and, once all the instances are over,
+// written to the standard output and error of the process in the order of the
+// instances.
+
+// Runs `run_instance` `instances` times on `threads` threads, the calling one
+// included; `init_thread` sets up every other thread before its first
+// instance. Returns 255 (the exit code of a failed interpreter) if an instance
+// has failed, 0 otherwise.
+int run_instances(size_t instances, size_t threads, bool own_inputs, void (*init_thread)(void),
+                  void (*run_instance)(void));
+
+#endif
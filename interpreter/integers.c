@@ -0,0 +1,146 @@
+#include "integers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../runtime/runtime.h"
+#include "superinstructions.h"
+
+typedef struct {
+    instruction* code;
+    const uint8_t* leaders;
+    int32_t n_locals;
+    // per local, indexed by its negated offset from fp: whether it is still
+    // believed to hold integers only
+    bool* integer;
+} function;
+
+static bool is_local(const function* f, int32_t offset) {
+    return offset <= 0 && offset > -f->n_locals;
+}
+
+static bool holds_integer(const function* f, int32_t offset) {
+    return is_local(f, offset) && f->integer[-offset];
+}
+
+// Records that a local may hold anything; true if it was believed not to
+static bool forget(function* f, int32_t offset) {
+    if (!holds_integer(f, offset)) {
+        return false;
+    }
+    f->integer[-offset] = false;
+    return true;
+}
+
+// Opcodes of instructions computing an integer, whatever their operands: binary
+// operators fail on anything but integers, and comparisons give booleans
+static bool computes_integer(int32_t opcode) {
+    return (opcode >= OP_BINOP_PLUS && opcode <= OP_BINOP_OR) || opcode >= OP_REG_PLUS;
+}
+
+// Runs through the function once, following whether the topmost stack value is
+// an integer within every block; true if a local has lost its proof
+static bool scan(function* f, size_t begin, size_t end) {
+    bool changed = false;
+    bool top = false;
+    for (size_t i = begin; i < end; i += fused_width(&f->code[i])) {
+        const instruction* insn = &f->code[i];
+        if (f->leaders[i]) {
+            top = false;
+        }
+        if (computes_integer(insn->opcode)) {
+            // REG_<op> and REG_CONST_<op> write their result to a.n, the others push it
+            top = insn->opcode < OP_REG_PLUS || insn->opcode >= OP_FRAME_FRAME_PLUS;
+            continue;
+        }
+        switch (insn->opcode) {
+            case OP_CONST:
+                top = true;
+                break;
+            case OP_LD_LOCAL:
+                top = holds_integer(f, insn->a.n);
+                break;
+            case OP_DUP:
+            case OP_ST_GLOBAL:
+            case OP_ST_ARGUMENT:
+            case OP_ST_CLOSURE:
+                break;
+            case OP_ST_LOCAL:
+            case OP_ST_LOCAL_DROP:
+                if (!top) {
+                    changed |= forget(f, insn->a.n);
+                }
+                if (insn->opcode == OP_ST_LOCAL_DROP) {
+                    top = false;
+                }
+                break;
+            case OP_LDA_LOCAL:
+                changed |= forget(f, insn->a.n);
+                top = false;
+                break;
+            case OP_REG_MOVE:
+                if (!holds_integer(f, insn->b.n)) {
+                    changed |= forget(f, insn->a.n);
+                }
+                top = false;
+                break;
+            case OP_REG_LD_GLOBAL:
+            case OP_REG_LD_CLOSURE:
+                changed |= forget(f, insn->a.n);
+                top = false;
+                break;
+            default:
+                // REG_CONST stores a constant; nothing else writes a local
+                top = false;
+        }
+    }
+    return changed;
+}
+
+static void specialize(function* f, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i += fused_width(&f->code[i])) {
+        instruction* insn = &f->code[i];
+        int32_t opcode = insn->opcode;
+        if (opcode >= OP_FRAME_FRAME_PLUS && opcode < OP_INT_FRAME_FRAME_PLUS) {
+            // FRAME_FRAME_<op> and FRAME_CONST_<op> alternate, see decoded_opcode
+            int32_t operator_code = (opcode - OP_FRAME_FRAME_PLUS) / 2;
+            bool constant = (opcode - OP_FRAME_FRAME_PLUS) % 2;
+            if (holds_integer(f, insn->a.n) && (constant || holds_integer(f, insn->b.n))) {
+                insn->opcode = OP_INT_FRAME_FRAME_PLUS + 4 * operator_code + constant;
+            }
+        } else if (opcode >= OP_REG_PLUS && opcode < OP_FRAME_FRAME_PLUS) {
+            int32_t operator_code = (opcode - OP_REG_PLUS) / 2;
+            bool constant = (opcode - OP_REG_PLUS) % 2;
+            if (holds_integer(f, insn->b.n) && (constant || holds_integer(f, insn->c.n))) {
+                insn->opcode = OP_INT_REG_PLUS + 4 * operator_code + constant;
+            }
+        }
+    }
+}
+
+void specialize_integer_operators(program* p) {
+    uint8_t* leaders = find_block_leaders(p);
+    function f = {.code = p->code, .leaders = leaders};
+
+    // a function runs from its BEGIN to the next one
+    for (size_t begin = 0, end; begin < p->length; begin = end) {
+        end = begin + fused_width(&p->code[begin]);
+        while (end < p->length && p->code[end].opcode != OP_BEGIN && p->code[end].opcode != OP_CBEGIN) {
+            end += fused_width(&p->code[end]);
+        }
+        f.n_locals = p->code[begin].b.n;
+        f.integer = malloc(f.n_locals + 1);
+        if (!f.integer) {
+            failure("ERROR: unable to allocate memory.\n");
+        }
+        for (int32_t k = 0; k < f.n_locals; k++) {
+            f.integer[k] = true;
+        }
+        while (scan(&f, begin, end)) {
+        }
+        specialize(&f, begin, end);
+        free(f.integer);
+    }
+    free(leaders);
+}
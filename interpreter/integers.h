@@ -0,0 +1,18 @@
+#ifndef __LAMA_INTEGERS__
+#define __LAMA_INTEGERS__
+
+#include "decoder.h"
+
+// Finds the locals of every function which only ever hold integers and rewrites
+// the binary operators over them into integer forms (see INTEGER_BINOP_OPCODES),
+// which skip the tag test of their operands.
+//
+// Locals start as boxed zeroes. A local keeps integers only if every store to it
+// stores a constant, the result of a binary operator (which fails on anything
+// but integers, or compares) or another such local, all of it within the basic
+// block of the store, and if no LDA takes a reference to it. Arguments, globals
+// and captured variables are never proven, as their stores are out of sight.
+// Runs on the final code, after the register translation and the fusion.
+void specialize_integer_operators(program* p);
+
+#endif
@@ -1,185 +1,194 @@
+#include <getopt.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <unistd.h>
 
 #include "../runtime/gc.h"
 #include "../runtime/runtime.h"
 #include "../runtime/runtime_common.h"
+#include "checkpoint.h"
+#include "decoder.h"
+#include "fibers.h"
+#include "function_profiler.h"
+#include "instances.h"
+#include "integers.h"
 #include "interpreter.h"
-
-static const uint8_t* eof;
+#include "jit.h"
+#include "loader.h"
+#include "profiler.h"
+#include "registers.h"
+#include "sampling_profiler.h"
+#include "server.h"
+#include "stacks.h"
+#include "superinstructions.h"
+#include "verifier.h"
+
+// Labels-as-values are a GNU extension; other compilers get the switch engine.
+#if defined(__GNUC__) && !defined(LAMA_SWITCH_DISPATCH)
+#  define THREADED_DISPATCH
+#endif
+
+// Every image is verified at load time, so the per-instruction checks below are
+// redundant and compiled out unless the interpreter is built with LAMA_RUNTIME_CHECKS.
+#ifdef LAMA_RUNTIME_CHECKS
+#  define RUNTIME_CHECK(condition, ...) \
+      do {                              \
+          if (!(condition)) {           \
+              failure(__VA_ARGS__);     \
+          }                             \
+      } while (0)
+#else
+#  define RUNTIME_CHECK(condition, ...) ((void)0)
+#endif
 
 void* __stop_custom_data = 0;
 void* __start_custom_data = 0;
 
 static const int32_t EMPTY_BOX = BOX(0);
 
-static int32_t gc_handled_memory[MEM_SIZE];
-static int32_t call_stack[STACK_SIZE];
-const uint8_t* ip;
-static int32_t* fp;
-static const int32_t* call_stack_bottom = call_stack + STACK_SIZE;
-static int32_t* call_stack_top;
-extern size_t __gc_stack_top;
-extern size_t __gc_stack_bottom;
-static int32_t* globals;
-static bytefile* bf;
-
-static int n_args = 0;
-static int n_locals = 0;
-static bool is_closure = false;
-
-static bytefile* read_file(char* fname) {
-    FILE* f = fopen(fname, "rb");
-
-    if (!f) {
-        failure("ERROR: unable to open file %s\n", strerror(errno));
-    }
-
-    if (fseek(f, 0, SEEK_END) == -1) {
-        failure("ERROR: unable to seek file end %s\n", strerror(errno));
-    }
-
-    long size = ftell(f);
-    if (size == -1) {
-        failure("ERROR: unable to get file size %s\n", strerror(errno));
-    }
-
-    size_t file_size = sizeof(bytefile) + size;
-    bytefile* file = malloc(file_size);
-    if (!file) {
-        failure("ERROR: unable to allocate memory.\n");
-    }
-    eof = (unsigned char*)file + file_size;
-
-    if (file == 0) {
-        failure("ERROR: unable to allocate memory.\n");
-    }
-
-    rewind(f);
-
-    if (size != fread(&file->string_table_size, 1, size, f)) {
-        failure("%s\n", strerror(errno));
-    }
-
-    fclose(f);
-
-    file->string_ptr =
-        &file->buffer[file->public_symbols_number * 2 * sizeof(int)];
-    file->public_ptr = (int*)file->buffer;
-    file->code_ptr = (const uint8_t*)&file->string_ptr[file->string_table_size];
-    return file;
-}
-
-static inline int32_t* sp() { return (int32_t*)__gc_stack_top; }
-
-static inline void move_sp(int delta) {
-    __gc_stack_top = (size_t)(sp() + delta);
-}
-
-static inline void push_op(int32_t value) {
-    *sp() = value;
-    move_sp(-1);
-    if (sp() == gc_handled_memory) {
-        failure("ERROR: operands stack overflow\n");
-    }
-}
+#define STACK_HEADROOM 4
 
-static inline void push_call(int32_t value) {
-    *call_stack_top = value;
-    call_stack_top--;
-    if (call_stack_top == call_stack) {
-        failure("ERROR: call stack overflow\n");
-    }
+// The loaded program is shared by all the threads running it (see --instances),
+// while the machine running it is thread-local like the heap: every thread calls
+// init_interpreter to get stacks and a heap of its own.
+static bytefile* bf;
+static program* prog;
+static size_t stack_size = DEFAULT_STACK_SIZE;
+static size_t call_depth = DEFAULT_CALL_DEPTH;
+static size_t nursery_size = DEFAULT_NURSERY_SIZE;
+
+// Both stacks are reserved by init_interpreter and end with a guard page, so an
+// overflow faults and is reported by the handler in stacks.c
+static _Thread_local int32_t* operand_stack;
+static _Thread_local int32_t* operand_stack_end;
+// frame_stack[0] is the record of the main function, which is entered without a call
+static _Thread_local call_frame* frame_stack;
+static _Thread_local size_t frame_stack_capacity;
+extern _Thread_local size_t __gc_stack_top;
+extern _Thread_local size_t __gc_stack_bottom;
+static _Thread_local int32_t* globals;
+
+// Virtual machine registers as seen outside of the dispatch loop. The loop
+// keeps ip, fp and the operand stack pointer in locals and stores them here
+// (the stack pointer into __gc_stack_top, which bounds the GC roots) only at
+// safepoints: before calling into the runtime and before failing.
+static _Thread_local const instruction* saved_ip;
+static _Thread_local int32_t* saved_fp;
+static _Thread_local call_frame* saved_frame;
+
+// With --checkpoint-save, the instruction to take the checkpoint at (cleared
+// once it is taken) and where it goes; with --checkpoint-restore, where every
+// run resumes from
+static const instruction* checkpoint_at;
+static const char* checkpoint_save_path;
+static const char* checkpoint_restore_path;
+
+// Whether instructions are quickened (see QUICKENED_OPCODES), and whether globals
+// are, which is only done while a single machine runs the code
+static bool quickening = true;
+static bool quicken_globals;
+
+// Pushes the record of a call returning to `return_ip`; the callee's BEGIN fills in the rest
+static inline call_frame* push_frame(call_frame* current, const instruction* return_ip, int32_t* fp, int32_t* closure) {
+    call_frame* callee = current + 1;
+    callee->return_ip = return_ip;
+    callee->caller_fp = fp;
+    callee->closure = closure;
+    return callee;
 }
 
-static inline int32_t pop_op(void) {
-    if (sp() == (int32_t*)__gc_stack_bottom - 1) {
-        failure("ERROR: try to access empty operands stack\n");
-    }
-    move_sp(1);
-    return *sp();
+// Moves the closure and the arguments of a tail call (the n topmost values) over
+// the ones the current function has been called with and makes the callee take
+// over its frame; returns the new stack pointer
+static inline int32_t* reuse_frame(call_frame* f, int32_t* fp, int32_t* sp, int32_t n, bool closure) {
+    int32_t* base = fp + f->n_args + (f->closure != NULL);
+    memmove(base - n + 1, sp + 1, n * sizeof(int32_t));
+    f->closure = closure ? base : NULL;
+    return base - n;
 }
 
-static inline int32_t peek_op(void) { return *(sp() + 1); }
-
-static inline int32_t pop_call() {
-    if (call_stack_top == call_stack_bottom - 1) {
-        failure("ERROR: try to access empty call stack\n");
-    }
-    call_stack_top++;
-    return *call_stack_top;
+#ifdef LAMA_RUNTIME_CHECKS
+static int32_t empty_stack_failure(void) {
+    failure("ERROR: try to access empty operands stack\n");
+    return 0;
 }
+#endif
 
-static void init_interpreter(int32_t global_area_size) {
+static void init_interpreter(void) {
+    int32_t global_area_size = bf->global_area_size;
+    // after the runtime, whose SIGSEGV handler the stack overflow handler falls back to
     __gc_init();
-    __gc_stack_bottom = (size_t)gc_handled_memory + MEM_SIZE;
+    if (global_area_size + STACK_HEADROOM >= stack_size / sizeof(int32_t)) {
+        failure("ERROR: the global area does not fit in the operand stack.\n");
+    }
+    operand_stack = reserve_stack(stack_size, true, "ERROR: operands stack overflow\n");
+    operand_stack_end = operand_stack + stack_size / sizeof(int32_t);
+    frame_stack = reserve_stack((call_depth + 1) * sizeof(call_frame), false, "ERROR: call stack overflow\n");
+    frame_stack_capacity = call_depth + 1;
+    saved_ip = prog->code;
+    saved_frame = frame_stack;
+
+    // a few slots above __gc_stack_bottom stay mapped: the pointer fix-up pass of
+    // the GC reads one word past it, and the arguments of the main function
+    // (never pushed) and its result are addressed past the global area
+    __gc_stack_bottom = (size_t)operand_stack + stack_size - STACK_HEADROOM * sizeof(int32_t);
     globals = (int32_t*)__gc_stack_bottom - global_area_size;
     __gc_stack_top = (size_t)(globals - 1);
-    call_stack_top = (int32_t*)call_stack_bottom - 1;
 
     for (int i = 0; i < global_area_size; i++) {
         globals[i] = EMPTY_BOX;
     }
 }
 
-static inline void update_ip(const uint8_t* new_ip) {
-    if (new_ip < bf->code_ptr || new_ip >= eof) {
-        failure("ERROR: instruction pointer points out of bytecode area.");
-    }
-    ip = new_ip;
-}
-
-static inline unsigned char next_byte() {
-    if (ip + 1 >= eof) {
-        failure("ERROR: instruction pointer points out of bytecode area.\n");
-    }
-    return *ip++;
-}
-
-static inline int32_t next_int() {
-    if (ip + sizeof(int32_t) >= eof) {
-        failure("ERROR: instruction pointer points out of bytecode area.\n");
+// Brings the machine back to the state init_interpreter has left it in, for the
+// program to be run once more: the objects of the previous run are dropped at
+// once (the heap keeps the memory it has grown to), the globals are emptied, the
+// stacks are empty. The decoded and the compiled code stay as they are.
+static void reset_interpreter(void) {
+    reset_fibers();
+    __gc_reset();
+    for (int i = 0; i < bf->global_area_size; i++) {
+        globals[i] = EMPTY_BOX;
     }
-    return (ip += sizeof(int32_t), *(int32_t*)(ip - sizeof(int32_t)));
+    __gc_stack_top = (size_t)(globals - 1);
+    saved_ip = prog->code;
+    saved_fp = NULL;
+    saved_frame = frame_stack;
 }
 
-static inline void call(void) {
-    int32_t func_label = next_int();
-    int32_t n_args = next_int();
-    is_closure = false;
-
-    push_call((int32_t)ip);
-    update_ip(bf->code_ptr + func_label);
+static machine_state saved_machine(void) {
+    return (machine_state){
+        .ip = saved_ip,
+        .sp = (int32_t*)__gc_stack_top,
+        .fp = saved_fp,
+        .frame = saved_frame,
+        .stack_begin = operand_stack,
+        .stack_end = operand_stack_end,
+        .frames = frame_stack,
+        .frames_capacity = frame_stack_capacity,
+    };
 }
 
-static inline void begin(int local_variables_count, int args_count) {
-    push_call((int32_t)fp);
-    push_call(n_args);
-    push_call(n_locals);
-    push_call(is_closure);
-
-    fp = sp();
-
-    n_args = args_count;
-    n_locals = local_variables_count;
-    for (int i = 0; i < local_variables_count; i++) {
-        push_op(EMPTY_BOX);
+// Called with the registers saved, when the program reaches the marker
+static void take_checkpoint(void) {
+    if (fibers_spawned()) {
+        failure("ERROR: a checkpoint cannot be taken once fibers have been spawned.\n");
     }
+    machine_state m = saved_machine();
+    save_checkpoint(checkpoint_save_path, bf, prog, &m);
+    checkpoint_at = NULL;
 }
 
-static inline const char* get_string_by_position(bytefile* f, uint32_t pos) {
-    if (pos >= f->string_table_size) {
-        failure("ERROR: no such index in string pool.\n");
-    }
-    return &f->string_ptr[pos];
-}
-
-static inline void tag(void) {
-    const char* tag = get_string_by_position(bf, next_int());
-    int32_t n_field = next_int();
-    int32_t sexp = pop_op();
-    int32_t tag_hash = LtagHash((char*)tag);
-    push_op(Btag((void*)sexp, tag_hash, BOX(n_field)));
+// Replaces the state of a freshly initialized or reset machine by the one of
+// the checkpoint
+static void resume_checkpoint(void) {
+    machine_state m = saved_machine();
+    restore_checkpoint(checkpoint_restore_path, bf, prog, &m);
+    saved_ip = m.ip;
+    saved_fp = m.fp;
+    saved_frame = m.frame;
+    __gc_stack_top = (size_t)m.sp;
 }
 
 static inline char* get_closure_content(int32_t* p) {
@@ -195,166 +204,182 @@ static inline int32_t get_closure_addr(int32_t* p) {
     return ((int32_t*)get_closure_content(p))[0];
 }
 
-static inline int32_t* get_addr(int32_t location, int32_t idx) {
-    if (idx < 0) {
-        failure("ERROR: index less than zero.");
-    }
-    switch (location) {
-        case LOCATION_GLOBAL:
-            if (globals + idx >= (int32_t*)__gc_stack_bottom) {
-                failure("ERROR: out of memory (global %d).\n", idx);
-            }
-            return globals + idx;
-        case LOCATION_LOCAL:
-            if (idx >= n_locals) {
-                failure("ERROR: operands stack overflow.\n");
-            }
-            return fp - idx;
-        case LOCATION_ARGUMENT:
-            if (idx >= n_args) {
-                failure("ERROR: arguments overflow.\n");
-            }
-            return fp + n_args - idx;
-        case LOCATION_CLOSURE: {
-            int32_t* closure_addr =
-                (int32_t*)get_closure_content((int32_t*)fp[n_args + 1]);
-            return (closure_addr + idx + 1);
-        }
-        default:
-            failure("ERROR: unknown location %d.\n", location);
-    }
+static inline int32_t* global_address(const call_frame* f, int32_t* fp, const instruction* insn) {
+    return globals + insn->a.n;
 }
 
-static inline void ld(int32_t location_type, int index) {
-    int32_t* location = get_addr(location_type, index);
-    push_op(*location);
+static inline int32_t* frame_address(const call_frame* f, int32_t* fp, const instruction* insn) {
+    RUNTIME_CHECK(insn->a.n > -f->n_locals && insn->a.n <= f->n_args,
+                  "ERROR: variable is out of the current frame.\n");
+    return fp + insn->a.n;
 }
 
-static inline void lda(int32_t location_type, int index) {
-    int32_t* location = get_addr(location_type, index);
-    push_op((int32_t)location);
+// The closure a function accesses captured values through has been checked by
+// the CALLC which has entered it and stays in its slot, b.n words above fp, for
+// the whole call; the slot, unlike a pointer kept aside, is updated by the GC
+static inline int32_t* closure_address(const call_frame* f, int32_t* fp, const instruction* insn) {
+    return (int32_t*)fp[insn->b.n] + insn->a.n;
 }
 
-static inline void st(int32_t location_type, int index) {
-    int32_t value = peek_op();
-    int32_t* location = get_addr(location_type, index);
-    *location = value;
+// Returns the entry of the function a closure refers to. CALLC sites remember
+// the last entry they have called in c.target (a single word, as threads running
+// instances share the code) and only look the bytecode offset up on a change.
+static inline const instruction* closure_entry(const instruction* site, int32_t* closure) {
+    int32_t offset = get_closure_addr(closure);
+    const instruction* entry = __atomic_load_n(&site->c.target, __ATOMIC_RELAXED);
+    if (entry == NULL || entry->c.n != offset) {
+        entry = instruction_at_offset(prog, offset);
+        __atomic_store_n(&((instruction*)site)->c.target, entry, __ATOMIC_RELAXED);
+    }
+    return entry;
 }
 
-static inline void sta() {
-    int32_t value = pop_op();
-    int32_t dest = pop_op();
-    if (UNBOXED(dest)) {
-        int32_t array = pop_op();
-        Bsta((void*)value, dest, (void*)array);
-    } else {
-        *(int32_t*)dest = value;
+// Returns the address of the variable described by a decoded LD/LDA/ST instruction
+static inline int32_t* get_addr(const call_frame* f, int32_t* fp, const instruction* insn) {
+    switch (insn->opcode) {
+        case OP_LD_GLOBAL:
+        case OP_LDA_GLOBAL:
+        case OP_ST_GLOBAL:
+            return global_address(f, fp, insn);
+        case OP_LD_LOCAL:
+        case OP_LDA_LOCAL:
+        case OP_ST_LOCAL:
+        case OP_LD_ARGUMENT:
+        case OP_LDA_ARGUMENT:
+        case OP_ST_ARGUMENT:
+            return frame_address(f, fp, insn);
+        case OP_LD_CLOSURE:
+        case OP_LDA_CLOSURE:
+        case OP_ST_CLOSURE:
+            return closure_address(f, fp, insn);
+        default:
+            failure("ERROR: unknown location in opcode %d.\n", insn->opcode);
     }
-    push_op(value);
 }
 
-static inline void closure(void) {
-    void* closure_addr = (void*)next_int();
-    int32_t num_values = next_int();
+// Allocates the closure built by a CLOSURE instruction
+static inline int32_t closure(const call_frame* f, int32_t* fp, const instruction* insn) {
+    int32_t num_values = insn->b.n;
 
     data* closure_data = (data*)alloc_closure(num_values + 1);
 
     push_extra_root((void**)&closure_data);
 
-    ((void**)closure_data->contents)[0] = closure_addr;
+    ((int32_t*)closure_data->contents)[0] = insn->a.n;
 
     for (int i = 0; i < num_values; i++) {
-        unsigned char location_type = next_byte();
-        int32_t idx = next_int();
-        int32_t* location = get_addr(location_type, idx);
+        int32_t* location = get_addr(f, fp, insn + 1 + i);
         ((int*) closure_data->contents)[i + 1] = *location;
     }
 
     pop_extra_root((void**)&closure_data);
-    push_op((int32_t)closure_data->contents);
+    return (int32_t)closure_data->contents;
 }
 
-static inline void execute_closure(void) {
-    int32_t args_count = next_int();
-    int32_t closure_label = get_closure_addr((int32_t*)sp()[args_count + 1]);
-    is_closure = true;
+static const char* const binop_symbols[] = {
+#define BINOP_SYMBOL(n, op) [n] = #op,
+    BINOPS(BINOP_SYMBOL)
+#undef BINOP_SYMBOL
+};
 
-    push_call((int32_t)ip);
-    update_ip(bf->code_ptr + (int32_t)closure_label);
+// All binary operators but == and !=, which compare any values by identity,
+// take integers; a single test of the lowest bits tells both operands are ones
+static inline bool integer_operands(int32_t operator_code, int32_t x, int32_t y) {
+    return operator_code == EQUAL || operator_code == NOT_EQUAL || (x & y & 1);
 }
 
-static inline void initialize_closure_context() {
-    int arg_count = next_int();
-    int local_variables_count = next_int();
-    begin(local_variables_count, arg_count);
-}
-
-static inline void finalize_function() {
-    int32_t returned_value = pop_op();
-
-    move_sp(n_args + n_locals);
-
-    bool is_closure = pop_call();
-    if (is_closure) {
-        pop_op();
+// The operator of a BINOP_<op>, REG_<op>, REG_CONST_<op>, FRAME_FRAME_<op> or
+// FRAME_CONST_<op> instruction, or of an integer form of one
+static inline int32_t binop_operator(int32_t opcode) {
+    opcode = generic_opcode(opcode);
+    if (opcode >= OP_FRAME_FRAME_PLUS) {
+        return (opcode - OP_FRAME_FRAME_PLUS) / 2;
     }
+    return opcode >= OP_REG_PLUS ? (opcode - OP_REG_PLUS) / 2 : opcode - OP_BINOP_PLUS;
+}
 
-    push_op(returned_value);
-
-    n_locals = pop_call();
-    n_args = pop_call(); 
-    fp = (int32_t*)pop_call();
-
-    if (call_stack_top != call_stack_bottom - 1) {
-        ip = (unsigned char*)pop_call();
-    }
+static int32_t binop_failure(int32_t opcode) {
+    failure("ERROR: binary operator %s applied to a non-integer value.\n", binop_symbols[binop_operator(opcode)]);
+    return 0;
 }
 
-static inline void binary_operation(int32_t operator_code) {
-    int32_t b = UNBOX(pop_op());
-    int32_t a = UNBOX(pop_op());
-    int32_t result = 0;
+// Applies a binary operator to boxed operands (see integer_operands) and returns
+// the boxed result. The operators work on the boxed values directly wherever
+// boxing commutes with them: BOX(a) + BOX(b) - 1 is BOX(a + b), and so on,
+// comparisons of boxed integers give the same result as of unboxed ones.
+// Arithmetic wraps around, as on unboxed operands.
+static inline int32_t evaluate_binop(int32_t operator_code, int32_t x, int32_t y) {
     switch (operator_code) {
-#define IMPLEMENT_BINOP(n, op) \
-    case n:                    \
-        result = a op b;       \
-        break;
-
-        BINOPS(IMPLEMENT_BINOP)
-
-#undef IMPLEMENT_BINOP
+        case PLUS:
+            return (int32_t)((uint32_t)x + (uint32_t)y - 1);
+        case MINUS:
+            return (int32_t)((uint32_t)x - (uint32_t)y + 1);
+        case MULTIPLY:
+            return (int32_t)((uint32_t)(x - 1) * (uint32_t)UNBOX(y) + 1);
+        case DIVIDE:
+            return BOX(UNBOX(x) / UNBOX(y));
+        case MOD:
+            return BOX(UNBOX(x) % UNBOX(y));
+        case LESS:
+            return BOX(x < y);
+        case LESS_EQUAL:
+            return BOX(x <= y);
+        case GREATER:
+            return BOX(x > y);
+        case GREATER_EQUAL:
+            return BOX(x >= y);
+        case EQUAL:
+            return BOX(x == y);
+        case NOT_EQUAL:
+            return BOX(x != y);
+        case AND:
+            return BOX(x != BOX(0) && y != BOX(0));
+        case OR:
+            return BOX(x != BOX(0) || y != BOX(0));
         default:
             failure("ERROR: unknown operand code: %d.\n", operator_code);
-            return;
+            return 0;
     }
-    result = BOX(result);
-    push_op(result);
 }
 
-static inline void call_barray(void) {
-    int num_elements = next_int();
+// Builds an array of the `num_elements` topmost stack values, the deepest one
+// being the first element. The values are left on the stack, so the GC sees
+// them during the allocation.
+static inline int32_t call_barray(int32_t* sp, int num_elements) {
     data* array_data = (data*)alloc_array(num_elements);
 
-    for (int i = num_elements - 1; i >= 0; i--) {
-        int value = pop_op();
-        ((int*)array_data->contents)[i] = value;
+    for (int i = 0; i < num_elements; i++) {
+        ((int*)array_data->contents)[i] = sp[num_elements - i];
     }
-    push_op((int32_t)array_data->contents);
+    return (int32_t)array_data->contents;
 }
 
-static inline void call_bsexp(void) {
-    const char* tag = get_string_by_position(bf, next_int());
-    int num_elements = next_int();
+// The same as call_barray for an s-expression with the given tag
+static inline int32_t call_bsexp(int32_t* sp, int32_t tag_hash, int num_elements) {
     data* exp = (data*) alloc_sexp(num_elements);
     ((sexp*)exp)->tag = 0;
 
-    for (int i = num_elements; i >= 1; i--) {
-        int value = pop_op();
-        ((int*)exp->contents)[i] = value;
+    for (int i = 0; i < num_elements; i++) {
+        ((int*)exp->contents)[i + 1] = sp[num_elements - i];
     }
 
-    ((sexp*)exp)->tag = UNBOX(LtagHash((char *)tag));
-    push_op((int32_t)exp->contents);
+    ((sexp*)exp)->tag = UNBOX(tag_hash);
+    return (int32_t)exp->contents;
+}
+
+// Whether a value is an aggregate with the given tag, the one a quickened ELEM,
+// CONST_ELEM, DUP_CONST_ELEM or STA indexes
+static inline bool is_aggregate(int32_t value, int32_t tag) {
+    return !UNBOXED(value) && TAG(TO_DATA(value)->data_header) == tag;
+}
+
+// Rewrites an instruction into another form of it. The code is shared by the
+// threads running instances, so the opcode and the handler are stored one at a
+// time: a thread may run either form meanwhile, and every form of an instruction
+// checks the values it gets.
+static inline void quicken(const instruction* insn, int32_t opcode, const void* handler) {
+    __atomic_store_n(&((instruction*)insn)->opcode, opcode, __ATOMIC_RELAXED);
+    __atomic_store_n(&((instruction*)insn)->handler, handler, __ATOMIC_RELAXED);
 }
 
 static inline bool check_tag(int32_t obj, int32_t tag) {
@@ -367,10 +392,6 @@ static inline bool check_tag(int32_t obj, int32_t tag) {
     switch (tag) {
         case ref_type:
             return true;
-        case str_literal: {
-            int32_t other_str = pop_op();
-            return UNBOX(Bstring_patt((void*)other_str, (void*)obj));
-        }
         case string_type:
             return actual_tag == STRING_TAG;
         case array_type:
@@ -384,229 +405,1138 @@ static inline bool check_tag(int32_t obj, int32_t tag) {
     }
 }
 
-static inline void match_pattern(int32_t patt_type) {
+// Matches a value against any pattern kind but the string literal one
+static inline int32_t match_pattern(int32_t patt_type, int32_t obj) {
     bool result = false;
-    int32_t obj = pop_op();
 
     if (patt_type == val_type) {
         result = UNBOXED(obj);
     } else {
         result = check_tag(obj, patt_type);
     }
-    push_op(BOX(result));
-}
-
-static inline void verify_array(void) {
-    int32_t requested_size = BOX(next_int());
-    int32_t actual_obj = pop_op();
-    push_op(Barray_patt((void*)actual_obj, requested_size));
+    return BOX(result);
 }
 
-static bool execute_h1_operation(uint8_t operation) {
-    switch (operation) {
-        case CONST:
-            push_op(BOX(next_int()));
-            break;  
+// Operand stack access inside the dispatch loop: the stack grows down and `sp`
+// points to its first free slot. PUSH evaluates its argument before touching
+// `sp`, so the argument may POP. Overflows hit the guard page below the stack.
+#define PUSH(value)                      \
+    do {                                 \
+        int32_t pushed_value = (value);  \
+        *sp-- = pushed_value;            \
+    } while (0)
+// Pushes the result of a binary operator unless the operands do not suit it
+#define PUSH_BINOP(operator_code, x, y)                                  \
+    do {                                                                 \
+        int32_t left = (x), right = (y);                                 \
+        PUSH(integer_operands(operator_code, left, right)                \
+                 ? evaluate_binop(operator_code, left, right)            \
+                 : binop_failure(ip->opcode));                           \
+    } while (0)
+#ifdef LAMA_RUNTIME_CHECKS
+#  define POP() (sp == stack_empty ? empty_stack_failure() : *++sp)
+#else
+// the verifier has checked the depth of the stack before every instruction
+#  define POP() (*++sp)
+#endif
+// Takes the sample the sampling profiler has asked for, if any. Function entries
+// and jumps check for one, running code reaches either soon.
+#define SAMPLE_POINT()                               \
+    do {                                             \
+        if (__builtin_expect(sample_requested, 0)) { \
+            take_sample(ip, frame, frames);          \
+        }                                            \
+    } while (0)
+#define PEEK() (sp[1])
+// Stores to a field of an object, which may be old (see __gc_write_barrier)
+#define STORE_FIELD(field, value)                \
+    do {                                         \
+        int32_t* slot = (field);                 \
+        int32_t stored = (value);                \
+        __gc_write_barrier(slot, (void*)stored); \
+        *slot = stored;                          \
+    } while (0)
+#define STORE_VARIABLE(variable, value) (*(variable) = (value))
+#define SAVE_REGISTERS()             \
+    do {                             \
+        __gc_stack_top = (size_t)sp; \
+        saved_ip = ip;               \
+        saved_fp = fp;               \
+        saved_frame = frame;         \
+    } while (0)
+// The registers of the running fiber, to be resumed at `resume_ip`, for the
+// scheduler to replace by the ones of the fiber it switches to
+#define FIBER_REGISTERS(resume_ip) \
+    {.ip = (resume_ip), .sp = sp, .fp = fp, .frame = frame, .frames = frames, .stack_empty = stack_empty}
+#define LOAD_FIBER_REGISTERS(r)            \
+    do {                                   \
+        ip = (r).ip;                       \
+        sp = (r).sp;                       \
+        fp = (r).fp;                       \
+        frame = (r).frame;                 \
+        frames = (r).frames;               \
+        stack_empty = (r).stack_empty;     \
+    } while (0)
+
+// Rewrites the running instruction into its form `name`, which its next runs
+// execute. An instruction the profiler or the JIT hooks into stays linked to the hook.
+#ifdef THREADED_DISPATCH
+#  define QUICKEN(name) \
+      quicken(ip, OP_##name, ip->handler == handlers[ip->opcode] ? handlers[OP_##name] : ip->handler)
+#else
+#  define QUICKEN(name) quicken(ip, OP_##name, ip->handler)
+#endif
+// Quickens the running generic ELEM, CONST_ELEM, DUP_CONST_ELEM or STA for the
+// kind of the aggregate it indexes, unless it has been given up on
+#define QUICKEN_AGGREGATE(generic, aggregate)                               \
+    do {                                                                    \
+        if (quickening && ip->c.n == 0) {                                   \
+            if (is_aggregate((aggregate), ARRAY_TAG)) {                     \
+                QUICKEN(generic##_ARRAY);                                   \
+            } else if (is_aggregate((aggregate), SEXP_TAG)) {               \
+                QUICKEN(generic##_SEXP);                                    \
+            } else {                                                        \
+                __atomic_store_n(&((instruction*)ip)->c.n, 1, __ATOMIC_RELAXED); \
+            }                                                               \
+        }                                                                   \
+    } while (0)
+// Turns the running quickened instruction back into its generic form for good
+// and runs that on the same operands
+#define UNQUICKEN(generic)                                                \
+    do {                                                                  \
+        __atomic_store_n(&((instruction*)ip)->c.n, 1, __ATOMIC_RELAXED);  \
+        QUICKEN(generic);                                                 \
+        DISPATCH();                                                       \
+    } while (0)
+// Stores the address of the global of the running instruction in it and quickens
+// it into its form `name`
+#define QUICKEN_GLOBAL(name)                                     \
+    do {                                                         \
+        if (quicken_globals) {                                   \
+            ((instruction*)ip)->b.address = globals + ip->a.n;   \
+            QUICKEN(name);                                       \
+        }                                                        \
+    } while (0)
+
+// Both engines share the handlers below and only differ in how an instruction
+// is dispatched: TARGET marks the beginning of a handler, NEXT moves to the
+// following instruction, SKIP(n) moves n instructions forward, DISPATCH
+// continues at the instruction `ip` points to.
+#ifdef THREADED_DISPATCH
+
+// Direct-threaded engine: every decoded instruction holds the address of its
+// handler, so each instruction costs exactly one indirect jump.
+#  define TARGET(name) op_##name:
+#  define DISPATCH() goto *ip->handler
+#  define SKIP(n)       \
+      do {              \
+          ip += (n);    \
+          DISPATCH();   \
+      } while (0)
+#  define NEXT() SKIP(1)
+
+#else
+
+// Portable engine: selects the handler with a switch over the decoded opcode.
+// DISPATCH jumps back to the switch rather than `continue`, which would only
+// leave the do-while of SKIP and fall through to the next handler.
+#  define TARGET(name) case OP_##name:
+#  define DISPATCH() goto dispatch
+#  define SKIP(n)       \
+      do {              \
+          ip += (n);    \
+          DISPATCH();   \
+      } while (0)
+#  define NEXT() SKIP(1)
+
+#endif
 
-        case BSTRING: {
-            const char* string_in_pool = get_string_by_position(bf, next_int());
-            push_op((int32_t)Bstring((char *)string_in_pool));
-            break;
+static void interpret(FILE* f) {
+#ifdef THREADED_DISPATCH
+    static const void* dispatch_table[OPCODES_NUMBER] = {
+#  define BINOP_LABEL(n, op) [OP_BINOP_##n] = &&op_BINOP_##n,
+        BINOPS(BINOP_LABEL)
+#  undef BINOP_LABEL
+#  define OPCODE_LABEL(name) [OP_##name] = &&op_##name,
+        DECODED_OPCODES(OPCODE_LABEL)
+        FUSED_OPCODES(OPCODE_LABEL)
+        REGISTER_OPCODES(OPCODE_LABEL)
+#  undef OPCODE_LABEL
+#  define QUICKENED_LABEL(name, generic) [OP_##name] = &&op_##name,
+        QUICKENED_OPCODES(QUICKENED_LABEL)
+#  undef QUICKENED_LABEL
+#  define REGISTER_BINOP_LABELS(n, op) [OP_REG_##n] = &&op_REG_##n, [OP_REG_CONST_##n] = &&op_REG_CONST_##n,
+        BINOPS(REGISTER_BINOP_LABELS)
+#  undef REGISTER_BINOP_LABELS
+#  define FUSED_BINOP_LABELS(n, op) \
+        [OP_FRAME_FRAME_##n] = &&op_FRAME_FRAME_##n, [OP_FRAME_CONST_##n] = &&op_FRAME_CONST_##n,
+        BINOPS(FUSED_BINOP_LABELS)
+#  undef FUSED_BINOP_LABELS
+#  define INTEGER_BINOP_LABELS(n, op)                                                               \
+        [OP_INT_FRAME_FRAME_##n] = &&op_INT_FRAME_FRAME_##n, [OP_INT_FRAME_CONST_##n] = &&op_INT_FRAME_CONST_##n, \
+        [OP_INT_REG_##n] = &&op_INT_REG_##n, [OP_INT_REG_CONST_##n] = &&op_INT_REG_CONST_##n,
+        BINOPS(INTEGER_BINOP_LABELS)
+#  undef INTEGER_BINOP_LABELS
+    };
+
+    // The profilers hook into the dispatch by linking instructions to their own
+    // handlers, so they cost nothing when they are off
+    const void* handlers[OPCODES_NUMBER];
+    memcpy(handlers, dispatch_table, sizeof(handlers));
+    if (function_profiler_enabled) {
+        handlers[OP_BEGIN] = handlers[OP_CBEGIN] = &&function_entry_hook;
+        handlers[OP_END] = handlers[OP_TAIL_CALL] = handlers[OP_TAIL_CALLC] = &&function_exit_hook;
+    }
+#  ifdef LAMA_JIT
+    // so does the JIT, counting function entries and back-edges until a function
+    // gets hot, then sending the interpreter to its compiled code
+    if (jit_enabled) {
+        handlers[OP_BEGIN] = handlers[OP_CBEGIN] = &&jit_counter_hook;
+    }
+#  endif
+    // instructions are linked on the first run only, later ones (see --serve)
+    // must not unlink compiled code, concurrent ones (see --instances) wait
+    static pthread_mutex_t linking = PTHREAD_MUTEX_INITIALIZER;
+    static bool linked = false;
+    pthread_mutex_lock(&linking);
+    if (!linked) {
+        for (size_t i = 0; i < prog->length; i++) {
+            prog->code[i].handler = profiler.enabled ? &&opcode_hook : handlers[prog->code[i].opcode];
+#  ifdef LAMA_JIT
+            const instruction* target = jump_target(&prog->code[i]);
+            if (jit_enabled && target && target <= &prog->code[i]) {
+                prog->code[i].handler = &&jit_counter_hook;
+            }
+#  endif
         }
-        case BSEXP:
-            call_bsexp();
-            break;
-
-        case STA:
-            sta();
-            break;
-
-        case JMP: {
-            int x = next_int();
-            update_ip(bf->code_ptr + x);
-            break;
+        if (checkpoint_at != NULL) {
+            prog->code[checkpoint_at - prog->code].handler = &&checkpoint_hook;
+        }
+        linked = true;
+    }
+    pthread_mutex_unlock(&linking);
+#else
+    // the sampling profiler samples at any instruction here
+    const bool hooked =
+        profiler.enabled || function_profiler_enabled || sampling_profiler_enabled || checkpoint_at != NULL;
+#endif
+
+    const instruction* ip = saved_ip;
+    int32_t* fp = saved_fp;
+    call_frame* frame = saved_frame;
+    int32_t* sp = (int32_t*)__gc_stack_top;
+    // the stacks of the running fiber, the ones of the machine for the main one
+    call_frame* frames = frame_stack;
+    int32_t* stack_empty = (int32_t*)__gc_stack_bottom - 1;
+
+#ifdef THREADED_DISPATCH
+    DISPATCH();
+
+opcode_hook:
+    profile_opcode(ip->opcode);
+    goto *handlers[ip->opcode];
+
+function_entry_hook:
+    profile_function_entry(ip - prog->code);
+    goto *dispatch_table[ip->opcode];
+
+function_exit_hook:
+    profile_function_exit();
+    goto *dispatch_table[ip->opcode];
+
+checkpoint_hook:
+    SAVE_REGISTERS();
+    take_checkpoint();
+    prog->code[ip - prog->code].handler = profiler.enabled ? &&opcode_hook : handlers[ip->opcode];
+    goto *ip->handler;
+
+#  ifdef LAMA_JIT
+jit_counter_hook: {
+    size_t begin, end;
+    if (jit_tick(ip - prog->code, &begin, &end)) {
+        for (size_t i = begin; i < end; i++) {
+            if (jit_entry(i)) {
+                prog->code[i].handler = &&jit_enter_hook;
+            }
         }
+        if (jit_entry(ip - prog->code)) {
+            goto jit_enter_hook;
+        }
+    }
+    goto *dispatch_table[ip->opcode];
+}
 
-        case END:
-            finalize_function();
-            if (call_stack_top == call_stack_bottom - 1) {
-                return true;
+// Compiled code returns the first instruction it leaves to the interpreter. That
+// is either one it cannot execute itself (the return from the main function may
+// be an entry of compiled code too), or the entry of code not compiled yet, which
+// goes through its handler to be counted.
+jit_enter_hook: {
+    // compiled code is bound to the stacks of the main fiber
+    if (frames != frame_stack) {
+        goto *dispatch_table[ip->opcode];
+    }
+    jit_registers registers = {.sp = sp, .fp = fp, .frame = frame};
+    ip = jit_run(&registers, jit_entry(ip - prog->code));
+    sp = registers.sp;
+    fp = registers.fp;
+    frame = registers.frame;
+    goto *(ip->handler == &&jit_enter_hook ? dispatch_table[ip->opcode] : ip->handler);
+}
+#  endif
+#else
+    while (true) {
+    dispatch:
+        if (hooked) {
+            if (ip == checkpoint_at) {
+                SAVE_REGISTERS();
+                take_checkpoint();
             }
-            break;
+            if (profiler.enabled) {
+                profile_opcode(ip->opcode);
+            }
+            if (sample_requested) {
+                take_sample(ip, frame, frames);
+            }
+            if (function_profiler_enabled) {
+                if (ip->opcode == OP_BEGIN || ip->opcode == OP_CBEGIN) {
+                    profile_function_entry(ip - prog->code);
+                } else if (ip->opcode == OP_END || ip->opcode == OP_TAIL_CALL || ip->opcode == OP_TAIL_CALLC) {
+                    profile_function_exit();
+                }
+            }
+        }
+        switch (ip->opcode) {
+#endif
+
+#define BINOP_HANDLER(n, op)               \
+    TARGET(BINOP_##n) {                    \
+        int32_t y = POP();                 \
+        int32_t x = POP();                 \
+        PUSH_BINOP(n, x, y);               \
+        NEXT();                            \
+    }
+    BINOPS(BINOP_HANDLER)
+#undef BINOP_HANDLER
+
+TARGET(CONST)
+    PUSH(ip->a.n);
+    NEXT();
+
+TARGET(STRING)
+    SAVE_REGISTERS();
+    PUSH((int32_t)Bstring((char*)ip->a.string));
+    NEXT();
+
+TARGET(SEXP) {
+    SAVE_REGISTERS();
+    int32_t exp = call_bsexp(sp, ip->a.n, ip->b.n);
+    sp += ip->b.n;
+    PUSH(exp);
+    NEXT();
+}
 
-        case DROP:
-            pop_op();
-            break;
+TARGET(STA) {
+    int32_t value = POP();
+    int32_t dest = POP();
+    if (UNBOXED(dest)) {
+        int32_t array = POP();
+        QUICKEN_AGGREGATE(STA, array);
+        SAVE_REGISTERS();
+        Bsta((void*)value, dest, (void*)array);
+    } else {
+        // the reference may point into a closure (LDA_CLOSURE)
+        STORE_FIELD((int32_t*)dest, value);
+    }
+    PUSH(value);
+    NEXT();
+}
 
-        case DUP:
-            push_op(peek_op());
-            break;
+TARGET(JMP)
+    SAMPLE_POINT();
+    ip = ip->a.target;
+    DISPATCH();
 
-        case ELEM: {  
-            int32_t idx = pop_op();
-            int32_t array = pop_op();
-            push_op((int32_t)Belem((char*)array, idx));
-            break;
-        }
+TARGET(END) {
+    int32_t returned_value = POP();
 
-        case RET:
-            failure("ERROR: bytecode RET is unsupported.\n");
+    // drop the locals, the arguments and the closure the function has been called through
+    sp = fp + frame->n_args + (frame->closure != NULL);
+    PUSH(returned_value);
 
-        case SWAP:
-            failure("ERROR: bytecode SWAP is unsupported.\n");
+    if (frame == frames) {
+        if (frames == frame_stack) {
+            SAVE_REGISTERS();
+            return;
+        }
+        fiber_registers r = FIBER_REGISTERS(ip);
+        finish_fiber(returned_value, &r);
+        LOAD_FIBER_REGISTERS(r);
+        DISPATCH();
+    }
+    ip = frame->return_ip;
+    fp = frame->caller_fp;
+    frame--;
+    DISPATCH();
+}
 
-        case STI:
-            failure("ERROR: bytecode STI is unsupported.\n");
+TARGET(DROP)
+    (void)POP();
+    NEXT();
+
+TARGET(DUP)
+    PUSH(PEEK());
+    NEXT();
+
+TARGET(ELEM) {
+    int32_t idx = POP();
+    int32_t array = POP();
+    QUICKEN_AGGREGATE(ELEM, array);
+    SAVE_REGISTERS();
+    PUSH((int32_t)Belem((char*)array, idx));
+    NEXT();
+}
 
-        default:
-            failure("ERROR: invalid opcode %d.\n", operation);
-    }
-    return false;
-}
-
-static void handle_conditional_jump(uint8_t operation) {
-    int target = next_int();
-    bool condition = (operation == CJMPZ) ? !UNBOX(pop_op()) : UNBOX(pop_op());
-    if (condition) {
-        update_ip(bf->code_ptr + target);
-    }
-}
-
-static void execute_h5_operation(uint8_t operation) {
-    switch (operation) {
-        case CJMPZ:
-        case CJMPNZ:
-            handle_conditional_jump(operation);
-            break;
-
-        case BEGIN:
-            int args_count = next_int();
-            int locals_count = next_int();
-            begin(locals_count, args_count);
-            break;
-
-        case CBEGIN:
-            initialize_closure_context();
-            break;
-
-        case BCLOSURE:
-            closure();
-            break;
-
-        case CALLC:
-            execute_closure();
-            break;
-        case CALL:
-            call();
-            break;
-        case TAG:
-            tag();
-            break;
-        case ARRAY_KEY:
-            verify_array();
-            break;
-
-        case FAIL:
-            int32_t line = next_int();
-            int32_t column = next_byte();
-            failure("FAIL at \t%d:%d.\n", line, column);
-
-        case LINE:
-            next_int();
-            break;
+TARGET(RET)
+    SAVE_REGISTERS();
+    failure("ERROR: bytecode RET is unsupported.\n");
+
+TARGET(SWAP)
+    SAVE_REGISTERS();
+    failure("ERROR: bytecode SWAP is unsupported.\n");
+
+TARGET(STI)
+    SAVE_REGISTERS();
+    failure("ERROR: bytecode STI is unsupported.\n");
+
+#define LOCATION_HANDLERS(location, address, store) \
+    TARGET(LD_##location)                           \
+        PUSH(*address(frame, fp, ip));              \
+        NEXT();                                     \
+    TARGET(LDA_##location)                          \
+        PUSH((int32_t)address(frame, fp, ip));      \
+        NEXT();                                     \
+    TARGET(ST_##location)                           \
+        store(address(frame, fp, ip), PEEK());      \
+        NEXT();
+    LOCATION_HANDLERS(LOCAL, frame_address, STORE_VARIABLE)
+    LOCATION_HANDLERS(ARGUMENT, frame_address, STORE_VARIABLE)
+    LOCATION_HANDLERS(CLOSURE, closure_address, STORE_FIELD)
+#undef LOCATION_HANDLERS
+
+// The globals of a machine stay where init_interpreter has put them
+TARGET(LD_GLOBAL)
+    QUICKEN_GLOBAL(LD_GLOBAL_ABS);
+    PUSH(*global_address(frame, fp, ip));
+    NEXT();
+
+TARGET(LDA_GLOBAL)
+    PUSH((int32_t)global_address(frame, fp, ip));
+    NEXT();
+
+TARGET(ST_GLOBAL)
+    QUICKEN_GLOBAL(ST_GLOBAL_ABS);
+    *global_address(frame, fp, ip) = PEEK();
+    NEXT();
+
+TARGET(CJMPZ)
+    SAMPLE_POINT();
+    if (!UNBOX(POP())) {
+        ip = ip->a.target;
+        DISPATCH();
+    }
+    NEXT();
 
-        default:
-            failure("ERROR: invalid opcode %d.\n", operation);
+TARGET(CJMPNZ)
+    SAMPLE_POINT();
+    if (UNBOX(POP())) {
+        ip = ip->a.target;
+        DISPATCH();
+    }
+    NEXT();
+
+TARGET(CBEGIN)
+    RUNTIME_CHECK(frame->closure != NULL && TAG(TO_DATA(*frame->closure)->data_header) == CLOSURE_TAG,
+                  "ERROR: pointer to not-closure object as closure argument.\n");
+TARGET(BEGIN)
+    SAMPLE_POINT();
+    fp = sp;
+    frame->n_args = ip->a.n;
+    frame->n_locals = ip->b.n;
+    for (int i = 0; i < ip->b.n; i++) {
+        PUSH(EMPTY_BOX);
     }
+    NEXT();
+
+TARGET(CLOSURE)
+    SAVE_REGISTERS();
+    PUSH(closure(frame, fp, ip));
+    ip += ip->b.n;
+    NEXT();
+
+TARGET(CALLC) {
+    int32_t* closure_slot = sp + ip->a.n + 1;
+    const instruction* entry = closure_entry(ip, (int32_t*)*closure_slot);
+
+    frame = push_frame(frame, ip + 1, fp, closure_slot);
+    ip = entry;
+    DISPATCH();
+}
+
+TARGET(CALL)
+    frame = push_frame(frame, ip + 1, fp, NULL);
+    ip = ip->a.target;
+    DISPATCH();
+
+TARGET(TAIL_CALLC) {
+    const instruction* entry = closure_entry(ip, (int32_t*)sp[ip->a.n + 1]);
+
+    sp = reuse_frame(frame, fp, sp, ip->a.n + 1, true);
+    ip = entry;
+    DISPATCH();
 }
 
-static void execute_builtin_operation(uint8_t operation) {
-    int32_t value;
+TARGET(TAIL_CALL)
+    sp = reuse_frame(frame, fp, sp, ip->b.n, false);
+    ip = ip->a.target;
+    DISPATCH();
+
+TARGET(TAG)
+    PUSH(Btag((void*)POP(), ip->a.n, ip->b.n));
+    NEXT();
+
+TARGET(ARRAY)
+    PUSH(Barray_patt((void*)POP(), ip->a.n));
+    NEXT();
+
+TARGET(FAIL)
+    SAVE_REGISTERS();
+    failure("FAIL at \t%d:%d.\n", ip->a.n, ip->b.n);
+
+TARGET(PATT_STR) {
+    int32_t pattern = POP();
+    int32_t obj = POP();
+    SAVE_REGISTERS();
+    PUSH(Bstring_patt((void*)obj, (void*)pattern));
+    NEXT();
+}
 
-    switch (operation) {
-        case BUILTIN_READ:
-            value = Lread();
-            break;
+TARGET(PATT_STRING)
+    PUSH(match_pattern(string_type, POP()));
+    NEXT();
 
-        case BUILTIN_WRITE:
-            value = Lwrite(pop_op());
-            break;
+TARGET(PATT_ARRAY)
+    PUSH(match_pattern(array_type, POP()));
+    NEXT();
 
-        case BUILTIN_LENGTH:
-            value = Llength((char*)pop_op());
-            break;
+TARGET(PATT_SEXP)
+    PUSH(match_pattern(sexp_type, POP()));
+    NEXT();
 
-        case BUILTIN_STRING:
-            value = (int32_t) Lstring((char*)pop_op());
-            break;
+TARGET(PATT_REF)
+    PUSH(match_pattern(ref_type, POP()));
+    NEXT();
 
-        case BUILTIN_ARRAY:
-            call_barray();
-            return;
+TARGET(PATT_VAL)
+    PUSH(match_pattern(val_type, POP()));
+    NEXT();
 
-        default:
-            failure("ERROR: invalid opcode %d.\n", operation);
+TARGET(PATT_CLOSURE)
+    PUSH(match_pattern(closure_type, POP()));
+    NEXT();
+
+TARGET(READ)
+    SAVE_REGISTERS();
+    PUSH(Lread());
+    NEXT();
+
+TARGET(WRITE) {
+    int32_t value = POP();
+    SAVE_REGISTERS();
+    PUSH(Lwrite(value));
+    NEXT();
+}
+
+TARGET(LENGTH) {
+    int32_t value = POP();
+    SAVE_REGISTERS();
+    PUSH(Llength((char*)value));
+    NEXT();
+}
+
+TARGET(TO_STRING) {
+    int32_t value = POP();
+    SAVE_REGISTERS();
+    PUSH((int32_t)Lstring((char*)value));
+    NEXT();
+}
+
+TARGET(BARRAY) {
+    SAVE_REGISTERS();
+    int32_t array = call_barray(sp, ip->a.n);
+    sp += ip->a.n;
+    PUSH(array);
+    NEXT();
+}
+
+TARGET(CALL_EXTERN) {
+    SAVE_REGISTERS();
+    int32_t result = call_extern(ip->a.function, sp, ip->b.n);
+    sp += ip->b.n;
+    PUSH(result);
+    NEXT();
+}
+
+TARGET(FIBER_SPAWN) {
+    int32_t closure = POP();
+    SAVE_REGISTERS();
+    if (function_profiler_enabled) {
+        // the profiler follows the calls of a single stack
+        failure("ERROR: fibers cannot be profiled.\n");
     }
-    push_op(value);
+    PUSH(spawn_fiber(closure, closure_entry(ip, (int32_t*)closure)));
+    NEXT();
 }
 
-static void interpret(FILE* f) {
-    ip = bf->code_ptr;
-    while (true) {
-        uint8_t opcode = next_byte();
-        uint8_t high_part = (opcode & 0xF0) >> 4;
-        uint8_t low_part = opcode & 0x0F;
+TARGET(FIBER_YIELD) {
+    PUSH(EMPTY_BOX);
+    fiber_registers r = FIBER_REGISTERS(ip + 1);
+    yield_fiber(&r);
+    LOAD_FIBER_REGISTERS(r);
+    DISPATCH();
+}
+
+TARGET(FIBER_JOIN) {
+    int32_t fiber = POP();
+    int32_t result;
+    SAVE_REGISTERS();
+    fiber_registers r = FIBER_REGISTERS(ip + 1);
+    if (join_fiber(fiber, &r, &result)) {
+        PUSH(result);
+        NEXT();
+    }
+    LOAD_FIBER_REGISTERS(r);
+    DISPATCH();
+}
+
+TARGET(STOP)
+    SAVE_REGISTERS();
+    return;
 
-        if (high_part == 0xFF) {
-            break;
+// Superinstructions: the interior of a fused sequence is left in place and is
+// skipped with SKIP, see superinstructions.h
+TARGET(DUP_CONST_ELEM)
+    QUICKEN_AGGREGATE(DUP_CONST_ELEM, PEEK());
+    SAVE_REGISTERS();
+    PUSH((int32_t)Belem((char*)PEEK(), ip->a.n));
+    SKIP(3);
+
+TARGET(CONST_ELEM) {
+    int32_t array = POP();
+    QUICKEN_AGGREGATE(CONST_ELEM, array);
+    SAVE_REGISTERS();
+    PUSH((int32_t)Belem((char*)array, ip->a.n));
+    SKIP(2);
+}
+
+TARGET(DROP_DROP)
+    (void)POP();
+    (void)POP();
+    SKIP(2);
+
+#define ST_DROP_HANDLER(location, address, store) \
+    TARGET(ST_##location##_DROP)                  \
+        store(address(frame, fp, ip), POP());     \
+        SKIP(2);
+    ST_DROP_HANDLER(LOCAL, frame_address, STORE_VARIABLE)
+    ST_DROP_HANDLER(ARGUMENT, frame_address, STORE_VARIABLE)
+    ST_DROP_HANDLER(CLOSURE, closure_address, STORE_FIELD)
+#undef ST_DROP_HANDLER
+
+TARGET(ST_GLOBAL_DROP)
+    QUICKEN_GLOBAL(ST_GLOBAL_DROP_ABS);
+    *global_address(frame, fp, ip) = POP();
+    SKIP(2);
+
+TARGET(DUP_TAG_CJMPZ)
+    if (!UNBOX(Btag((void*)PEEK(), ip->a.n, ip->b.n))) {
+        ip = ip->c.target;
+        DISPATCH();
+    }
+    SKIP(3);
+
+TARGET(DUP_TAG_CJMPNZ)
+    if (UNBOX(Btag((void*)PEEK(), ip->a.n, ip->b.n))) {
+        ip = ip->c.target;
+        DISPATCH();
+    }
+    SKIP(3);
+
+TARGET(DUP_ARRAY_CJMPZ)
+    if (!UNBOX(Barray_patt((void*)PEEK(), ip->a.n))) {
+        ip = ip->c.target;
+        DISPATCH();
+    }
+    SKIP(3);
+
+TARGET(DUP_ARRAY_CJMPNZ)
+    if (UNBOX(Barray_patt((void*)PEEK(), ip->a.n))) {
+        ip = ip->c.target;
+        DISPATCH();
+    }
+    SKIP(3);
+
+#define FUSED_BINOP_HANDLERS(code, op)                                              \
+    TARGET(FRAME_FRAME_##code)                                                      \
+        PUSH_BINOP(code, *frame_address(frame, fp, ip), fp[ip->b.n]);               \
+        SKIP(3);                                                                    \
+    TARGET(FRAME_CONST_##code)                                                      \
+        /* the constant is boxed: `| 1` changes nothing but spares its tag test */  \
+        PUSH_BINOP(code, *frame_address(frame, fp, ip), ip->b.n | 1);               \
+        SKIP(3);
+    BINOPS(FUSED_BINOP_HANDLERS)
+#undef FUSED_BINOP_HANDLERS
+
+// Quickened instructions (see QUICKENED_OPCODES). The aggregate forms check the
+// kind of their operands before touching the stack and leave anything else to
+// the generic instruction, which reports the errors.
+TARGET(LD_GLOBAL_ABS)
+    PUSH(*ip->b.address);
+    NEXT();
+
+TARGET(ST_GLOBAL_ABS)
+    *ip->b.address = PEEK();
+    NEXT();
+
+TARGET(ST_GLOBAL_DROP_ABS)
+    *ip->b.address = POP();
+    SKIP(2);
+
+// Fields of an s-expression follow its tag, elements of an array start right away
+#define AGGREGATE_HANDLERS(kind, first)                                           \
+    TARGET(ELEM_##kind)                                                           \
+        if (UNBOXED(sp[1]) && is_aggregate(sp[2], kind##_TAG)) {                  \
+            sp++;                                                                 \
+            sp[1] = ((int32_t*)sp[1])[UNBOX(sp[0]) + (first)];                    \
+            NEXT();                                                               \
+        }                                                                         \
+        UNQUICKEN(ELEM);                                                          \
+    TARGET(CONST_ELEM_##kind)                                                     \
+        if (is_aggregate(sp[1], kind##_TAG)) {                                    \
+            sp[1] = ((int32_t*)sp[1])[UNBOX(ip->a.n) + (first)];                  \
+            SKIP(2);                                                              \
+        }                                                                         \
+        UNQUICKEN(CONST_ELEM);                                                    \
+    TARGET(DUP_CONST_ELEM_##kind)                                                 \
+        if (is_aggregate(sp[1], kind##_TAG)) {                                    \
+            PUSH(((int32_t*)sp[1])[UNBOX(ip->a.n) + (first)]);                    \
+            SKIP(3);                                                              \
+        }                                                                         \
+        UNQUICKEN(DUP_CONST_ELEM);                                                \
+    TARGET(STA_##kind)                                                            \
+        if (UNBOXED(sp[2]) && is_aggregate(sp[3], kind##_TAG)) {                  \
+            STORE_FIELD(&((int32_t*)sp[3])[UNBOX(sp[2]) + (first)], sp[1]);       \
+            sp[3] = sp[1];                                                        \
+            sp += 2;                                                              \
+            NEXT();                                                               \
+        }                                                                         \
+        UNQUICKEN(STA);
+    AGGREGATE_HANDLERS(ARRAY, 0)
+    AGGREGATE_HANDLERS(SEXP, 1)
+#undef AGGREGATE_HANDLERS
+
+// Register instructions (see registers.h) address the slots of the frame by
+// their offsets from fp and leave the stack pointer alone, but for REG_SP
+TARGET(REG_MOVE)
+    fp[ip->a.n] = fp[ip->b.n];
+    NEXT();
+
+TARGET(REG_CONST)
+    fp[ip->a.n] = ip->b.n;
+    NEXT();
+
+TARGET(REG_LD_GLOBAL)
+    fp[ip->a.n] = globals[ip->b.n];
+    NEXT();
+
+TARGET(REG_LD_CLOSURE)
+    fp[ip->a.n] = ((int32_t*)fp[ip->c.n])[ip->b.n];
+    NEXT();
+
+TARGET(REG_ST_GLOBAL)
+    globals[ip->a.n] = fp[ip->b.n];
+    NEXT();
+
+TARGET(REG_ST_CLOSURE)
+    STORE_FIELD(closure_address(frame, fp, ip), fp[ip->c.n]);
+    NEXT();
+
+TARGET(REG_CJMPZ)
+    SAMPLE_POINT();
+    if (!UNBOX(fp[ip->b.n])) {
+        ip = ip->a.target;
+        DISPATCH();
+    }
+    NEXT();
+
+TARGET(REG_CJMPNZ)
+    SAMPLE_POINT();
+    if (UNBOX(fp[ip->b.n])) {
+        ip = ip->a.target;
+        DISPATCH();
+    }
+    NEXT();
+
+TARGET(REG_SP)
+    sp = fp + ip->a.n;
+    NEXT();
+
+#define REGISTER_BINOP(code, x, y)                                                             \
+    do {                                                                                       \
+        int32_t left = (x), right = (y);                                                       \
+        fp[ip->a.n] = integer_operands(code, left, right) ? evaluate_binop(code, left, right)  \
+                                                          : binop_failure(ip->opcode);         \
+        NEXT();                                                                                \
+    } while (0)
+#define REGISTER_BINOP_HANDLERS(code, op)                        \
+    TARGET(REG_##code)                                           \
+        REGISTER_BINOP(code, fp[ip->b.n], fp[ip->c.n]);          \
+    TARGET(REG_CONST_##code)                                     \
+        REGISTER_BINOP(code, fp[ip->b.n], ip->c.n | 1);
+    BINOPS(REGISTER_BINOP_HANDLERS)
+#undef REGISTER_BINOP_HANDLERS
+#undef REGISTER_BINOP
+
+// Integer forms (see integers.h): their operands are locals proven to hold
+// integers, and constants, so they go without the tag test
+#define INTEGER_BINOP_HANDLERS(code, op)                                             \
+    TARGET(INT_FRAME_FRAME_##code)                                                   \
+        PUSH(evaluate_binop(code, *frame_address(frame, fp, ip), fp[ip->b.n]));      \
+        SKIP(3);                                                                     \
+    TARGET(INT_FRAME_CONST_##code)                                                   \
+        PUSH(evaluate_binop(code, *frame_address(frame, fp, ip), ip->b.n));          \
+        SKIP(3);                                                                     \
+    TARGET(INT_REG_##code)                                                           \
+        fp[ip->a.n] = evaluate_binop(code, fp[ip->b.n], fp[ip->c.n]);                \
+        NEXT();                                                                      \
+    TARGET(INT_REG_CONST_##code)                                                     \
+        fp[ip->a.n] = evaluate_binop(code, fp[ip->b.n], ip->c.n);                    \
+        NEXT();
+    BINOPS(INTEGER_BINOP_HANDLERS)
+#undef INTEGER_BINOP_HANDLERS
+
+#ifndef THREADED_DISPATCH
+            default:
+                SAVE_REGISTERS();
+                failure("ERROR: invalid opcode %d.\n", ip->opcode);
         }
+    }
+#endif
+}
+
+#undef TARGET
+#undef DISPATCH
+#undef SKIP
+#undef NEXT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SAVE_REGISTERS
+#undef SAMPLE_POINT
+#undef STORE_FIELD
+#undef STORE_VARIABLE
+#undef FIBER_REGISTERS
+#undef LOAD_FIBER_REGISTERS
+#undef QUICKEN
+#undef QUICKEN_AGGREGATE
+#undef UNQUICKEN
+#undef QUICKEN_GLOBAL
+
+// A job of the batch mode, an instance of the instance mode
+static void run_job(void) {
+    reset_interpreter();
+    if (checkpoint_restore_path != NULL) {
+        resume_checkpoint();
+    }
+    interpret(stdout);
+}
+
+static const char* USAGE =
+    "Usage: interpreter [options] file.bc\n"
+    "  -p, --profile-opcodes   count executed opcodes and report them at exit\n"
+    "  --profile-cycles        also measure cycles spent per opcode (implies -p)\n"
+    "  --profile-json FILE     where the JSON opcode report goes, opcodes.json by default\n"
+    "  -f, --profile-functions attribute calls and cycles to functions and report them at exit\n"
+    "  --profile-folded FILE   where the folded stacks go, functions.folded by default\n"
+    "  -s, --profile-samples   sample the call stack on a CPU time timer and report the samples at exit\n"
+    "  --sample-rate HZ        samples per second of CPU time, 100 by default\n"
+    "  --sample-folded FILE    where the sampled folded stacks go, samples.folded by default\n"
+    "  --profile-top N         number of functions, call edges or lines in the summaries, 20 by default\n"
+    "  --no-jit                never compile functions to native code\n"
+    "  --jit-threshold N       compile a function after N entries and back-edges, 100 by default\n"
+    "  --registers             run the register form of the program (see registers.h), never JIT-compiled\n"
+    "  --no-quickening         never specialize instructions after their first run\n"
+    "  --stack-size MB         size of the operand stack, 4 MB by default\n"
+    "  --call-depth N          maximum number of nested calls, 262144 by default\n"
+    "  --fiber-stack KB        size of the operand stack of a fiber, 256 KB by default\n"
+    "  --nursery KB            size of the nursery of the generational GC, 1024 KB by default,\n"
+    "                          0 to collect the whole heap every time\n"
+    "  --gc-threads N          number of threads marking large heaps, one per core by default\n"
+    "                          (one per instance with --instances)\n"
+    "  --serve                 run the program once per job read from stdin (see server.h)\n"
+    "  --serve-socket PATH     run the program once per job sent to the Unix socket PATH\n"
+    "  --checkpoint-save FILE  save the state of the program to FILE when it calls its\n"
+    "                          public function `checkpoint`, then go on\n"
+    "  --checkpoint-restore FILE\n"
+    "                          resume the program from the checkpoint in FILE\n"
+    "  --instances N           run N independent instances of the program (see instances.h)\n"
+    "  --threads N             number of threads running the instances, one per core by default\n"
+    "  --instance-inputs       read an input for every instance, framed as the jobs of --serve\n";
+
+enum {
+    OPTION_PROFILE_CYCLES = 256,
+    OPTION_PROFILE_JSON,
+    OPTION_PROFILE_FOLDED,
+    OPTION_SAMPLE_RATE,
+    OPTION_SAMPLE_FOLDED,
+    OPTION_PROFILE_TOP,
+    OPTION_NO_JIT,
+    OPTION_JIT_THRESHOLD,
+    OPTION_REGISTERS,
+    OPTION_NO_QUICKENING,
+    OPTION_STACK_SIZE,
+    OPTION_CALL_DEPTH,
+    OPTION_FIBER_STACK,
+    OPTION_NURSERY,
+    OPTION_GC_THREADS,
+    OPTION_SERVE,
+    OPTION_SERVE_SOCKET,
+    OPTION_CHECKPOINT_SAVE,
+    OPTION_CHECKPOINT_RESTORE,
+    OPTION_INSTANCES,
+    OPTION_THREADS,
+    OPTION_INSTANCE_INPUTS
+};
 
-        switch (high_part) {
-            case BINOP:
-                binary_operation(low_part - 1);
+int main(int argc, char* argv[]) {
+    static const struct option options[] = {
+        {"profile-opcodes", no_argument, NULL, 'p'},
+        {"profile-cycles", no_argument, NULL, OPTION_PROFILE_CYCLES},
+        {"profile-json", required_argument, NULL, OPTION_PROFILE_JSON},
+        {"profile-functions", no_argument, NULL, 'f'},
+        {"profile-folded", required_argument, NULL, OPTION_PROFILE_FOLDED},
+        {"profile-samples", no_argument, NULL, 's'},
+        {"sample-rate", required_argument, NULL, OPTION_SAMPLE_RATE},
+        {"sample-folded", required_argument, NULL, OPTION_SAMPLE_FOLDED},
+        {"profile-top", required_argument, NULL, OPTION_PROFILE_TOP},
+        {"no-jit", no_argument, NULL, OPTION_NO_JIT},
+        {"jit-threshold", required_argument, NULL, OPTION_JIT_THRESHOLD},
+        {"registers", no_argument, NULL, OPTION_REGISTERS},
+        {"no-quickening", no_argument, NULL, OPTION_NO_QUICKENING},
+        {"stack-size", required_argument, NULL, OPTION_STACK_SIZE},
+        {"call-depth", required_argument, NULL, OPTION_CALL_DEPTH},
+        {"fiber-stack", required_argument, NULL, OPTION_FIBER_STACK},
+        {"nursery", required_argument, NULL, OPTION_NURSERY},
+        {"gc-threads", required_argument, NULL, OPTION_GC_THREADS},
+        {"serve", no_argument, NULL, OPTION_SERVE},
+        {"serve-socket", required_argument, NULL, OPTION_SERVE_SOCKET},
+        {"checkpoint-save", required_argument, NULL, OPTION_CHECKPOINT_SAVE},
+        {"checkpoint-restore", required_argument, NULL, OPTION_CHECKPOINT_RESTORE},
+        {"instances", required_argument, NULL, OPTION_INSTANCES},
+        {"threads", required_argument, NULL, OPTION_THREADS},
+        {"instance-inputs", no_argument, NULL, OPTION_INSTANCE_INPUTS},
+        {NULL, 0, NULL, 0},
+    };
+    bool profile = false, profile_cycles = false, profile_functions = false;
+    const char* profile_json = "opcodes.json";
+    const char* profile_folded = "functions.folded";
+    bool profile_samples = false;
+    uint32_t sample_rate = DEFAULT_SAMPLE_RATE;
+    const char* sample_folded = "samples.folded";
+    size_t profile_top = 20;
+    bool jit = true;
+    uint32_t jit_threshold = JIT_DEFAULT_THRESHOLD;
+    bool registers = false;
+    bool serve = false;
+    const char* serve_socket_path = NULL;
+    size_t instances = 0;
+    size_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+    bool instance_inputs = false;
+    size_t gc_threads = 0;
+    int option;
+
+    while ((option = getopt_long(argc, argv, "pfs", options, NULL)) != -1) {
+        switch (option) {
+            case 'p':
+                profile = true;
+                break;
+            case OPTION_PROFILE_CYCLES:
+                profile = profile_cycles = true;
+                break;
+            case OPTION_PROFILE_JSON:
+                profile_json = optarg;
+                break;
+            case 'f':
+                profile_functions = true;
+                break;
+            case OPTION_PROFILE_FOLDED:
+                profile_folded = optarg;
+                break;
+            case 's':
+                profile_samples = true;
                 break;
-            case H1_OPS: {
-                bool exit = execute_h1_operation(low_part);
-                if (exit) {
-                    return;
+            case OPTION_SAMPLE_RATE:
+                sample_rate = strtoul(optarg, NULL, 10);
+                if (sample_rate == 0 || sample_rate > 1000000) {
+                    failure("ERROR: the sample rate is between 1 and 1000000 per second.\n");
                 }
                 break;
-            }
-            case LD:
-                ld(low_part, next_int());
+            case OPTION_SAMPLE_FOLDED:
+                sample_folded = optarg;
                 break;
-            case LDA:
-                lda(low_part, next_int());
+            case OPTION_PROFILE_TOP:
+                profile_top = strtoul(optarg, NULL, 10);
                 break;
-            case ST:
-                st(low_part, next_int());
+            case OPTION_NO_JIT:
+                jit = false;
                 break;
-            case H5_OPS: {
-                execute_h5_operation(low_part);
+            case OPTION_JIT_THRESHOLD:
+                jit_threshold = strtoul(optarg, NULL, 10);
                 break;
-            }
-            case PATT:
-                match_pattern(low_part);
+            case OPTION_REGISTERS:
+                registers = true;
                 break;
-
-            case HI_BUILTIN: {
-                execute_builtin_operation(low_part);
+            case OPTION_NO_QUICKENING:
+                quickening = false;
+                break;
+            case OPTION_STACK_SIZE:
+                stack_size = strtoul(optarg, NULL, 10) << 20;
+                break;
+            case OPTION_CALL_DEPTH:
+                call_depth = strtoul(optarg, NULL, 10);
+                break;
+            case OPTION_FIBER_STACK:
+                fiber_stack_size = strtoul(optarg, NULL, 10) << 10;
+                if (fiber_stack_size == 0) {
+                    failure("ERROR: the stack of a fiber takes 1 KB at least.\n");
+                }
+                break;
+            case OPTION_NURSERY:
+                nursery_size = strtoul(optarg, NULL, 10) << 10;
+                break;
+            case OPTION_GC_THREADS:
+                gc_threads = strtoul(optarg, NULL, 10);
+                if (gc_threads == 0) {
+                    failure("ERROR: the heap is marked by one thread at least.\n");
+                }
+                break;
+            case OPTION_SERVE:
+                serve = true;
+                break;
+            case OPTION_SERVE_SOCKET:
+                serve_socket_path = optarg;
+                break;
+            case OPTION_CHECKPOINT_SAVE:
+                checkpoint_save_path = optarg;
+                break;
+            case OPTION_CHECKPOINT_RESTORE:
+                checkpoint_restore_path = optarg;
+                break;
+            case OPTION_INSTANCES:
+                instances = strtoul(optarg, NULL, 10);
+                break;
+            case OPTION_THREADS:
+                threads = strtoul(optarg, NULL, 10);
+                break;
+            case OPTION_INSTANCE_INPUTS:
+                instance_inputs = true;
                 break;
-            }
             default:
-                failure("ERROR: Invalid opcode %d-%d.\n", high_part, low_part);
-                return;
+                failure("%s", USAGE);
         }
     }
-    return;
-}
+    if (optind >= argc) {
+        failure("ERROR: provide bytecode file.\n%s", USAGE);
+    }
+    if (checkpoint_restore_path != NULL && profile_functions) {
+        // the calls made before the checkpoint are not known to the profiler
+        failure("ERROR: functions cannot be profiled from a checkpoint.\n");
+    }
+    if (instances > 0 && (profile || profile_functions || profile_samples || checkpoint_save_path != NULL ||
+                          serve || serve_socket_path != NULL)) {
+        // the profiles and the checkpoint marker are shared by all the threads
+        failure("ERROR: instances cannot be profiled, checkpointed or served.\n");
+    }
+    if (instance_inputs && instances == 0) {
+        failure("ERROR: --instance-inputs needs --instances.\n");
+    }
+    if (profile_samples && (profile || profile_functions)) {
+        // all of them hook into the dispatch of function entries
+        failure("ERROR: the sampling profiler does not run along with the other profilers.\n");
+    }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        failure("ERROR: provide bytecode file.\n");
+    if (registers && (checkpoint_save_path != NULL || checkpoint_restore_path != NULL)) {
+        // a checkpoint refers to instructions of the stack form
+        failure("ERROR: checkpoints are only taken and restored in the stack form of the program.\n");
+    }
+
+    bf = read_file(argv[optind]);
+    verify_bytefile(bf);
+    prog = decode_bytefile(bf);
+    verify_stack_depths(prog);
+    if (registers) {
+        prog = translate_to_registers(prog);
+    }
+    fuse_superinstructions(prog);
+    mark_tail_calls(prog);
+    specialize_integer_operators(prog);
+    // every thread the program runs on has a nursery of this size
+    __gc_set_nursery(nursery_size / sizeof(size_t));
+    // the threads running instances are busy enough marking heaps of their own
+    if (gc_threads == 0) {
+        gc_threads = instances > 0 ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    __gc_set_mark_threads(gc_threads);
+    init_interpreter();
+    // the address of a global is the one of the machine of the thread
+    quicken_globals = quickening && instances == 0;
+    if (checkpoint_save_path != NULL) {
+        checkpoint_at = checkpoint_marker(bf, prog);
+        if (checkpoint_at == NULL) {
+            failure("ERROR: the program has no public function `checkpoint` to save a checkpoint at.\n");
+        }
+    }
+    if (profile) {
+        start_opcode_profiler(profile_cycles, profile_json);
+    }
+    if (profile_functions) {
+        start_function_profiler(bf, prog, profile_folded, profile_top);
+    }
+    if (profile_samples) {
+        start_sampling_profiler(bf, prog, sample_folded, profile_top, sample_rate);
+    }
+#ifdef LAMA_JIT
+    // compiled code bypasses the per-instruction hooks the profilers rely on, is
+    // bound to the stacks of the main thread and only made of stack code
+    if (jit && !registers && !profile && !profile_functions && !profile_samples && instances == 0) {
+        jit_layout layout = {
+            .globals = globals,
+            .stack_empty = (int32_t*)__gc_stack_bottom - 1,
+            .frames = frame_stack,
+        };
+        start_jit(prog, &layout, jit_threshold);
+    }
+#endif
+    if (instances > 0) {
+        return run_instances(instances, threads, instance_inputs, init_interpreter, run_job);
+    } else if (serve_socket_path != NULL) {
+        serve_socket(serve_socket_path, run_job);
+    } else if (serve) {
+        serve_stdio(run_job);
+    } else {
+        if (checkpoint_restore_path != NULL) {
+            resume_checkpoint();
+        }
+        interpret(stdout);
     }
-    bf = read_file(argv[1]);
-    init_interpreter(bf->global_area_size);
-    interpret(stdout);
     return 0;
 }
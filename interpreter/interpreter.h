@@ -1,24 +1,28 @@
+#ifndef __LAMA_INTERPRETER__
+#define __LAMA_INTERPRETER__
+
 #include <stddef.h>
 #include <stdint.h>
 
+#include "loader.h"
+
 enum { PLUS, MINUS, MULTIPLY, DIVIDE, MOD, LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL, NOT_EQUAL, AND, OR };
 #define BINOPS(op)                                                            \
     op(PLUS, +) op(MINUS, -) op(MULTIPLY, *) op(DIVIDE, /) op(MOD, %) op(LESS, <) op(LESS_EQUAL, <=) \
     op(GREATER, >) op(GREATER_EQUAL, >=) op(EQUAL, ==) op(NOT_EQUAL, !=) op(AND, &&) op(OR, ||)
 
-typedef struct {
-    const char* string_ptr;
-    const int* public_ptr;
-    const uint8_t* code_ptr;
-    const int* global_ptr;
-    unsigned int string_table_size;
-    unsigned int global_area_size;
-    unsigned int public_symbols_number;
-    char buffer[0];
-} bytefile;
+// Default limits of the operand stack (in bytes, the global area included) and of
+// the call stack (in nested calls), see --stack-size and --call-depth
+#define DEFAULT_STACK_SIZE (4 << 20)
+#define DEFAULT_CALL_DEPTH (1 << 18)
+
+// Default size of the nursery of the generational collector (in bytes), see --nursery
+#define DEFAULT_NURSERY_SIZE (1 << 20)
 
-#define STACK_SIZE (1 << 20)
-#define MEM_SIZE (STACK_SIZE)
+#define OPCODE(high, low) ((uint8_t)(((high) << 4) | (low)))
+#define OPCODE_HIGH(opcode) (((opcode) & 0xF0) >> 4)
+#define OPCODE_LOW(opcode) ((opcode) & 0x0F)
+#define STOP_OPCODE 0xFF
 
 enum {
     str_literal,
@@ -76,6 +80,7 @@ enum {
     BUILTIN_LENGTH,
     BUILTIN_STRING,
     BUILTIN_ARRAY,
+    BUILTIN_EXTERN,
 };
 
 enum {
@@ -83,4 +88,6 @@ enum {
     LOCATION_LOCAL,
     LOCATION_ARGUMENT,
     LOCATION_CLOSURE
-};
\ No newline at end of file
+};
+
+#endif
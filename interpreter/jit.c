@@ -0,0 +1,1115 @@
+#include "jit.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../runtime/gc.h"
+#include "../runtime/runtime.h"
+#include "../runtime/runtime_common.h"
+#include "superinstructions.h"
+
+bool jit_enabled = false;
+
+#ifdef LAMA_JIT
+
+extern _Thread_local size_t __gc_stack_top;
+
+// Runtime functions compiled code calls the same way the interpreter does
+extern void* Bstring(void* p);
+extern void* Belem(void* p, int i);
+extern void* Bsta(void* v, int i, void* x);
+extern int Btag(void* d, int t, int n);
+extern int Barray_patt(void* d, int n);
+extern int Bstring_patt(void* x, void* y);
+extern int Lread();
+extern int Lwrite(int n);
+extern int Llength(void* p);
+extern void* Lstring(void* p);
+extern void* alloc_array(int len);
+extern void* alloc_sexp(int members);
+
+// Compiled stores to fields of objects call it before storing
+static void write_barrier(void* slot, void* value) { __gc_write_barrier(slot, value); }
+
+// every function is compiled into a single region of this size
+#define JIT_CODE_SIZE (16 << 20)
+// upper bound of the code emitted for a single instruction
+#define MAX_TEMPLATE_SIZE 512
+// arrays and s-expressions up to this size are filled in by unrolled code
+#define MAX_UNROLLED_ELEMENTS 16
+// stack space compiled code reserves for the arguments of runtime calls (and a
+// spill slot), keeps esp 16-byte aligned at every call
+#define NATIVE_FRAME_SIZE 28
+
+static const int32_t EMPTY_BOX = BOX(0);
+
+// Compiled code keeps sp in esi, fp in edi and the jit_registers it has been
+// entered with in ebx, all of them callee-saved, so runtime calls preserve them;
+// eax, ecx and edx are scratch registers.
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+#define CC_ALWAYS (-1)
+
+enum { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29, ALU_XOR = 0x31, ALU_CMP = 0x39 };
+enum { EXT_ADD = 0, EXT_OR = 1, EXT_AND = 4, EXT_SUB = 5, EXT_XOR = 6, EXT_CMP = 7 };
+
+typedef enum { INTERPRETED, COMPILED, FAILED } function_state;
+
+typedef struct {
+    // instructions of the function, from its BEGIN up to the next one
+    size_t begin;
+    size_t end;
+    uint32_t counter;
+    function_state state;
+} function_info;
+
+typedef struct {
+    // address of a rel32 operand and the instruction it has to reach
+    uint8_t* site;
+    size_t target;
+} fixup;
+
+typedef struct {
+    uint8_t* p;
+    uint8_t* end;
+    const function_info* f;
+    // native address of every instruction of the function, indexed from f->begin
+    uint8_t** labels;
+    fixup* fixups;
+    size_t fixups_count;
+    size_t fixups_capacity;
+} assembler;
+
+static program* prog;
+static jit_layout layout;
+static uint32_t threshold;
+// sizeof(instruction) = odd << instruction_shift, so that an index is recovered
+// from an instruction pointer by a shift and a multiplication by the inverse of odd
+static int instruction_shift;
+static uint32_t instruction_inverse;
+
+static function_info* functions;
+static int32_t* function_of;
+static uint8_t* leaders;
+static const void** entries;
+
+static uint8_t* code;
+static uint8_t* code_top;
+static const instruction* (*trampoline)(jit_registers*, const void*);
+static uint8_t* epilogue;
+static uint8_t* underflow_stub;
+static uint8_t* not_closure_stub;
+static uint8_t* binop_stub;
+static uint8_t* transfer_stub;
+
+static void* allocate(size_t size) {
+    void* p = calloc(size, 1);
+    if (!p) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    return p;
+}
+
+static void set_writable(bool writable) {
+    if (mprotect(code, JIT_CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == -1) {
+        failure("ERROR: unable to change the protection of compiled code.\n");
+    }
+}
+
+// Encoding helpers; memory operands are always [base + disp]
+static inline void emit8(assembler* a, uint8_t byte) { *a->p++ = byte; }
+
+static inline void emit32(assembler* a, int32_t value) {
+    memcpy(a->p, &value, sizeof(int32_t));
+    a->p += sizeof(int32_t);
+}
+
+static void emit_modrm(assembler* a, int reg, int base, int32_t disp) {
+    bool short_disp = disp >= -128 && disp <= 127;
+    emit8(a, (short_disp ? 0x40 : 0x80) | reg << 3 | base);
+    if (base == ESP) {
+        emit8(a, 0x24);
+    }
+    if (short_disp) {
+        emit8(a, (uint8_t)disp);
+    } else {
+        emit32(a, disp);
+    }
+}
+
+static void emit_load(assembler* a, int reg, int base, int32_t disp) {
+    emit8(a, 0x8B);
+    emit_modrm(a, reg, base, disp);
+}
+
+static void emit_store(assembler* a, int base, int32_t disp, int reg) {
+    emit8(a, 0x89);
+    emit_modrm(a, reg, base, disp);
+}
+
+static void emit_store_imm(assembler* a, int base, int32_t disp, int32_t value) {
+    emit8(a, 0xC7);
+    emit_modrm(a, 0, base, disp);
+    emit32(a, value);
+}
+
+// mov reg, [table + index * 4]
+static void emit_load_indexed(assembler* a, int reg, const void* table, int index) {
+    emit8(a, 0x8B);
+    emit8(a, reg << 3 | ESP);
+    emit8(a, 0x80 | index << 3 | EBP);
+    emit32(a, (int32_t)table);
+}
+
+static void emit_lea(assembler* a, int reg, int base, int32_t disp) {
+    emit8(a, 0x8D);
+    emit_modrm(a, reg, base, disp);
+}
+
+static void emit_store_absolute(assembler* a, const void* address, int reg) {
+    emit8(a, 0x89);
+    emit8(a, reg << 3 | 0x05);
+    emit32(a, (int32_t)address);
+}
+
+static void emit_mov_imm(assembler* a, int reg, int32_t value) {
+    emit8(a, 0xB8 + reg);
+    emit32(a, value);
+}
+
+static void emit_mov(assembler* a, int dst, int src) {
+    emit8(a, 0x89);
+    emit8(a, 0xC0 | src << 3 | dst);
+}
+
+static void emit_alu(assembler* a, int op, int dst, int src) {
+    emit8(a, op);
+    emit8(a, 0xC0 | src << 3 | dst);
+}
+
+static void emit_alu_imm(assembler* a, int ext, int reg, int32_t value) {
+    if (value >= -128 && value <= 127) {
+        emit8(a, 0x83);
+        emit8(a, 0xC0 | ext << 3 | reg);
+        emit8(a, (uint8_t)value);
+    } else {
+        emit8(a, 0x81);
+        emit8(a, 0xC0 | ext << 3 | reg);
+        emit32(a, value);
+    }
+}
+
+static void emit_test(assembler* a, int reg1, int reg2) {
+    emit8(a, 0x85);
+    emit8(a, 0xC0 | reg2 << 3 | reg1);
+}
+
+static void emit_test_imm(assembler* a, int reg, int32_t value) {
+    emit8(a, 0xF7);
+    emit8(a, 0xC0 | reg);
+    emit32(a, value);
+}
+
+// sar reg, 1
+static void emit_unbox(assembler* a, int reg) {
+    emit8(a, 0xD1);
+    emit8(a, 0xF8 | reg);
+}
+
+static void emit_box(assembler* a, int reg) {
+    emit_alu(a, ALU_ADD, reg, reg);
+    emit_alu_imm(a, EXT_OR, reg, 1);
+}
+
+// setcc on the low byte of reg, zero-extended to the whole register
+static void emit_setcc(assembler* a, int cc, int reg) {
+    emit8(a, 0x0F);
+    emit8(a, 0x90 + cc);
+    emit8(a, 0xC0 | reg);
+    emit8(a, 0x0F);
+    emit8(a, 0xB6);
+    emit8(a, 0xC0 | reg << 3 | reg);
+}
+
+static void emit_rel32(assembler* a, const uint8_t* target) {
+    emit32(a, (int32_t)(target - (a->p + sizeof(int32_t))));
+}
+
+static void emit_jmp(assembler* a, const uint8_t* target) {
+    emit8(a, 0xE9);
+    emit_rel32(a, target);
+}
+
+static void emit_jcc(assembler* a, int cc, const uint8_t* target) {
+    emit8(a, 0x0F);
+    emit8(a, 0x80 + cc);
+    emit_rel32(a, target);
+}
+
+static void emit_call(assembler* a, const void* function) {
+    emit8(a, 0xE8);
+    emit_rel32(a, function);
+}
+
+// Short forward conditional jump, the returned site is resolved by land()
+static uint8_t* emit_jcc8(assembler* a, int cc) {
+    emit8(a, 0x70 + cc);
+    emit8(a, 0);
+    return a->p - 1;
+}
+
+static void land(assembler* a, uint8_t* site) { *site = (uint8_t)(a->p - (site + 1)); }
+
+// Operand stack templates: the stack grows down and esi points to its first free slot
+// Checks that n values can be popped, only in the interpreters built with
+// LAMA_RUNTIME_CHECKS: the verifier has checked the depth of the stack otherwise
+static void emit_require(assembler* a, int32_t n) {
+#ifdef LAMA_RUNTIME_CHECKS
+    // popping n values needs sp + n - 1 < stack_empty
+    emit8(a, 0x81);
+    emit8(a, 0xC0 | EXT_CMP << 3 | ESI);
+    emit32(a, (int32_t)(layout.stack_empty - (n - 1)));
+    emit_jcc(a, CC_AE, underflow_stub);
+#else
+    (void)a, (void)n;
+#endif
+}
+
+static void emit_push(assembler* a, int reg) {
+    emit_store(a, ESI, 0, reg);
+    emit_alu_imm(a, EXT_SUB, ESI, sizeof(int32_t));
+}
+
+static void emit_push_imm(assembler* a, int32_t value) {
+    emit_store_imm(a, ESI, 0, value);
+    emit_alu_imm(a, EXT_SUB, ESI, sizeof(int32_t));
+}
+
+static void emit_pop(assembler* a, int reg) {
+    emit_require(a, 1);
+    emit_alu_imm(a, EXT_ADD, ESI, sizeof(int32_t));
+    emit_load(a, reg, ESI, 0);
+}
+
+static void emit_peek(assembler* a, int reg) { emit_load(a, reg, ESI, sizeof(int32_t)); }
+
+// The same safepoint as SAVE_REGISTERS in the interpreter: the GC scans the
+// operand stack up to __gc_stack_top
+static void emit_save(assembler* a) { emit_store_absolute(a, &__gc_stack_top, ESI); }
+
+static void emit_arg(assembler* a, int i, int reg) { emit_store(a, ESP, i * sizeof(int32_t), reg); }
+
+static void emit_arg_imm(assembler* a, int i, int32_t value) { emit_store_imm(a, ESP, i * sizeof(int32_t), value); }
+
+// Leaves compiled code, the interpreter continues at `insn`
+static void emit_leave(assembler* a, const instruction* insn) {
+    emit_mov_imm(a, EAX, (int32_t)insn);
+    emit_jmp(a, epilogue);
+}
+
+// Continues at the instruction whose index is in eax: in its compiled code if
+// there is one by now, otherwise in the interpreter
+static void emit_dispatch(assembler* a) {
+    emit_load_indexed(a, EDX, entries, EAX);
+    emit_test(a, EDX, EDX);
+    emit_jcc(a, CC_E, transfer_stub);
+    emit8(a, 0xFF);  // jmp edx
+    emit8(a, 0xE0 | EDX);
+}
+
+// Jumps to an instruction, either inside the function being compiled or anywhere else
+static void emit_jump(assembler* a, int cc, const instruction* target) {
+    size_t index = target - prog->code;
+    if (index >= a->f->begin && index < a->f->end) {
+        if (cc == CC_ALWAYS) {
+            emit8(a, 0xE9);
+        } else {
+            emit8(a, 0x0F);
+            emit8(a, 0x80 + cc);
+        }
+        if (a->fixups_count == a->fixups_capacity) {
+            a->fixups_capacity = a->fixups_capacity ? a->fixups_capacity * 2 : 16;
+            a->fixups = realloc(a->fixups, a->fixups_capacity * sizeof(fixup));
+            if (!a->fixups) {
+                failure("ERROR: unable to allocate memory.\n");
+            }
+        }
+        a->fixups[a->fixups_count++] = (fixup){.site = a->p, .target = index};
+        emit32(a, 0);
+    } else if (cc != CC_ALWAYS) {
+        uint8_t* skip = emit_jcc8(a, cc ^ 1);
+        emit_jump(a, CC_ALWAYS, target);
+        land(a, skip);
+    } else if (entries[index]) {
+        emit_jmp(a, entries[index]);
+    } else {
+        emit_mov_imm(a, EAX, index);
+        emit_dispatch(a);
+    }
+}
+
+// Fails the same way as get_closure_content unless reg points to a closure; uses ecx
+static void emit_check_closure(assembler* a, int reg) {
+    emit_load(a, ECX, reg, -(int32_t)DATA_HEADER_SZ + offsetof(data, data_header));
+    emit_alu_imm(a, EXT_AND, ECX, 7);
+    emit_alu_imm(a, EXT_CMP, ECX, CLOSURE_TAG);
+    emit_jcc(a, CC_NE, not_closure_stub);
+}
+
+// The same as push_frame in the interpreter, the closure slot is either in
+// edx or absent; uses ecx
+static void emit_push_frame(assembler* a, const instruction* return_ip, bool closure) {
+    emit_load(a, ECX, EBX, offsetof(jit_registers, frame));
+    emit_alu_imm(a, EXT_ADD, ECX, sizeof(call_frame));
+    emit_store(a, EBX, offsetof(jit_registers, frame), ECX);
+    emit_store_imm(a, ECX, offsetof(call_frame, return_ip), (int32_t)return_ip);
+    emit_store(a, ECX, offsetof(call_frame, caller_fp), EDI);
+    if (closure) {
+        emit_store(a, ECX, offsetof(call_frame, closure), EDX);
+    } else {
+        emit_store_imm(a, ECX, offsetof(call_frame, closure), 0);
+    }
+}
+
+// Allocates an array or an s-expression from the n topmost values, as
+// call_barray and call_bsexp do
+static void emit_aggregate(assembler* a, int32_t n, bool sexp, int32_t tag_hash) {
+    // fields of an s-expression follow its tag
+    int32_t first = offsetof(data, contents) + (sexp ? sizeof(int32_t) : 0);
+    if (n > 0) {
+        emit_require(a, n);
+    }
+    emit_save(a);
+    emit_arg_imm(a, 0, n);
+    emit_call(a, sexp ? alloc_sexp : alloc_array);
+    for (int32_t i = 0; i < n; i++) {
+        emit_load(a, ECX, ESI, (n - i) * sizeof(int32_t));
+        emit_store(a, EAX, first + i * sizeof(int32_t), ECX);
+    }
+    if (sexp) {
+        emit_store_imm(a, EAX, offsetof(data, contents), UNBOX(tag_hash));
+    }
+    emit_alu_imm(a, EXT_ADD, EAX, offsetof(data, contents));
+    if (n > 0) {
+        emit_alu_imm(a, EXT_ADD, ESI, n * sizeof(int32_t));
+    }
+    emit_push(a, EAX);
+}
+
+// Returns the base register of a variable address, [base + *disp]; uses edx
+// unless the variable is fp-relative
+static int emit_variable(assembler* a, int location, const instruction* insn, int32_t* disp) {
+    int32_t n = insn->a.n;
+    switch (location) {
+        case LOCATION_GLOBAL:
+            emit_mov_imm(a, EDX, (int32_t)(layout.globals + n));
+            *disp = 0;
+            return EDX;
+        case LOCATION_LOCAL:
+        case LOCATION_ARGUMENT:
+            *disp = n * sizeof(int32_t);
+            return EDI;
+        default:
+            // the contents of the closure the function has been called through,
+            // from its slot above the arguments as closure_address does
+            emit_load(a, EDX, EDI, insn->b.n * sizeof(int32_t));
+            *disp = n * sizeof(int32_t);
+            return EDX;
+    }
+}
+
+// Calls the write barrier for the store of the value on top of the stack to a
+// captured variable, which lives in a closure
+static void emit_closure_barrier(assembler* a, const instruction* insn) {
+    int32_t disp;
+    int base = emit_variable(a, LOCATION_CLOSURE, insn, &disp);
+    emit_lea(a, ECX, base, disp);
+    emit_peek(a, EAX);
+    emit_arg(a, 0, ECX);
+    emit_arg(a, 1, EAX);
+    emit_call(a, write_barrier);
+}
+
+// eax = eax <op> ecx on boxed operands, as evaluate_binop does: the operands are
+// checked to be integers but for == and != or when `integers` tells they are
+// proven ones (see integers.h), and worked on without unboxing wherever boxing
+// commutes with the operator
+static void emit_binop(assembler* a, int32_t operator_code, bool integers) {
+    static const char* const symbols[] = {
+#define BINOP_SYMBOL(n, op) [n] = #op,
+        BINOPS(BINOP_SYMBOL)
+#undef BINOP_SYMBOL
+    };
+
+    if (!integers && operator_code != EQUAL && operator_code != NOT_EQUAL) {
+        emit_mov(a, EDX, EAX);
+        emit_alu(a, ALU_AND, EDX, ECX);
+        emit_test_imm(a, EDX, 1);
+        uint8_t* tagged = emit_jcc8(a, CC_NE);
+        emit_mov_imm(a, EDX, (int32_t)symbols[operator_code]);
+        emit_jmp(a, binop_stub);
+        land(a, tagged);
+    }
+    switch (operator_code) {
+        case PLUS:
+            emit_alu(a, ALU_ADD, EAX, ECX);
+            emit_alu_imm(a, EXT_SUB, EAX, 1);
+            return;
+        case MINUS:
+            emit_alu(a, ALU_SUB, EAX, ECX);
+            emit_alu_imm(a, EXT_ADD, EAX, 1);
+            return;
+        case MULTIPLY:
+            emit_alu_imm(a, EXT_SUB, EAX, 1);
+            emit_unbox(a, ECX);
+            emit8(a, 0x0F);  // imul eax, ecx
+            emit8(a, 0xAF);
+            emit8(a, 0xC0 | EAX << 3 | ECX);
+            emit_alu_imm(a, EXT_ADD, EAX, 1);
+            return;
+        case DIVIDE:
+        case MOD:
+            emit_unbox(a, EAX);
+            emit_unbox(a, ECX);
+            emit8(a, 0x99);  // cdq
+            emit8(a, 0xF7);  // idiv ecx
+            emit8(a, 0xF8 | ECX);
+            if (operator_code == MOD) {
+                emit_mov(a, EAX, EDX);
+            }
+            break;
+        case LESS:
+        case LESS_EQUAL:
+        case GREATER:
+        case GREATER_EQUAL:
+        case EQUAL:
+        case NOT_EQUAL: {
+            static const int conditions[] = {
+                [LESS] = CC_L, [LESS_EQUAL] = CC_LE, [GREATER] = CC_G,
+                [GREATER_EQUAL] = CC_GE, [EQUAL] = CC_E, [NOT_EQUAL] = CC_NE};
+            emit_alu(a, ALU_CMP, EAX, ECX);
+            emit_setcc(a, conditions[operator_code], EAX);
+            break;
+        }
+        case AND:
+        case OR:
+            emit_alu_imm(a, EXT_CMP, EAX, EMPTY_BOX);
+            emit_setcc(a, CC_NE, EAX);
+            emit_alu_imm(a, EXT_CMP, ECX, EMPTY_BOX);
+            emit_setcc(a, CC_NE, ECX);
+            emit_alu(a, operator_code == AND ? ALU_AND : ALU_OR, EAX, ECX);
+            break;
+    }
+    emit_box(a, EAX);
+}
+
+// eax = boxed result of matching eax against a PATT_* pattern but the string literal one
+static void emit_match_pattern(assembler* a, int32_t patt_type) {
+    static const int tags[] = {
+        [string_type] = STRING_TAG, [array_type] = ARRAY_TAG, [sexp_type] = SEXP_TAG, [closure_type] = CLOSURE_TAG};
+
+    switch (patt_type) {
+        case val_type:
+            emit_alu_imm(a, EXT_AND, EAX, 1);
+            break;
+        case ref_type:
+            emit_alu_imm(a, EXT_AND, EAX, 1);
+            emit_alu_imm(a, EXT_XOR, EAX, 1);
+            break;
+        default: {
+            emit_alu(a, ALU_XOR, EDX, EDX);
+            emit_test_imm(a, EAX, 1);
+            uint8_t* unboxed = emit_jcc8(a, CC_NE);
+            emit_load(a, ECX, EAX, -(int32_t)DATA_HEADER_SZ + offsetof(data, data_header));
+            emit_alu_imm(a, EXT_AND, ECX, 7);
+            emit_alu_imm(a, EXT_CMP, ECX, tags[patt_type]);
+            emit_setcc(a, CC_E, EDX);
+            land(a, unboxed);
+            emit_mov(a, EAX, EDX);
+        }
+    }
+    emit_box(a, EAX);
+}
+
+static int location_of(int32_t opcode, int32_t group) { return opcode - group; }
+
+// Emits the template of an instruction; returns false if the instruction is
+// left to the interpreter. Instructions the interpreter has quickened keep the
+// operands of their generic form and get its template.
+static bool compile_instruction(assembler* a, const instruction* insn) {
+    int32_t opcode = generic_opcode(insn->opcode);
+    int32_t disp;
+    int base;
+
+    if (opcode >= OP_BINOP_PLUS && opcode <= OP_BINOP_OR) {
+        emit_require(a, 2);
+        emit_load(a, ECX, ESI, sizeof(int32_t));
+        emit_load(a, EAX, ESI, 2 * sizeof(int32_t));
+        emit_binop(a, opcode - OP_BINOP_PLUS, false);
+        emit_store(a, ESI, 2 * sizeof(int32_t), EAX);
+        emit_alu_imm(a, EXT_ADD, ESI, sizeof(int32_t));
+        return true;
+    }
+    if (opcode >= OP_FRAME_FRAME_PLUS) {
+        // FRAME_FRAME_<op> and FRAME_CONST_<op> alternate, see decoded_opcode
+        int32_t operator_code = (opcode - OP_FRAME_FRAME_PLUS) / 2;
+        emit_load(a, EAX, EDI, insn->a.n * sizeof(int32_t));
+        if ((opcode - OP_FRAME_FRAME_PLUS) % 2 == 0) {
+            emit_load(a, ECX, EDI, insn->b.n * sizeof(int32_t));
+        } else {
+            emit_mov_imm(a, ECX, insn->b.n);
+        }
+        emit_binop(a, operator_code, insn->opcode >= OP_INT_FRAME_FRAME_PLUS);
+        emit_push(a, EAX);
+        return true;
+    }
+
+    switch (opcode) {
+        case OP_CONST:
+            emit_push_imm(a, insn->a.n);
+            break;
+
+        case OP_STRING:
+            emit_save(a);
+            emit_arg_imm(a, 0, (int32_t)insn->a.string);
+            emit_call(a, Bstring);
+            emit_push(a, EAX);
+            break;
+
+        case OP_SEXP:
+        case OP_BARRAY:
+            if ((opcode == OP_SEXP ? insn->b.n : insn->a.n) > MAX_UNROLLED_ELEMENTS) {
+                emit_leave(a, insn);
+                return false;
+            }
+            if (opcode == OP_SEXP) {
+                emit_aggregate(a, insn->b.n, true, insn->a.n);
+            } else {
+                emit_aggregate(a, insn->a.n, false, 0);
+            }
+            break;
+
+        case OP_STA: {
+            emit_require(a, 2);
+            emit_load(a, EAX, ESI, sizeof(int32_t));
+            emit_load(a, EDX, ESI, 2 * sizeof(int32_t));
+            emit_alu_imm(a, EXT_ADD, ESI, 2 * sizeof(int32_t));
+            emit_test_imm(a, EDX, 1);
+            uint8_t* reference = emit_jcc8(a, CC_E);
+            emit_pop(a, ECX);
+            emit_save(a);
+            emit_arg(a, 0, EAX);
+            emit_arg(a, 1, EDX);
+            emit_arg(a, 2, ECX);
+            emit_arg(a, 3, EAX);
+            emit_call(a, Bsta);
+            emit_load(a, EAX, ESP, 3 * sizeof(int32_t));
+            emit8(a, 0xEB);  // jmp over the store
+            emit8(a, 0);
+            uint8_t* done = a->p - 1;
+            land(a, reference);
+            // the reference may be a captured variable; the copies of the
+            // arguments past the ones of the call survive it
+            emit_arg(a, 0, EDX);
+            emit_arg(a, 1, EAX);
+            emit_arg(a, 2, EDX);
+            emit_arg(a, 3, EAX);
+            emit_call(a, write_barrier);
+            emit_load(a, EDX, ESP, 2 * sizeof(int32_t));
+            emit_load(a, EAX, ESP, 3 * sizeof(int32_t));
+            emit_store(a, EDX, 0, EAX);
+            land(a, done);
+            emit_push(a, EAX);
+            break;
+        }
+
+        case OP_JMP:
+            emit_jump(a, CC_ALWAYS, insn->a.target);
+            break;
+
+        case OP_END: {
+            // the return from the main function ends the program in the interpreter
+            emit_load(a, ECX, EBX, offsetof(jit_registers, frame));
+            emit_alu_imm(a, EXT_CMP, ECX, (int32_t)layout.frames);
+            uint8_t* nested = emit_jcc8(a, CC_NE);
+            emit_leave(a, insn);
+            land(a, nested);
+            emit_pop(a, EAX);
+            // drop the locals, the arguments and the closure the function has been called through
+            emit_load(a, EDX, ECX, offsetof(call_frame, n_args));
+            emit8(a, 0x8D);  // lea esi, [edi + edx * 4]
+            emit8(a, ESI << 3 | ESP);
+            emit8(a, 0x80 | EDX << 3 | EDI);
+            emit_alu(a, ALU_XOR, EDX, EDX);
+            emit8(a, 0x83);  // cmp dword [ecx + closure], 0
+            emit_modrm(a, EXT_CMP, ECX, offsetof(call_frame, closure));
+            emit8(a, 0);
+            emit_setcc(a, CC_NE, EDX);
+            emit8(a, 0x8D);  // lea esi, [esi + edx * 4]
+            emit8(a, ESI << 3 | ESP);
+            emit8(a, 0x80 | EDX << 3 | ESI);
+            emit_store(a, ESI, 0, EAX);
+            emit_alu_imm(a, EXT_SUB, ESI, sizeof(int32_t));
+            emit_load(a, EDI, ECX, offsetof(call_frame, caller_fp));
+            emit_load(a, EAX, ECX, offsetof(call_frame, return_ip));
+            emit_alu_imm(a, EXT_SUB, ECX, sizeof(call_frame));
+            emit_store(a, EBX, offsetof(jit_registers, frame), ECX);
+            // the index of the return instruction
+            emit_alu_imm(a, EXT_SUB, EAX, (int32_t)prog->code);
+            if (instruction_shift > 0) {
+                emit8(a, 0xC1);  // shr eax, shift
+                emit8(a, 0xE8 | EAX);
+                emit8(a, instruction_shift);
+            }
+            emit8(a, 0x69);  // imul eax, eax, inverse
+            emit8(a, 0xC0 | EAX << 3 | EAX);
+            emit32(a, (int32_t)instruction_inverse);
+            emit_dispatch(a);
+            break;
+        }
+
+        case OP_DROP:
+            emit_require(a, 1);
+            emit_alu_imm(a, EXT_ADD, ESI, sizeof(int32_t));
+            break;
+
+        case OP_DUP:
+            emit_peek(a, EAX);
+            emit_push(a, EAX);
+            break;
+
+        case OP_ELEM:
+            emit_require(a, 2);
+            emit_load(a, ECX, ESI, sizeof(int32_t));
+            emit_load(a, EAX, ESI, 2 * sizeof(int32_t));
+            emit_alu_imm(a, EXT_ADD, ESI, 2 * sizeof(int32_t));
+            emit_save(a);
+            emit_arg(a, 0, EAX);
+            emit_arg(a, 1, ECX);
+            emit_call(a, Belem);
+            emit_push(a, EAX);
+            break;
+
+        case OP_LD_GLOBAL:
+        case OP_LD_LOCAL:
+        case OP_LD_ARGUMENT:
+        case OP_LD_CLOSURE:
+            base = emit_variable(a, location_of(opcode, OP_LD_GLOBAL), insn, &disp);
+            emit_load(a, EAX, base, disp);
+            emit_push(a, EAX);
+            break;
+
+        case OP_LDA_GLOBAL:
+        case OP_LDA_LOCAL:
+        case OP_LDA_ARGUMENT:
+        case OP_LDA_CLOSURE:
+            base = emit_variable(a, location_of(opcode, OP_LDA_GLOBAL), insn, &disp);
+            emit_lea(a, EAX, base, disp);
+            emit_push(a, EAX);
+            break;
+
+        case OP_ST_GLOBAL:
+        case OP_ST_LOCAL:
+        case OP_ST_ARGUMENT:
+        case OP_ST_CLOSURE:
+            if (opcode == OP_ST_CLOSURE) {
+                emit_closure_barrier(a, insn);
+            }
+            base = emit_variable(a, location_of(opcode, OP_ST_GLOBAL), insn, &disp);
+            emit_peek(a, EAX);
+            emit_store(a, base, disp, EAX);
+            break;
+
+        case OP_CJMPZ:
+        case OP_CJMPNZ:
+            emit_pop(a, EAX);
+            emit_unbox(a, EAX);
+            emit_test(a, EAX, EAX);
+            emit_jump(a, opcode == OP_CJMPZ ? CC_E : CC_NE, insn->a.target);
+            break;
+
+        case OP_BEGIN:
+        case OP_CBEGIN:
+            emit_load(a, EAX, EBX, offsetof(jit_registers, frame));
+            emit_store_imm(a, EAX, offsetof(call_frame, n_args), insn->a.n);
+            emit_store_imm(a, EAX, offsetof(call_frame, n_locals), insn->b.n);
+            emit_mov(a, EDI, ESI);
+            if (insn->b.n <= 8) {
+                for (int32_t i = 0; i < insn->b.n; i++) {
+                    emit_push_imm(a, EMPTY_BOX);
+                }
+            } else {
+                emit_mov_imm(a, ECX, insn->b.n);
+                uint8_t* loop = a->p;
+                emit_push_imm(a, EMPTY_BOX);
+                emit8(a, 0x48 + ECX);  // dec ecx
+                emit_jcc(a, CC_NE, loop);
+            }
+            break;
+
+        case OP_CALL:
+            emit_push_frame(a, insn + 1, false);
+            emit_jump(a, CC_ALWAYS, insn->a.target);
+            break;
+
+        case OP_CALLC: {
+            int32_t slot = (insn->a.n + 1) * sizeof(int32_t);
+            emit_load(a, EAX, ESI, slot);
+            emit_check_closure(a, EAX);
+            emit_lea(a, EDX, ESI, slot);
+            emit_push_frame(a, insn + 1, true);
+            // the index of the BEGIN at the bytecode offset the closure holds
+            emit_load(a, EAX, EAX, 0);
+            emit_load_indexed(a, EAX, prog->index_by_offset, EAX);
+            emit_dispatch(a);
+            break;
+        }
+
+        case OP_TAIL_CALL:
+        case OP_TAIL_CALLC: {
+            // the closure and the arguments replace the ones of the caller, as reuse_frame does
+            bool closure = opcode == OP_TAIL_CALLC;
+            int32_t n = closure ? insn->a.n + 1 : insn->b.n;
+            if (n > MAX_UNROLLED_ELEMENTS) {
+                emit_leave(a, insn);
+                return false;
+            }
+            if (closure) {
+                emit_load(a, EAX, ESI, n * sizeof(int32_t));
+                emit_check_closure(a, EAX);
+            }
+            emit_load(a, ECX, EBX, offsetof(jit_registers, frame));
+            emit_load(a, EDX, ECX, offsetof(call_frame, n_args));
+            emit8(a, 0x8D);  // lea edx, [edi + edx * 4]
+            emit8(a, EDX << 3 | ESP);
+            emit8(a, 0x80 | EDX << 3 | EDI);
+            emit8(a, 0x83);  // cmp dword [ecx + closure], 0
+            emit_modrm(a, EXT_CMP, ECX, offsetof(call_frame, closure));
+            emit8(a, 0);
+            uint8_t* plain = emit_jcc8(a, CC_E);
+            emit_alu_imm(a, EXT_ADD, EDX, sizeof(int32_t));
+            land(a, plain);
+            if (closure) {
+                emit_store(a, ECX, offsetof(call_frame, closure), EDX);
+            } else {
+                emit_store_imm(a, ECX, offsetof(call_frame, closure), 0);
+            }
+            // the deepest value moves first, to the highest slot, so nothing is overwritten before it is moved
+            for (int32_t i = 0; i < n; i++) {
+                emit_load(a, ECX, ESI, (n - i) * sizeof(int32_t));
+                emit_store(a, EDX, -i * (int32_t)sizeof(int32_t), ECX);
+            }
+            emit_lea(a, ESI, EDX, -n * (int32_t)sizeof(int32_t));
+            if (closure) {
+                emit_load(a, EAX, EDX, 0);
+                emit_load(a, EAX, EAX, 0);
+                emit_load_indexed(a, EAX, prog->index_by_offset, EAX);
+                emit_dispatch(a);
+            } else {
+                emit_jump(a, CC_ALWAYS, insn->a.target);
+            }
+            break;
+        }
+
+        case OP_TAG:
+        case OP_ARRAY:
+            emit_pop(a, EAX);
+            emit_arg(a, 0, EAX);
+            emit_arg_imm(a, 1, insn->a.n);
+            if (opcode == OP_TAG) {
+                emit_arg_imm(a, 2, insn->b.n);
+                emit_call(a, Btag);
+            } else {
+                emit_call(a, Barray_patt);
+            }
+            emit_push(a, EAX);
+            break;
+
+        case OP_PATT_STR:
+            emit_require(a, 2);
+            emit_load(a, EAX, ESI, sizeof(int32_t));
+            emit_load(a, ECX, ESI, 2 * sizeof(int32_t));
+            emit_alu_imm(a, EXT_ADD, ESI, 2 * sizeof(int32_t));
+            emit_save(a);
+            emit_arg(a, 0, ECX);
+            emit_arg(a, 1, EAX);
+            emit_call(a, Bstring_patt);
+            emit_push(a, EAX);
+            break;
+
+        case OP_PATT_STRING:
+        case OP_PATT_ARRAY:
+        case OP_PATT_SEXP:
+        case OP_PATT_REF:
+        case OP_PATT_VAL:
+        case OP_PATT_CLOSURE:
+            emit_pop(a, EAX);
+            emit_match_pattern(a, opcode - OP_PATT_STR);
+            emit_push(a, EAX);
+            break;
+
+        case OP_READ:
+            emit_save(a);
+            emit_call(a, Lread);
+            emit_push(a, EAX);
+            break;
+
+        case OP_WRITE:
+        case OP_LENGTH:
+        case OP_TO_STRING:
+            emit_pop(a, EAX);
+            emit_save(a);
+            emit_arg(a, 0, EAX);
+            emit_call(a, opcode == OP_WRITE ? (void*)Lwrite : opcode == OP_LENGTH ? (void*)Llength : (void*)Lstring);
+            emit_push(a, EAX);
+            break;
+
+        case OP_CALL_EXTERN:
+            if (insn->b.n > 0) {
+                emit_require(a, insn->b.n);
+            }
+            emit_save(a);
+            emit_arg_imm(a, 0, (int32_t)insn->a.function);
+            emit_arg(a, 1, ESI);
+            emit_arg_imm(a, 2, insn->b.n);
+            emit_call(a, call_extern);
+            if (insn->b.n > 0) {
+                emit_alu_imm(a, EXT_ADD, ESI, insn->b.n * sizeof(int32_t));
+            }
+            emit_push(a, EAX);
+            break;
+
+        case OP_DUP_CONST_ELEM:
+        case OP_CONST_ELEM:
+            if (opcode == OP_DUP_CONST_ELEM) {
+                emit_peek(a, EAX);
+            } else {
+                emit_pop(a, EAX);
+            }
+            emit_save(a);
+            emit_arg(a, 0, EAX);
+            emit_arg_imm(a, 1, insn->a.n);
+            emit_call(a, Belem);
+            emit_push(a, EAX);
+            break;
+
+        case OP_DROP_DROP:
+            emit_require(a, 2);
+            emit_alu_imm(a, EXT_ADD, ESI, 2 * sizeof(int32_t));
+            break;
+
+        case OP_ST_GLOBAL_DROP:
+        case OP_ST_LOCAL_DROP:
+        case OP_ST_ARGUMENT_DROP:
+        case OP_ST_CLOSURE_DROP:
+            if (opcode == OP_ST_CLOSURE_DROP) {
+                emit_closure_barrier(a, insn);
+            }
+            base = emit_variable(a, location_of(opcode, OP_ST_GLOBAL_DROP), insn, &disp);
+            emit_pop(a, EAX);
+            emit_store(a, base, disp, EAX);
+            break;
+
+        case OP_DUP_TAG_CJMPZ:
+        case OP_DUP_TAG_CJMPNZ:
+        case OP_DUP_ARRAY_CJMPZ:
+        case OP_DUP_ARRAY_CJMPNZ: {
+            bool tag = opcode == OP_DUP_TAG_CJMPZ || opcode == OP_DUP_TAG_CJMPNZ;
+            emit_peek(a, EAX);
+            emit_arg(a, 0, EAX);
+            emit_arg_imm(a, 1, insn->a.n);
+            if (tag) {
+                emit_arg_imm(a, 2, insn->b.n);
+                emit_call(a, Btag);
+            } else {
+                emit_call(a, Barray_patt);
+            }
+            emit_unbox(a, EAX);
+            emit_test(a, EAX, EAX);
+            emit_jump(a, opcode == OP_DUP_TAG_CJMPZ || opcode == OP_DUP_ARRAY_CJMPZ ? CC_E : CC_NE, insn->c.target);
+            break;
+        }
+
+        default:
+            // allocations of closures and failures stay in the interpreter
+            emit_leave(a, insn);
+            return false;
+    }
+    return true;
+}
+
+static bool compile(function_info* f) {
+    size_t n = f->end - f->begin;
+    assembler a = {.p = code_top, .end = code + JIT_CODE_SIZE, .f = f};
+    bool compiled = true;
+    bool after_leave = false;
+
+    a.labels = allocate(n * sizeof(uint8_t*));
+    uint8_t* enterable = allocate(n);
+    set_writable(true);
+
+    for (size_t i = f->begin; i < f->end; i += fused_width(&prog->code[i])) {
+        if (a.end - a.p < MAX_TEMPLATE_SIZE) {
+            compiled = false;
+            break;
+        }
+        a.labels[i - f->begin] = a.p;
+        bool stays = compile_instruction(&a, &prog->code[i]);
+        enterable[i - f->begin] = stays && (leaders[i] || after_leave);
+        after_leave = !stays;
+    }
+    if (compiled && f->end < prog->length) {
+        emit_jump(&a, CC_ALWAYS, &prog->code[f->end]);
+    }
+
+    for (size_t k = 0; compiled && k < a.fixups_count; k++) {
+        uint8_t* target = a.labels[a.fixups[k].target - f->begin];
+        if (!target) {
+            compiled = false;
+            break;
+        }
+        int32_t rel = (int32_t)(target - (a.fixups[k].site + sizeof(int32_t)));
+        memcpy(a.fixups[k].site, &rel, sizeof(int32_t));
+    }
+    set_writable(false);
+
+    if (compiled) {
+        code_top = a.p;
+        for (size_t i = 0; i < n; i++) {
+            if (enterable[i]) {
+                entries[f->begin + i] = a.labels[i];
+            }
+        }
+    }
+    free(a.labels);
+    free(a.fixups);
+    free(enterable);
+    return compiled;
+}
+
+// Emits the code shared by all functions: the trampoline entering compiled
+// code, the epilogue leaving it and the failure stubs
+static void emit_runtime_glue(void) {
+    static const char* const UNDERFLOW = "ERROR: try to access empty operands stack\n";
+    static const char* const NOT_CLOSURE = "ERROR: pointer to not-closure object as closure argument.\n";
+    static const char* const BINOP_OPERANDS = "ERROR: binary operator %s applied to a non-integer value.\n";
+    assembler a = {.p = code, .end = code + JIT_CODE_SIZE};
+
+    // const instruction* trampoline(jit_registers* registers, const void* entry)
+    trampoline = (const instruction* (*)(jit_registers*, const void*))a.p;
+    emit8(&a, 0x50 + EBP);
+    emit8(&a, 0x50 + EBX);
+    emit8(&a, 0x50 + ESI);
+    emit8(&a, 0x50 + EDI);
+    emit_alu_imm(&a, EXT_SUB, ESP, NATIVE_FRAME_SIZE);
+    emit_load(&a, EBX, ESP, NATIVE_FRAME_SIZE + 5 * sizeof(int32_t));
+    emit_load(&a, ESI, EBX, offsetof(jit_registers, sp));
+    emit_load(&a, EDI, EBX, offsetof(jit_registers, fp));
+    emit8(&a, 0xFF);  // jmp [esp + entry]
+    emit_modrm(&a, 4, ESP, NATIVE_FRAME_SIZE + 6 * sizeof(int32_t));
+
+    epilogue = a.p;
+    emit_store(&a, EBX, offsetof(jit_registers, sp), ESI);
+    emit_store(&a, EBX, offsetof(jit_registers, fp), EDI);
+    emit_alu_imm(&a, EXT_ADD, ESP, NATIVE_FRAME_SIZE);
+    emit8(&a, 0x58 + EDI);
+    emit8(&a, 0x58 + ESI);
+    emit8(&a, 0x58 + EBX);
+    emit8(&a, 0x58 + EBP);
+    emit8(&a, 0xC3);
+
+    // leaves compiled code at the instruction whose index is in eax
+    transfer_stub = a.p;
+    emit8(&a, 0x69);  // imul eax, eax, sizeof(instruction)
+    emit8(&a, 0xC0 | EAX << 3 | EAX);
+    emit32(&a, sizeof(instruction));
+    emit_alu_imm(&a, EXT_ADD, EAX, (int32_t)prog->code);
+    emit_jmp(&a, epilogue);
+
+    // the symbol of the operator is in edx
+    binop_stub = a.p;
+    emit_save(&a);
+    emit_arg(&a, 1, EDX);
+    emit_arg_imm(&a, 0, (int32_t)BINOP_OPERANDS);
+    emit_call(&a, failure);
+
+    uint8_t** stubs[] = {&underflow_stub, &not_closure_stub};
+    const char* messages[] = {UNDERFLOW, NOT_CLOSURE};
+    for (int i = 0; i < 2; i++) {
+        *stubs[i] = a.p;
+        emit_save(&a);
+        emit_arg_imm(&a, 0, (int32_t)messages[i]);
+        emit_call(&a, failure);
+    }
+    code_top = a.p;
+}
+
+void start_jit(program* p, const jit_layout* vm_layout, uint32_t hot_threshold) {
+    prog = p;
+    layout = *vm_layout;
+    threshold = hot_threshold;
+
+    uint32_t odd = sizeof(instruction);
+    for (instruction_shift = 0; odd % 2 == 0; instruction_shift++) {
+        odd /= 2;
+    }
+    // Newton's iteration doubles the number of correct low bits of the inverse
+    instruction_inverse = odd;
+    for (int i = 0; i < 5; i++) {
+        instruction_inverse *= 2 - odd * instruction_inverse;
+    }
+
+    code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        failure("ERROR: unable to allocate memory for compiled code.\n");
+    }
+    emit_runtime_glue();
+    set_writable(false);
+
+    leaders = find_block_leaders(p);
+    entries = allocate(p->length * sizeof(void*));
+    function_of = allocate(p->length * sizeof(int32_t));
+    functions = allocate(p->length * sizeof(function_info));
+
+    int32_t count = 0;
+    for (size_t i = 0; i < p->length; i += instruction_width(&p->code[i])) {
+        if (p->code[i].opcode == OP_BEGIN || p->code[i].opcode == OP_CBEGIN) {
+            if (count > 0) {
+                functions[count - 1].end = i;
+            }
+            functions[count++] = (function_info){.begin = i, .state = INTERPRETED};
+        }
+    }
+    if (count > 0) {
+        functions[count - 1].end = p->length;
+    }
+    for (int32_t k = 0, f = -1; k < (int32_t)p->length; k++) {
+        if (f + 1 < count && functions[f + 1].begin == (size_t)k) {
+            f++;
+        }
+        function_of[k] = f;
+    }
+    jit_enabled = true;
+}
+
+bool jit_tick(size_t insn_index, size_t* begin, size_t* end) {
+    if (function_of[insn_index] < 0) {
+        return false;
+    }
+    function_info* f = &functions[function_of[insn_index]];
+    if (f->state != INTERPRETED || ++f->counter <= threshold) {
+        return false;
+    }
+    f->state = compile(f) ? COMPILED : FAILED;
+    *begin = f->begin;
+    *end = f->end;
+    return f->state == COMPILED;
+}
+
+const void* jit_entry(size_t insn_index) { return entries[insn_index]; }
+
+const instruction* jit_run(jit_registers* registers, const void* entry) { return trampoline(registers, entry); }
+
+#endif
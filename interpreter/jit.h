@@ -0,0 +1,77 @@
+#ifndef __LAMA_JIT__
+#define __LAMA_JIT__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+
+// The JIT emits x86-32 code and is entered from the direct-threaded engine, so
+// it is only built along with it for 32-bit x86 targets.
+#if defined(__i386__) && defined(__GNUC__) && !defined(LAMA_SWITCH_DISPATCH)
+#  define LAMA_JIT
+#endif
+
+#define JIT_DEFAULT_THRESHOLD 100
+
+// Virtual machine registers passed to and from compiled code
+typedef struct {
+    int32_t* sp;
+    int32_t* fp;
+    call_frame* frame;
+} jit_registers;
+
+// Where the interpreter keeps the state compiled code works on
+typedef struct {
+    int32_t* globals;
+    // the first free slot of the empty operand stack; overflows of both stacks
+    // hit their guard pages, so compiled code only checks for underflows
+    const int32_t* stack_empty;
+    // frames[0] is the call frame of the main function
+    const call_frame* frames;
+} jit_layout;
+
+extern bool jit_enabled;
+
+// Enables the JIT for a decoded program: a function is compiled once the
+// number of its entries plus the number of back-edges taken inside it exceeds
+// `threshold`.
+void start_jit(program* p, const jit_layout* layout, uint32_t threshold);
+
+// Accounts for the entry of a function or a back-edge at `insn_index` and
+// compiles the enclosing function once it gets hot. Returns true if it has just
+// been compiled, the instructions of the function are then [*begin, *end).
+bool jit_tick(size_t insn_index, size_t* begin, size_t* end);
+
+// Native code of the instruction at `insn_index`, NULL unless compiled code
+// may be entered there: at the block leaders of compiled functions and right
+// after the instructions compiled code leaves to the interpreter.
+const void* jit_entry(size_t insn_index);
+
+// Runs compiled code from `entry` until it reaches an instruction it leaves to
+// the interpreter (the allocation of a closure, a failure, the return from the
+// main function) or code which is not compiled yet, and returns that instruction.
+// Calls and returns between compiled functions stay in compiled code.
+const instruction* jit_run(jit_registers* registers, const void* entry);
+
+// Target of a jump instruction, NULL for any other one
+static inline const instruction* jump_target(const instruction* insn) {
+    switch (insn->opcode) {
+        case OP_JMP:
+        case OP_CJMPZ:
+        case OP_CJMPNZ:
+        case OP_REG_CJMPZ:
+        case OP_REG_CJMPNZ:
+            return insn->a.target;
+        case OP_DUP_TAG_CJMPZ:
+        case OP_DUP_TAG_CJMPNZ:
+        case OP_DUP_ARRAY_CJMPZ:
+        case OP_DUP_ARRAY_CJMPNZ:
+            return insn->c.target;
+        default:
+            return NULL;
+    }
+}
+
+#endif
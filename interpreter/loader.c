@@ -0,0 +1,76 @@
+#include "loader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../runtime/runtime.h"
+
+#define HEADER_SIZE (3 * sizeof(int32_t))
+#define PUBLIC_SYMBOL_SIZE (2 * sizeof(int32_t))
+
+static const uint8_t* map_file(const char* fname, size_t* size) {
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+        failure("ERROR: unable to open file %s: %s\n", fname, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        failure("ERROR: unable to get file size %s: %s\n", fname, strerror(errno));
+    }
+    if ((size_t)st.st_size < HEADER_SIZE) {
+        failure("ERROR: invalid bytecode file %s: the header is truncated.\n", fname);
+    }
+
+    void* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        failure("ERROR: unable to map file %s: %s\n", fname, strerror(errno));
+    }
+    close(fd);
+
+    *size = st.st_size;
+    return image;
+}
+
+bytefile* read_file(const char* fname) {
+    bytefile* file = malloc(sizeof(bytefile));
+    if (!file) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+
+    file->image = map_file(fname, &file->image_size);
+
+    uint32_t header[3];
+    memcpy(header, file->image, HEADER_SIZE);
+    file->string_table_size = header[0];
+    file->global_area_size = header[1];
+    file->public_symbols_number = header[2];
+
+    // the section pointers are only computed once the sections are known to fit,
+    // so the verifier and the tools never see pointers past the mapping
+    size_t rest = file->image_size - HEADER_SIZE;
+    if (rest / PUBLIC_SYMBOL_SIZE < file->public_symbols_number) {
+        failure("ERROR: invalid bytecode file %s: public symbols table exceeds the file.\n", fname);
+    }
+    rest -= file->public_symbols_number * PUBLIC_SYMBOL_SIZE;
+    if (rest < file->string_table_size) {
+        failure("ERROR: invalid bytecode file %s: string pool exceeds the file.\n", fname);
+    }
+
+    file->public_ptr = (const int*)(file->image + HEADER_SIZE);
+    file->string_ptr = (const char*)(file->image + HEADER_SIZE + file->public_symbols_number * PUBLIC_SYMBOL_SIZE);
+    file->code_ptr = (const uint8_t*)&file->string_ptr[file->string_table_size];
+    file->code_end = file->image + file->image_size;
+    return file;
+}
+
+void close_file(bytefile* bf) {
+    munmap((void*)bf->image, bf->image_size);
+    free(bf);
+}
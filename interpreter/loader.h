@@ -0,0 +1,32 @@
+#ifndef __LAMA_LOADER__
+#define __LAMA_LOADER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A loaded bytecode file. The image itself is mapped read-only and private, so
+// it is shared through the page cache by every process running the same file;
+// the header fields and the pointers into the image are kept here, outside of
+// the mapping.
+typedef struct {
+    const char* string_ptr;
+    const int* public_ptr;
+    const uint8_t* code_ptr;
+    const uint8_t* code_end;
+    unsigned int string_table_size;
+    unsigned int global_area_size;
+    unsigned int public_symbols_number;
+    // the whole mapped file, header included
+    const uint8_t* image;
+    size_t image_size;
+} bytefile;
+
+// Maps a bytecode image and fills in the header fields and the section pointers
+// of the resulting bytefile; fails with a diagnostic if the file cannot be read
+// or its sections do not fit in it.
+bytefile* read_file(const char* fname);
+
+// Unmaps the image and frees the bytefile
+void close_file(bytefile* bf);
+
+#endif
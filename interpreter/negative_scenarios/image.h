@@ -0,0 +1,37 @@
+#ifndef __LAMA_NEGATIVE_IMAGE__
+#define __LAMA_NEGATIVE_IMAGE__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../decoder.h"
+#include "../verifier.h"
+
+// An operand of an instruction, as it is laid out in a bytecode file
+#define I32(x) (uint8_t)(x), (uint8_t)((x) >> 8), (uint8_t)((x) >> 16), (uint8_t)((x) >> 24)
+
+#define BEGIN 0x52
+#define CONST 0x10
+#define STRING 0x11
+#define JMP 0x15
+#define END 0x16
+#define CJMPZ 0x50
+#define LD_LOCAL 0x21
+#define BINOP_PLUS 0x01
+#define STOP 0xff
+
+// Runs both passes of the verifier on an image with the given string pool and
+// code and no public symbols, as the interpreter does after loading it
+static void verify(const char* strings, size_t strings_size, const uint8_t* code, size_t code_size) {
+    bytefile* bf = calloc(1, sizeof(bytefile));
+    bf->string_ptr = strings;
+    bf->string_table_size = strings_size;
+    bf->code_ptr = code;
+    bf->code_end = code + code_size;
+    verify_bytefile(bf);
+    verify_stack_depths(decode_bytefile(bf));
+}
+
+#define VERIFY(strings, code) verify(strings, sizeof(strings), code, sizeof(code))
+
+#endif
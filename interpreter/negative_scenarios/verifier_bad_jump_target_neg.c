@@ -0,0 +1,7 @@
+#include "image.h"
+
+// the jump lands inside its own operand
+int main () {
+    const uint8_t code[] = {BEGIN, I32(2), I32(0), JMP, I32(10), CONST, I32(0), END, STOP};
+    VERIFY("", code);
+}
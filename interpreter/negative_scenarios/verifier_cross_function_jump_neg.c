@@ -0,0 +1,8 @@
+#include "image.h"
+
+// main jumps into the body of the function following it
+int main () {
+    const uint8_t code[] = {BEGIN, I32(2), I32(0), JMP, I32(29), CONST, I32(0), END,
+                            BEGIN, I32(0), I32(0), CONST, I32(1), END, STOP};
+    VERIFY("", code);
+}
@@ -0,0 +1,8 @@
+#include "image.h"
+
+// the stack holds one more value when the conditional jump is not taken
+int main () {
+    const uint8_t code[] = {BEGIN, I32(2), I32(0), CONST, I32(0), CJMPZ, I32(24),
+                            CONST, I32(1), CONST, I32(2), END, STOP};
+    VERIFY("", code);
+}
@@ -0,0 +1,6 @@
+#include "image.h"
+
+int main () {
+    const uint8_t code[] = {BEGIN, I32(2), I32(1), LD_LOCAL, I32(1), END, STOP};
+    VERIFY("", code);
+}
@@ -0,0 +1,6 @@
+#include "image.h"
+
+int main () {
+    const uint8_t code[] = {CONST, I32(1), BEGIN, I32(2), I32(0), END, STOP};
+    VERIFY("", code);
+}
@@ -0,0 +1,6 @@
+#include "image.h"
+
+int main () {
+    const uint8_t code[] = {BEGIN, I32(2), I32(0), CONST, I32(1), BINOP_PLUS, END, STOP};
+    VERIFY("", code);
+}
@@ -0,0 +1,7 @@
+#include "image.h"
+
+// the string pool holds "abc" and its terminator only
+int main () {
+    const uint8_t code[] = {BEGIN, I32(2), I32(0), STRING, I32(4), END, STOP};
+    VERIFY("abc", code);
+}
@@ -0,0 +1,133 @@
+// Offline tool mining candidate superinstructions: counts the sequences of
+// decoded instructions of length 2 to MAX_LENGTH which lie within one basic
+// block across the given bytecode files and prints the most frequent ones.
+//
+// Usage: ngrams [-t top] file.bc ...
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../runtime/runtime.h"
+#include "decoder.h"
+#include "loader.h"
+#include "superinstructions.h"
+#include "verifier.h"
+
+#define MAX_LENGTH 4
+
+void* __stop_custom_data = 0;
+void* __start_custom_data = 0;
+
+// A sequence is packed into a single key: one byte per opcode
+typedef uint32_t ngram;
+
+typedef struct {
+    ngram key;
+    size_t count;
+} ngram_count;
+
+typedef struct {
+    ngram* keys;
+    size_t count;
+    size_t capacity;
+} ngram_list;
+
+static ngram_list ngrams[MAX_LENGTH + 1];
+
+static void add_ngram(ngram_list* list, ngram key) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 1024;
+        list->keys = realloc(list->keys, list->capacity * sizeof(ngram));
+        if (!list->keys) {
+            failure("ERROR: unable to allocate memory.\n");
+        }
+    }
+    list->keys[list->count++] = key;
+}
+
+static void collect(const program* p) {
+    uint8_t* leaders = find_block_leaders(p);
+
+    for (size_t i = 0; i < p->length; i += instruction_width(&p->code[i])) {
+        ngram key = 0;
+        size_t j = i;
+        for (int length = 1; length <= MAX_LENGTH && j < p->length; length++) {
+            if (length > 1 && leaders[j]) {
+                break;
+            }
+            key = (key << 8) | (uint8_t)p->code[j].opcode;
+            if (length > 1) {
+                add_ngram(&ngrams[length], key);
+            }
+            j += instruction_width(&p->code[j]);
+        }
+    }
+    free(leaders);
+}
+
+static int compare_keys(const void* x, const void* y) {
+    ngram a = *(const ngram*)x, b = *(const ngram*)y;
+    return (a > b) - (a < b);
+}
+
+static int compare_counts(const void* x, const void* y) {
+    const ngram_count *a = x, *b = y;
+    if (a->count != b->count) {
+        return a->count < b->count ? 1 : -1;
+    }
+    return compare_keys(&a->key, &b->key);
+}
+
+static void report(ngram_list* list, int length, size_t top) {
+    ngram_count* counts = malloc((list->count + 1) * sizeof(ngram_count));
+    size_t distinct = 0;
+
+    if (!counts) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    qsort(list->keys, list->count, sizeof(ngram), compare_keys);
+    for (size_t i = 0; i < list->count; i++) {
+        if (distinct > 0 && counts[distinct - 1].key == list->keys[i]) {
+            counts[distinct - 1].count++;
+        } else {
+            counts[distinct++] = (ngram_count){.key = list->keys[i], .count = 1};
+        }
+    }
+    qsort(counts, distinct, sizeof(ngram_count), compare_counts);
+
+    printf("Sequences of %d instructions (%zu total, %zu distinct):\n", length, list->count, distinct);
+    for (size_t i = 0; i < distinct && i < top; i++) {
+        printf("%8zu ", counts[i].count);
+        for (int k = length - 1; k >= 0; k--) {
+            printf(" %s", opcode_name((counts[i].key >> (8 * k)) & 0xFF));
+        }
+        printf("\n");
+    }
+    printf("\n");
+    free(counts);
+}
+
+int main(int argc, char* argv[]) {
+    size_t top = 20;
+    int first = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        top = strtoul(argv[2], NULL, 10);
+        first = 3;
+    }
+    if (first >= argc) {
+        failure("Usage: ngrams [-t top] file.bc ...\n");
+    }
+
+    for (int i = first; i < argc; i++) {
+        bytefile* bf = read_file(argv[i]);
+        verify_bytefile(bf);
+        collect(decode_bytefile(bf));
+    }
+    for (int length = 2; length <= MAX_LENGTH; length++) {
+        report(&ngrams[length], length, top);
+    }
+    return 0;
+}
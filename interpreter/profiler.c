@@ -0,0 +1,95 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../runtime/runtime.h"
+
+opcode_profiler profiler = {.last_opcode = -1};
+
+typedef struct {
+    int32_t opcode;
+    opcode_stats stats;
+} report_entry;
+
+static int compare_entries(const void* x, const void* y) {
+    const report_entry *a = x, *b = y;
+    uint64_t ka = profiler.cycles ? a->stats.cycles : a->stats.count;
+    uint64_t kb = profiler.cycles ? b->stats.cycles : b->stats.count;
+    if (ka != kb) {
+        return ka < kb ? 1 : -1;
+    }
+    return a->opcode - b->opcode;
+}
+
+static double percent(uint64_t part, uint64_t total) { return total ? 100.0 * part / total : 0.0; }
+
+static void print_table(FILE* f, const report_entry* entries, size_t n, uint64_t total, uint64_t total_cycles) {
+    fprintf(f, "%-24s %14s %8s", "opcode", "count", "%");
+    if (profiler.cycles) {
+        fprintf(f, " %16s %8s %10s", "cycles", "%", "cycles/op");
+    }
+    fprintf(f, "\n");
+
+    for (size_t i = 0; i < n; i++) {
+        const opcode_stats* s = &entries[i].stats;
+        fprintf(f, "%-24s %14llu %8.2f", opcode_name(entries[i].opcode), (unsigned long long)s->count,
+                percent(s->count, total));
+        if (profiler.cycles) {
+            fprintf(f, " %16llu %8.2f %10.1f", (unsigned long long)s->cycles, percent(s->cycles, total_cycles),
+                    (double)s->cycles / s->count);
+        }
+        fprintf(f, "\n");
+    }
+    fprintf(f, "%-24s %14llu\n", "total", (unsigned long long)total);
+}
+
+static void print_json(FILE* f, const report_entry* entries, size_t n, uint64_t total, uint64_t total_cycles) {
+    fprintf(f, "{\n  \"total\": %llu,\n", (unsigned long long)total);
+    if (profiler.cycles) {
+        fprintf(f, "  \"total_cycles\": %llu,\n", (unsigned long long)total_cycles);
+    }
+    fprintf(f, "  \"opcodes\": [");
+    for (size_t i = 0; i < n; i++) {
+        const opcode_stats* s = &entries[i].stats;
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"count\": %llu", i ? "," : "", opcode_name(entries[i].opcode),
+                (unsigned long long)s->count);
+        if (profiler.cycles) {
+            fprintf(f, ", \"cycles\": %llu", (unsigned long long)s->cycles);
+        }
+        fprintf(f, "}");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+
+static void write_report(void) {
+    report_entry entries[OPCODES_NUMBER];
+    size_t n = 0;
+    uint64_t total = 0, total_cycles = 0;
+
+    for (int32_t opcode = 0; opcode < OPCODES_NUMBER; opcode++) {
+        if (profiler.stats[opcode].count) {
+            entries[n++] = (report_entry){.opcode = opcode, .stats = profiler.stats[opcode]};
+            total += profiler.stats[opcode].count;
+            total_cycles += profiler.stats[opcode].cycles;
+        }
+    }
+    qsort(entries, n, sizeof(report_entry), compare_entries);
+
+    print_table(stderr, entries, n, total, total_cycles);
+
+    FILE* json = fopen(profiler.json_path, "w");
+    if (!json) {
+        fprintf(stderr, "ERROR: unable to write opcode profile to %s\n", profiler.json_path);
+        return;
+    }
+    print_json(json, entries, n, total, total_cycles);
+    fclose(json);
+}
+
+void start_opcode_profiler(bool cycles, const char* json_path) {
+    profiler.enabled = true;
+    profiler.cycles = cycles;
+    profiler.json_path = json_path;
+    atexit(write_report);
+}
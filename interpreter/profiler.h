@@ -0,0 +1,53 @@
+#ifndef __LAMA_PROFILER__
+#define __LAMA_PROFILER__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "decoder.h"
+
+typedef struct {
+    uint64_t count;
+    uint64_t cycles;
+} opcode_stats;
+
+typedef struct {
+    bool enabled;
+    // also attribute time stamp counter deltas to opcodes
+    bool cycles;
+    // where the JSON report goes, the table is printed to stderr
+    const char* json_path;
+    opcode_stats stats[OPCODES_NUMBER];
+    int32_t last_opcode;
+    uint64_t last_stamp;
+} opcode_profiler;
+
+extern opcode_profiler profiler;
+
+static inline uint64_t read_cycles(void) {
+#if defined(__i386__) || defined(__x86_64__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Accounts for an instruction about to be executed. The cycles elapsed since
+// the previous call are attributed to the previous instruction.
+static inline void profile_opcode(int32_t opcode) {
+    profiler.stats[opcode].count++;
+    if (profiler.cycles) {
+        uint64_t now = read_cycles();
+        if (profiler.last_opcode >= 0) {
+            profiler.stats[profiler.last_opcode].cycles += now - profiler.last_stamp;
+        }
+        profiler.last_opcode = opcode;
+        profiler.last_stamp = now;
+    }
+}
+
+// Enables the profiler; the report is written when the interpreter exits,
+// normally or through failure().
+void start_opcode_profiler(bool cycles, const char* json_path);
+
+#endif
@@ -0,0 +1,655 @@
+#include "registers.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../runtime/runtime.h"
+
+// Where a value on the operand stack is while a block is being translated
+typedef enum {
+    // in its stack slot
+    SLOT_IN_PLACE,
+    // in the register at offset `n` from fp, not copied to its slot yet
+    SLOT_REGISTER,
+    // the boxed constant `n`, not stored to its slot yet
+    SLOT_CONSTANT,
+} slot_kind;
+
+typedef struct {
+    slot_kind kind;
+    int32_t n;
+} slot;
+
+typedef struct {
+    const program* source;
+    uint8_t* leaders;
+
+    // Per source instruction: the depth of the operand stack before it (-1 if
+    // it is unreachable), the instruction popping the value it pushes (-1 if
+    // it is popped in another block), whether it is translated into register
+    // code (LD, CONST, DUP and BINOP only) and, for STA, whether its destination
+    // is a reference made by LDA, in which case it pops two values, not three
+    int32_t* depth;
+    int32_t* consumer;
+    uint8_t* in_registers;
+    uint8_t* sta_to_reference;
+    // number of instructions of the block from the given one on which stay
+    // stack code, see decide_block
+    int32_t* stack_code_after;
+    // the instruction which has pushed every value of the simulated block, -1 for
+    // values pushed before the block
+    int32_t* producer;
+    size_t* worklist;
+
+    program* target;
+    size_t capacity;
+    // index of the translation of every source instruction
+    int32_t* start;
+    // jumps of the translation, to be pointed to the translations of their targets
+    size_t* jumps;
+    size_t jumps_count;
+    size_t jumps_capacity;
+
+    // the operand stack of the block being translated: `height` values, the
+    // `sp_height` lowest of which are below the stack pointer, none of the
+    // ones below `first_pending` is out of its slot
+    slot* stack;
+    int32_t height;
+    int32_t sp_height;
+    int32_t first_pending;
+    int32_t n_locals;
+    // the last translated instruction if it writes the topmost stack slot, -1 otherwise
+    int32_t last_write;
+    // the source instruction being translated, which stores of pending values
+    // are attributed to
+    size_t current;
+} translator;
+
+static void* allocate(size_t size) {
+    void* p = calloc(size, 1);
+    if (!p) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    return p;
+}
+
+static bool is_binop(int32_t opcode) { return opcode >= OP_BINOP_PLUS && opcode <= OP_BINOP_OR; }
+
+static bool is_jump(int32_t opcode) {
+    return opcode == OP_JMP || opcode == OP_CJMPZ || opcode == OP_CJMPNZ || opcode == OP_REG_CJMPZ ||
+           opcode == OP_REG_CJMPNZ || opcode == OP_CALL;
+}
+
+static bool ends_block(int32_t opcode) {
+    return opcode == OP_JMP || opcode == OP_END || opcode == OP_FAIL || opcode == OP_STOP;
+}
+
+// Number of values an instruction pops and pushes (see stack_effect); false for
+// the instructions the interpreter does not run
+static bool effect(const translator* t, size_t i, int32_t* pops, int32_t* pushes) {
+    const instruction* insn = &t->source->code[i];
+    if (insn->opcode == OP_STI || insn->opcode == OP_RET || insn->opcode == OP_SWAP) {
+        return false;
+    }
+    stack_effect(insn, t->sta_to_reference[i], pops, pushes);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Analysis: the stack depth before every instruction and who pops what
+
+// Blocks start at function entries and jump targets only: calls return right
+// after themselves, where the values of the caller are as they were left
+static uint8_t* find_blocks(const program* p) {
+    uint8_t* leaders = allocate(p->length + 1);
+    for (size_t i = 0; i < p->length; i += instruction_width(&p->code[i])) {
+        const instruction* insn = &p->code[i];
+        if (insn->opcode == OP_BEGIN || insn->opcode == OP_CBEGIN) {
+            leaders[i] = 1;
+        } else if (insn->opcode == OP_JMP || insn->opcode == OP_CJMPZ || insn->opcode == OP_CJMPNZ) {
+            leaders[insn->a.target - p->code] = 1;
+        }
+    }
+    return leaders;
+}
+
+static bool propagate(translator* t, size_t target, int32_t height, size_t* pending) {
+    if (t->depth[target] < 0) {
+        t->depth[target] = height;
+        t->worklist[(*pending)++] = target;
+        return true;
+    }
+    return t->depth[target] == height;
+}
+
+// Runs the block starting at `start` on the stack depth, recording the
+// producers and the consumers of the values it pushes
+static bool simulate_block(translator* t, size_t start, size_t begin, size_t end, size_t* pending) {
+    const instruction* code = t->source->code;
+    int32_t height = t->depth[start];
+    int32_t limit = end - begin;
+    if (height > limit) {
+        return false;
+    }
+    for (int32_t k = 0; k < height; k++) {
+        t->producer[k] = -1;
+    }
+
+    for (size_t i = start; i < end; i += instruction_width(&code[i])) {
+        if (i != start && t->leaders[i]) {
+            return propagate(t, i, height, pending);
+        }
+        t->depth[i] = height;
+
+        const instruction* insn = &code[i];
+        if (insn->opcode == OP_STA) {
+            // the destination is a reference when it comes from LDA, an index otherwise
+            int32_t destination = height >= 2 ? t->producer[height - 2] : -1;
+            if (destination < 0 || code[destination].opcode == OP_DUP) {
+                return false;
+            }
+            int32_t opcode = code[destination].opcode;
+            t->sta_to_reference[i] = opcode >= OP_LDA_GLOBAL && opcode <= OP_LDA_CLOSURE;
+        }
+        int32_t pops, pushes;
+        if (!effect(t, i, &pops, &pushes) || pops > height || height - pops + pushes > limit) {
+            return false;
+        }
+        for (int32_t k = height - pops; k < height; k++) {
+            if (t->producer[k] >= 0) {
+                t->consumer[t->producer[k]] = i;
+            }
+        }
+        height -= pops;
+        if (pushes) {
+            t->producer[height++] = i;
+        }
+
+        switch (insn->opcode) {
+            case OP_JMP:
+            case OP_CJMPZ:
+            case OP_CJMPNZ: {
+                size_t target = insn->a.target - code;
+                if (target < begin || target >= end || !propagate(t, target, height, pending)) {
+                    return false;
+                }
+                if (insn->opcode == OP_JMP) {
+                    return true;
+                }
+                break;
+            }
+            case OP_END:
+            case OP_FAIL:
+            case OP_STOP:
+                return true;
+        }
+    }
+    return true;
+}
+
+static bool analyze_function(translator* t, size_t begin, size_t end) {
+    size_t pending = 0;
+    t->depth[begin] = 0;
+    t->worklist[pending++] = begin;
+    while (pending > 0) {
+        if (!simulate_block(t, t->worklist[--pending], begin, end, &pending)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Instructions popping the values computed for them in registers
+static bool register_consumer(const translator* t, int32_t i) {
+    int32_t opcode = t->source->code[i].opcode;
+    return opcode == OP_DROP || opcode == OP_CJMPZ || opcode == OP_CJMPNZ ||
+           (is_binop(opcode) && t->in_registers[i]);
+}
+
+static bool pure(int32_t opcode) {
+    return is_binop(opcode) || opcode == OP_CONST || opcode == OP_DUP || opcode == OP_LD_GLOBAL ||
+           opcode == OP_LD_LOCAL || opcode == OP_LD_ARGUMENT || opcode == OP_LD_CLOSURE;
+}
+
+// A value is computed in registers when the instruction popping it takes it
+// from a register and no stack code runs meanwhile, which would need it in its
+// slot. The block is walked backwards, as consumers follow producers.
+static void decide_block(translator* t, const size_t* order, size_t n, size_t end) {
+    const instruction* code = t->source->code;
+    t->stack_code_after[end] = 0;
+    for (size_t k = n; k-- > 0;) {
+        size_t i = order[k];
+        size_t next = k + 1 < n ? order[k + 1] : end;
+        int32_t opcode = code[i].opcode;
+        bool stack_code;
+        if (pure(opcode)) {
+            int32_t c = t->consumer[i];
+            t->in_registers[i] = c >= 0 && register_consumer(t, c) &&
+                                 t->stack_code_after[next] == t->stack_code_after[c];
+            stack_code = !t->in_registers[i];
+        } else {
+            int32_t group = opcode - OP_ST_GLOBAL;
+            // a conditional jump stores the values under the condition
+            stack_code = !(group >= 0 && group <= LOCATION_CLOSURE) && opcode != OP_DROP;
+        }
+        t->stack_code_after[i] = t->stack_code_after[next] + stack_code;
+    }
+}
+
+static void decide_function(translator* t, size_t begin, size_t end) {
+    const instruction* code = t->source->code;
+    size_t* order = t->worklist;
+    size_t n = 0;
+    for (size_t i = begin; i < end; i += instruction_width(&code[i])) {
+        if (i != begin && t->leaders[i] && n > 0) {
+            decide_block(t, order, n, i);
+            n = 0;
+        }
+        if (t->depth[i] >= 0) {
+            order[n++] = i;
+        }
+    }
+    if (n > 0) {
+        decide_block(t, order, n, end);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Translation
+
+// Appends an instruction translating the source instruction `i`, returns its index
+static int32_t emit(translator* t, int32_t opcode, size_t i) {
+    program* out = t->target;
+    if (out->length == t->capacity) {
+        t->capacity = t->capacity == 0 ? 256 : 2 * t->capacity;
+        out->code = realloc(out->code, t->capacity * sizeof(instruction));
+        out->offsets = realloc(out->offsets, t->capacity * sizeof(int32_t));
+        out->lines = realloc(out->lines, t->capacity * sizeof(int32_t));
+        if (!out->code || !out->offsets || !out->lines) {
+            failure("ERROR: unable to allocate memory.\n");
+        }
+    }
+    size_t index = out->length++;
+    memset(&out->code[index], 0, sizeof(instruction));
+    out->code[index].opcode = opcode;
+    out->offsets[index] = t->source->offsets[i];
+    out->lines[index] = t->source->lines[i];
+    t->last_write = -1;
+    return index;
+}
+
+static instruction* at(translator* t, int32_t index) { return &t->target->code[index]; }
+
+static void add_jump(translator* t, int32_t index) {
+    if (t->jumps_count == t->jumps_capacity) {
+        t->jumps_capacity = t->jumps_capacity == 0 ? 256 : 2 * t->jumps_capacity;
+        t->jumps = realloc(t->jumps, t->jumps_capacity * sizeof(size_t));
+        if (!t->jumps) {
+            failure("ERROR: unable to allocate memory.\n");
+        }
+    }
+    t->jumps[t->jumps_count++] = index;
+}
+
+// Copies a source instruction as it is, along with the descriptors following CLOSURE
+static void copy(translator* t, size_t i) {
+    const instruction* insn = &t->source->code[i];
+    for (size_t k = 0; k < instruction_width(insn); k++) {
+        int32_t index = emit(t, insn[k].opcode, i + k);
+        *at(t, index) = insn[k];
+        if (k == 0 && is_jump(insn->opcode)) {
+            add_jump(t, index);
+        }
+    }
+}
+
+// Register of the stack slot at depth `k`
+static int32_t temporary(const translator* t, int32_t k) { return -(t->n_locals + k); }
+
+static bool in_place(const translator* t, int32_t k) { return t->stack[k].kind == SLOT_IN_PLACE; }
+
+static int32_t register_of(const translator* t, int32_t k) {
+    return in_place(t, k) ? temporary(t, k) : t->stack[k].n;
+}
+
+static void push(translator* t, slot_kind kind, int32_t n) {
+    if (kind != SLOT_IN_PLACE && t->height < t->first_pending) {
+        t->first_pending = t->height;
+    }
+    t->stack[t->height++] = (slot){kind, n};
+}
+
+static void pop(translator* t, int32_t n) {
+    t->height -= n;
+    if (t->first_pending > t->height) {
+        t->first_pending = t->height;
+    }
+}
+
+// Stores the value at depth `k` to its slot
+static void materialize(translator* t, int32_t k) {
+    slot* s = &t->stack[k];
+    if (s->kind == SLOT_REGISTER && s->n != temporary(t, k)) {
+        int32_t index = emit(t, OP_REG_MOVE, t->current);
+        at(t, index)->a.n = temporary(t, k);
+        at(t, index)->b.n = s->n;
+    } else if (s->kind == SLOT_CONSTANT) {
+        int32_t index = emit(t, OP_REG_CONST, t->current);
+        at(t, index)->a.n = temporary(t, k);
+        at(t, index)->b.n = s->n;
+    }
+    s->kind = SLOT_IN_PLACE;
+}
+
+static void flush_below(translator* t, int32_t height) {
+    for (int32_t k = t->first_pending; k < height; k++) {
+        materialize(t, k);
+    }
+    if (t->first_pending < height) {
+        t->first_pending = height;
+    }
+}
+
+static void sync_sp(translator* t) {
+    if (t->sp_height != t->height) {
+        int32_t index = emit(t, OP_REG_SP, t->current);
+        at(t, index)->a.n = temporary(t, t->height);
+        t->sp_height = t->height;
+    }
+}
+
+// Whether the topmost value is where stack code expects it
+static bool top_on_stack(const translator* t) {
+    return t->height > 0 && in_place(t, t->height - 1) && t->sp_height == t->height;
+}
+
+static void stack_instruction(translator* t, size_t i) {
+    int32_t pops, pushes;
+    effect(t, i, &pops, &pushes);
+    flush_below(t, t->height);
+    sync_sp(t);
+    copy(t, i);
+    pop(t, pops);
+    if (pushes) {
+        push(t, SLOT_IN_PLACE, 0);
+    }
+    t->sp_height = t->height;
+}
+
+static void register_load(translator* t, size_t i, int32_t opcode, int32_t b, int32_t c) {
+    int32_t index = emit(t, opcode, i);
+    at(t, index)->a.n = temporary(t, t->height);
+    at(t, index)->b.n = b;
+    at(t, index)->c.n = c;
+    push(t, SLOT_IN_PLACE, 0);
+    t->last_write = index;
+}
+
+static void register_binop(translator* t, size_t i, int32_t operator_code) {
+    int32_t x = t->height - 2, y = t->height - 1;
+    if (t->stack[x].kind == SLOT_CONSTANT) {
+        materialize(t, x);
+    }
+    int32_t index;
+    if (t->stack[y].kind == SLOT_CONSTANT) {
+        index = emit(t, OP_REG_CONST_PLUS + 2 * operator_code, i);
+        at(t, index)->c.n = t->stack[y].n;
+    } else {
+        index = emit(t, OP_REG_PLUS + 2 * operator_code, i);
+        at(t, index)->c.n = register_of(t, y);
+    }
+    at(t, index)->a.n = temporary(t, x);
+    at(t, index)->b.n = register_of(t, x);
+    pop(t, 2);
+    push(t, SLOT_IN_PLACE, 0);
+    t->last_write = index;
+}
+
+// ST to a local or an argument: the value is computed right into the variable if
+// it has just been, otherwise copied
+static void store_frame(translator* t, size_t i, int32_t variable) {
+    // the values still to be read from the variable are read first
+    for (int32_t k = t->first_pending; k < t->height - 1; k++) {
+        if (t->stack[k].kind == SLOT_REGISTER && t->stack[k].n == variable) {
+            materialize(t, k);
+        }
+    }
+    slot* top = &t->stack[t->height - 1];
+    if (top->kind == SLOT_REGISTER && top->n == variable) {
+        return;
+    }
+    if (t->last_write >= 0 && in_place(t, t->height - 1) &&
+        at(t, t->last_write)->a.n == temporary(t, t->height - 1)) {
+        at(t, t->last_write)->a.n = variable;
+        t->last_write = -1;
+        *top = (slot){SLOT_REGISTER, variable};
+        if (t->height - 1 < t->first_pending) {
+            t->first_pending = t->height - 1;
+        }
+        return;
+    }
+    if (top_on_stack(t)) {
+        copy(t, i);
+        return;
+    }
+    int32_t index = emit(t, top->kind == SLOT_CONSTANT ? OP_REG_CONST : OP_REG_MOVE, i);
+    at(t, index)->a.n = variable;
+    at(t, index)->b.n = top->kind == SLOT_CONSTANT ? top->n : register_of(t, t->height - 1);
+}
+
+// ST to a global or a captured variable
+static void store_indirect(translator* t, size_t i, int32_t opcode) {
+    if (top_on_stack(t)) {
+        copy(t, i);
+        return;
+    }
+    if (t->stack[t->height - 1].kind == SLOT_CONSTANT) {
+        materialize(t, t->height - 1);
+    }
+    const instruction* insn = &t->source->code[i];
+    int32_t source = register_of(t, t->height - 1);
+    int32_t index = emit(t, opcode, i);
+    at(t, index)->a.n = insn->a.n;
+    if (opcode == OP_REG_ST_GLOBAL) {
+        at(t, index)->b.n = source;
+    } else {
+        at(t, index)->b.n = insn->b.n;
+        at(t, index)->c.n = source;
+    }
+}
+
+static void conditional_jump(translator* t, size_t i) {
+    // the values under the condition stay on the stack either way
+    flush_below(t, t->height - 1);
+    if (top_on_stack(t)) {
+        copy(t, i);
+        pop(t, 1);
+        t->sp_height = t->height;
+        return;
+    }
+    if (t->stack[t->height - 1].kind == SLOT_CONSTANT) {
+        materialize(t, t->height - 1);
+    }
+    int32_t condition = register_of(t, t->height - 1);
+    pop(t, 1);
+    sync_sp(t);
+    int32_t opcode = t->source->code[i].opcode == OP_CJMPZ ? OP_REG_CJMPZ : OP_REG_CJMPNZ;
+    int32_t index = emit(t, opcode, i);
+    at(t, index)->a.target = t->source->code[i].a.target;
+    at(t, index)->b.n = condition;
+    add_jump(t, index);
+}
+
+static void translate_instruction(translator* t, size_t i) {
+    const instruction* insn = &t->source->code[i];
+    bool registers = t->in_registers[i];
+    if (is_binop(insn->opcode)) {
+        if (registers) {
+            register_binop(t, i, insn->opcode - OP_BINOP_PLUS);
+        } else {
+            stack_instruction(t, i);
+        }
+        return;
+    }
+
+    switch (insn->opcode) {
+        case OP_LD_LOCAL:
+        case OP_LD_ARGUMENT:
+            if (registers) {
+                push(t, SLOT_REGISTER, insn->a.n);
+                return;
+            }
+            break;
+        case OP_CONST:
+            if (registers) {
+                push(t, SLOT_CONSTANT, insn->a.n);
+                return;
+            }
+            break;
+        case OP_LD_GLOBAL:
+            if (registers) {
+                register_load(t, i, OP_REG_LD_GLOBAL, insn->a.n, 0);
+                return;
+            }
+            break;
+        case OP_LD_CLOSURE:
+            if (registers) {
+                register_load(t, i, OP_REG_LD_CLOSURE, insn->a.n, insn->b.n);
+                return;
+            }
+            break;
+        case OP_DUP:
+            if (registers) {
+                slot top = t->stack[t->height - 1];
+                if (top.kind == SLOT_IN_PLACE) {
+                    top = (slot){SLOT_REGISTER, temporary(t, t->height - 1)};
+                }
+                push(t, top.kind, top.n);
+                return;
+            }
+            break;
+        case OP_ST_LOCAL:
+        case OP_ST_ARGUMENT:
+            store_frame(t, i, insn->a.n);
+            return;
+        case OP_ST_GLOBAL:
+            store_indirect(t, i, OP_REG_ST_GLOBAL);
+            return;
+        case OP_ST_CLOSURE:
+            store_indirect(t, i, OP_REG_ST_CLOSURE);
+            return;
+        case OP_DROP:
+            if (top_on_stack(t)) {
+                copy(t, i);
+                pop(t, 1);
+                t->sp_height = t->height;
+            } else {
+                pop(t, 1);
+            }
+            return;
+        case OP_CJMPZ:
+        case OP_CJMPNZ:
+            conditional_jump(t, i);
+            return;
+    }
+    stack_instruction(t, i);
+}
+
+static void translate_function(translator* t, size_t begin, size_t end, bool registers) {
+    const instruction* code = t->source->code;
+    bool falls_through = false;
+    for (size_t i = begin; i < end; i += instruction_width(&code[i])) {
+        if (registers && t->leaders[i] && falls_through) {
+            // control enters a block with every value in its slot
+            flush_below(t, t->height);
+            sync_sp(t);
+        }
+        for (size_t k = 0; k < instruction_width(&code[i]); k++) {
+            t->start[i + k] = t->target->length;
+        }
+        if (!registers || t->depth[i] < 0) {
+            copy(t, i);
+            falls_through = false;
+            continue;
+        }
+        if (t->leaders[i]) {
+            t->height = t->sp_height = t->first_pending = t->depth[i];
+            for (int32_t k = 0; k < t->height; k++) {
+                t->stack[k] = (slot){SLOT_IN_PLACE, 0};
+            }
+            t->last_write = -1;
+        }
+        if (code[i].opcode == OP_BEGIN || code[i].opcode == OP_CBEGIN) {
+            t->n_locals = code[i].b.n;
+        }
+        t->current = i;
+        translate_instruction(t, i);
+        falls_through = !ends_block(code[i].opcode);
+    }
+}
+
+program* translate_to_registers(program* p) {
+    translator t = {.source = p};
+    t.leaders = find_blocks(p);
+    t.depth = allocate((p->length + 1) * sizeof(int32_t));
+    t.consumer = allocate(p->length * sizeof(int32_t));
+    t.in_registers = allocate(p->length);
+    t.sta_to_reference = allocate(p->length);
+    t.stack_code_after = allocate((p->length + 1) * sizeof(int32_t));
+    t.producer = allocate((p->length + 1) * sizeof(int32_t));
+    t.worklist = allocate((p->length + 1) * sizeof(size_t));
+    t.stack = allocate((p->length + 1) * sizeof(slot));
+    t.start = allocate((p->length + 1) * sizeof(int32_t));
+    for (size_t i = 0; i < p->length; i++) {
+        t.depth[i] = t.consumer[i] = -1;
+    }
+
+    program* out = allocate(sizeof(program));
+    t.target = out;
+    out->code_size = p->code_size;
+
+    // a function runs from its BEGIN to the next one
+    for (size_t begin = 0, end; begin < p->length; begin = end) {
+        end = begin + instruction_width(&p->code[begin]);
+        while (end < p->length && p->code[end].opcode != OP_BEGIN && p->code[end].opcode != OP_CBEGIN) {
+            end += instruction_width(&p->code[end]);
+        }
+        int32_t opcode = p->code[begin].opcode;
+        bool registers = (opcode == OP_BEGIN || opcode == OP_CBEGIN) && analyze_function(&t, begin, end);
+        if (registers) {
+            decide_function(&t, begin, end);
+        }
+        translate_function(&t, begin, end, registers);
+    }
+    t.start[p->length] = out->length;
+
+    for (size_t k = 0; k < t.jumps_count; k++) {
+        instruction* jump = &out->code[t.jumps[k]];
+        jump->a.target = &out->code[t.start[jump->a.target - p->code]];
+    }
+    out->index_by_offset = allocate(p->code_size * sizeof(int32_t));
+    for (size_t offset = 0; offset < p->code_size; offset++) {
+        int32_t i = p->index_by_offset[offset];
+        out->index_by_offset[offset] = i < 0 ? -1 : t.start[i];
+    }
+
+    free(t.leaders);
+    free(t.depth);
+    free(t.consumer);
+    free(t.in_registers);
+    free(t.sta_to_reference);
+    free(t.stack_code_after);
+    free(t.producer);
+    free(t.worklist);
+    free(t.stack);
+    free(t.start);
+    free(t.jumps);
+    free(p->code);
+    free(p->offsets);
+    free(p->lines);
+    free(p->index_by_offset);
+    free(p);
+    return out;
+}
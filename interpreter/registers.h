@@ -0,0 +1,27 @@
+#ifndef __LAMA_REGISTERS__
+#define __LAMA_REGISTERS__
+
+#include "decoder.h"
+
+// Register form of a decoded program, run by the same engines (see --registers).
+//
+// The operand stack of a function call lies right below its locals, and the
+// depth of the stack before every instruction is known statically, so every
+// value on the stack has a slot of its own at a fixed offset from fp: stack
+// slots, locals and arguments are all registers. Within a basic block, the
+// values computed by LD, CONST, DUP and BINOP for a BINOP, ST, DROP or a
+// conditional jump are kept in registers: loads of locals and arguments only
+// rename a register, constants become operands, binary operators name their
+// operands and their destination, and ST makes the instruction computing the
+// stored value write the variable directly. All the other instructions are left
+// as they are, as the operand stack is where they expect it: the values on it
+// are stored to their slots first and REG_SP moves the stack pointer where the
+// register code has not. Control enters a block with every value in its slot
+// and the stack pointer right below the topmost one.
+//
+// Functions whose stack depth is not known statically (STA through a reference
+// computed in another block, unsupported instructions) are left as they are.
+// Consumes `p` and returns the translated program.
+program* translate_to_registers(program* p);
+
+#endif
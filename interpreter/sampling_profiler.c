@@ -0,0 +1,318 @@
+#include "sampling_profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../runtime/runtime.h"
+
+// Deeper call stacks keep their innermost frames only
+#define MAX_SAMPLE_DEPTH 256
+
+// A frame of a sampled stack: the function and the source line it is at (0 if unknown)
+typedef struct {
+    int32_t function;
+    int32_t line;
+} location;
+
+// A distinct sampled stack, whose `depth` frames, the innermost first, are kept
+// in the pool of locations from `first` on
+typedef struct {
+    uint64_t count;
+    uint32_t hash;
+    int32_t depth;
+    bool truncated;
+    size_t first;
+} sampled_stack;
+
+typedef struct {
+    int32_t offset;
+    const char* name;
+    uint64_t self;
+    uint64_t total;
+    // the last stack counted in `total`, a recursive function counts once per stack
+    size_t last_stack;
+} function_samples;
+
+bool sampling_profiler_enabled = false;
+volatile sig_atomic_t sample_requested = 0;
+
+static const program* sampled_program;
+static const char* folded_path;
+static size_t top_n;
+static uint32_t sample_rate;
+
+static function_samples* functions;
+static size_t functions_count;
+// index of the function every instruction belongs to
+static int32_t* function_by_insn;
+
+// open addressing hash table of the sampled stacks, empty slots have count == 0
+static sampled_stack* stacks;
+static size_t stacks_capacity, stacks_count;
+static location* pool;
+static size_t pool_count, pool_capacity;
+static uint64_t samples_count;
+
+static void request_sample(int signal) { sample_requested = 1; }
+
+static location locate(const instruction* insn) {
+    size_t index = insn - sampled_program->code;
+    return (location){.function = function_by_insn[index], .line = sampled_program->lines[index]};
+}
+
+static uint32_t hash_stack(const location* frames, int32_t depth, bool truncated) {
+    uint32_t hash = 2166136261u ^ truncated;
+    for (int32_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uint32_t)frames[i].function) * 16777619u;
+        hash = (hash ^ (uint32_t)frames[i].line) * 16777619u;
+    }
+    return hash;
+}
+
+static size_t stack_slot(sampled_stack* table, size_t capacity, uint32_t hash, const location* frames,
+                         int32_t depth, bool truncated) {
+    size_t slot = hash & (capacity - 1);
+    while (table[slot].count &&
+           (table[slot].hash != hash || table[slot].depth != depth || table[slot].truncated != truncated ||
+            memcmp(&pool[table[slot].first], frames, depth * sizeof(location)) != 0)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+static void grow_stacks(void) {
+    size_t capacity = stacks_capacity ? stacks_capacity * 2 : 256;
+    sampled_stack* table = calloc(capacity, sizeof(sampled_stack));
+    if (!table) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    for (size_t i = 0; i < stacks_capacity; i++) {
+        sampled_stack* s = &stacks[i];
+        if (s->count) {
+            table[stack_slot(table, capacity, s->hash, &pool[s->first], s->depth, s->truncated)] = *s;
+        }
+    }
+    free(stacks);
+    stacks = table;
+    stacks_capacity = capacity;
+}
+
+void take_sample(const instruction* ip, const call_frame* frame, const call_frame* frames) {
+    location frames_of_sample[MAX_SAMPLE_DEPTH];
+    int32_t depth = 0;
+
+    sample_requested = 0;
+    // a sample at the entry of a function is one of its caller, at the call
+    if ((ip->opcode == OP_BEGIN || ip->opcode == OP_CBEGIN) && frame > frames) {
+        ip = frame->return_ip - 1;
+        frame--;
+    }
+    frames_of_sample[depth++] = locate(ip);
+    // the caller of a function is at the call which has pushed its record
+    for (; frame > frames && depth < MAX_SAMPLE_DEPTH; frame--) {
+        frames_of_sample[depth++] = locate(frame->return_ip - 1);
+    }
+    bool truncated = frame > frames;
+
+    if (2 * (stacks_count + 1) > stacks_capacity) {
+        grow_stacks();
+    }
+    uint32_t hash = hash_stack(frames_of_sample, depth, truncated);
+    sampled_stack* s = &stacks[stack_slot(stacks, stacks_capacity, hash, frames_of_sample, depth, truncated)];
+    if (!s->count) {
+        while (pool_count + depth > pool_capacity) {
+            pool_capacity = pool_capacity ? pool_capacity * 2 : 4096;
+            pool = realloc(pool, pool_capacity * sizeof(location));
+            if (!pool) {
+                failure("ERROR: unable to allocate memory.\n");
+            }
+        }
+        memcpy(&pool[pool_count], frames_of_sample, depth * sizeof(location));
+        *s = (sampled_stack){.hash = hash, .depth = depth, .truncated = truncated, .first = pool_count};
+        pool_count += depth;
+        stacks_count++;
+    }
+    s->count++;
+    samples_count++;
+}
+
+static void print_location(FILE* f, location l) {
+    if (functions[l.function].name) {
+        fprintf(f, "%s", functions[l.function].name);
+    } else {
+        fprintf(f, "L%d", functions[l.function].offset);
+    }
+    if (l.line) {
+        fprintf(f, ":%d", l.line);
+    }
+}
+
+static void write_folded_stacks(void) {
+    FILE* f = fopen(folded_path, "w");
+    if (!f) {
+        fprintf(stderr, "ERROR: unable to write folded stacks to %s\n", folded_path);
+        return;
+    }
+    for (size_t i = 0; i < stacks_capacity; i++) {
+        const sampled_stack* s = &stacks[i];
+        if (!s->count) {
+            continue;
+        }
+        if (s->truncated) {
+            fprintf(f, "...;");
+        }
+        for (int32_t k = s->depth - 1; k >= 0; k--) {
+            print_location(f, pool[s->first + k]);
+            fputc(k ? ';' : ' ', f);
+        }
+        fprintf(f, "%llu\n", (unsigned long long)s->count);
+    }
+    fclose(f);
+}
+
+typedef struct {
+    location where;
+    uint64_t count;
+} line_samples;
+
+static int compare_functions(const void* x, const void* y) {
+    const function_samples *a = &functions[*(const int32_t*)x], *b = &functions[*(const int32_t*)y];
+    if (a->self != b->self) {
+        return a->self < b->self ? 1 : -1;
+    }
+    return (a->total < b->total) - (a->total > b->total);
+}
+
+static int compare_locations(const void* x, const void* y) {
+    const line_samples *a = x, *b = y;
+    if (a->where.function != b->where.function) {
+        return a->where.function - b->where.function;
+    }
+    return a->where.line - b->where.line;
+}
+
+static int compare_counts(const void* x, const void* y) {
+    const line_samples *a = x, *b = y;
+    return (a->count < b->count) - (a->count > b->count);
+}
+
+static double percent(uint64_t part, uint64_t total) { return total ? 100.0 * part / total : 0.0; }
+
+static void print_summary(void) {
+    int32_t* order = malloc((functions_count + 1) * sizeof(int32_t));
+    line_samples* lines = malloc((stacks_count + 1) * sizeof(line_samples));
+    size_t n = 0, m = 0;
+
+    if (!order || !lines) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    for (size_t i = 0; i < stacks_capacity; i++) {
+        const sampled_stack* s = &stacks[i];
+        if (!s->count) {
+            continue;
+        }
+        functions[pool[s->first].function].self += s->count;
+        for (int32_t k = 0; k < s->depth; k++) {
+            function_samples* f = &functions[pool[s->first + k].function];
+            if (f->last_stack != i + 1) {
+                f->last_stack = i + 1;
+                f->total += s->count;
+            }
+        }
+        lines[m++] = (line_samples){.where = pool[s->first], .count = s->count};
+    }
+    for (size_t i = 0; i < functions_count; i++) {
+        if (functions[i].total) {
+            order[n++] = i;
+        }
+    }
+    qsort(order, n, sizeof(int32_t), compare_functions);
+
+    // merge the innermost lines of all the stacks
+    qsort(lines, m, sizeof(line_samples), compare_locations);
+    size_t merged = 0;
+    for (size_t i = 0; i < m; i++) {
+        if (merged && compare_locations(&lines[merged - 1], &lines[i]) == 0) {
+            lines[merged - 1].count += lines[i].count;
+        } else {
+            lines[merged++] = lines[i];
+        }
+    }
+    qsort(lines, merged, sizeof(line_samples), compare_counts);
+
+    fprintf(stderr, "%llu samples, one per %.3f ms of CPU time\n", (unsigned long long)samples_count,
+            1000.0 / sample_rate);
+    fprintf(stderr, "%-32s %12s %8s %12s %8s\n", "function", "self", "%", "total", "%");
+    for (size_t i = 0; i < n && i < top_n; i++) {
+        const function_samples* f = &functions[order[i]];
+        char name[32];
+        if (f->name) {
+            snprintf(name, sizeof(name), "%s", f->name);
+        } else {
+            snprintf(name, sizeof(name), "L%d", f->offset);
+        }
+        fprintf(stderr, "%-32s %12llu %8.2f %12llu %8.2f\n", name, (unsigned long long)f->self,
+                percent(f->self, samples_count), (unsigned long long)f->total, percent(f->total, samples_count));
+    }
+
+    fprintf(stderr, "\nlines:\n");
+    for (size_t i = 0; i < merged && i < top_n; i++) {
+        fprintf(stderr, "  ");
+        print_location(stderr, lines[i].where);
+        fprintf(stderr, ": %llu samples, %.2f%%\n", (unsigned long long)lines[i].count,
+                percent(lines[i].count, samples_count));
+    }
+    free(order);
+    free(lines);
+}
+
+static void write_report(void) {
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &off, NULL);
+    print_summary();
+    write_folded_stacks();
+}
+
+void start_sampling_profiler(const bytefile* bf, const program* p, const char* path, size_t top, uint32_t rate) {
+    function_by_insn = malloc(p->length * sizeof(int32_t));
+    functions = malloc((p->length + 1) * sizeof(function_samples));
+    if (!function_by_insn || !functions) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+
+    // a function takes the instructions from its BEGIN to the next one
+    int32_t function = -1;
+    for (size_t i = 0; i < p->length; i++) {
+        if (p->code[i].opcode == OP_BEGIN || p->code[i].opcode == OP_CBEGIN) {
+            function = functions_count;
+            functions[functions_count++] = (function_samples){.offset = p->offsets[i]};
+        }
+        function_by_insn[i] = function;
+    }
+    for (unsigned int i = 0; i < bf->public_symbols_number; i++) {
+        size_t index = p->index_by_offset[bf->public_ptr[2 * i + 1]];
+        if (p->code[index].opcode == OP_BEGIN || p->code[index].opcode == OP_CBEGIN) {
+            functions[function_by_insn[index]].name = &bf->string_ptr[bf->public_ptr[2 * i]];
+        }
+    }
+
+    sampled_program = p;
+    folded_path = path;
+    top_n = top;
+    sample_rate = rate;
+    sampling_profiler_enabled = true;
+    atexit(write_report);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    struct itimerval timer = {.it_interval = {.tv_sec = 0, .tv_usec = 1000000 / rate}};
+    timer.it_value = timer.it_interval;
+    if (sigaction(SIGPROF, &action, NULL) != 0 || setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        failure("ERROR: unable to start the sampling profiler.\n");
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef __LAMA_SAMPLING_PROFILER__
+#define __LAMA_SAMPLING_PROFILER__
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "decoder.h"
+#include "interpreter.h"
+
+#define DEFAULT_SAMPLE_RATE 100
+
+extern bool sampling_profiler_enabled;
+
+// Set by the SIGPROF handler, cleared once the sample is taken
+extern volatile sig_atomic_t sample_requested;
+
+// Enables the sampling profiler for the given program. An interval timer sends
+// SIGPROF `rate` times per second of CPU time, and the interpreter takes a
+// sample at the next point it checks for one (see take_sample). At exit
+// the samples are written to `folded_path` as folded stacks, one frame per
+// function and source line, and the `top` hottest functions and lines are
+// printed to stderr.
+void start_sampling_profiler(const bytefile* bf, const program* p, const char* folded_path, size_t top,
+                             uint32_t rate);
+
+// Records the call stack of the running fiber: the innermost function is at
+// `ip` and has the record `frame`, the records of its callers go down to
+// `frames`, the one of the first function of the fiber. The interpreter calls it
+// at function entries and jumps (at any instruction in the switch engine) once
+// sample_requested is set.
+void take_sample(const instruction* ip, const call_frame* frame, const call_frame* frames);
+
+#endif
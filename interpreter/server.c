@@ -0,0 +1,132 @@
+#define _GNU_SOURCE 1
+
+#include "server.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../runtime/runtime.h"
+
+#define LISTEN_BACKLOG 16
+
+static sigjmp_buf job_failed;
+
+// A failure of the program (possibly reported from the stack overflow handler,
+// hence the signal mask saved along) abandons the job instead of the process
+static void abandon_job(void) {
+    siglongjmp(job_failed, 1);
+}
+
+bool read_job(FILE* in, char** input, size_t* length) {
+    if (fscanf(in, "%zu", length) != 1 || fgetc(in) != '\n') {
+        if (!feof(in)) {
+            fprintf(stderr, "ERROR: malformed job header, the stream is dropped.\n");
+        }
+        return false;
+    }
+    // fmemopen wants a buffer even for an empty input
+    *input = malloc(*length + 1);
+    if (*input == NULL) {
+        failure("ERROR: no memory for the input of a job of %zu bytes.\n", *length);
+    }
+    if (fread(*input, 1, *length, in) != *length) {
+        fprintf(stderr, "ERROR: the stream ends inside a job.\n");
+        free(*input);
+        return false;
+    }
+    return true;
+}
+
+// Runs a job with the standard streams of the process replaced by in-memory
+// ones and writes the answer to `out`
+static void run_captured(void (*run_job)(void), char* input, size_t length, FILE* out) {
+    FILE* const process_streams[] = {stdin, stdout, stderr};
+    char* output = NULL;
+    char* errors = NULL;
+    size_t output_length = 0, errors_length = 0;
+
+    stdin = fmemopen(input, length, "r");
+    stdout = open_memstream(&output, &output_length);
+    stderr = open_memstream(&errors, &errors_length);
+    if (stdin == NULL || stdout == NULL || stderr == NULL) {
+        stdin = process_streams[0], stdout = process_streams[1], stderr = process_streams[2];
+        failure("ERROR: cannot set up the streams of a job: %s.\n", strerror(errno));
+    }
+
+    int status = 0;
+    failure_hook = abandon_job;
+    if (sigsetjmp(job_failed, 1) == 0) {
+        run_job();
+    } else {
+        status = 255;
+    }
+    failure_hook = NULL;
+
+    fclose(stdin);
+    fclose(stdout);
+    fclose(stderr);
+    stdin = process_streams[0], stdout = process_streams[1], stderr = process_streams[2];
+
+    fprintf(out, "%d %zu %zu\n", status, output_length, errors_length);
+    fwrite(output, 1, output_length, out);
+    fwrite(errors, 1, errors_length, out);
+    fflush(out);
+    free(output);
+    free(errors);
+}
+
+static void serve_stream(FILE* in, FILE* out, void (*run_job)(void)) {
+    char* input;
+    size_t length;
+    while (read_job(in, &input, &length)) {
+        run_captured(run_job, input, length, out);
+        free(input);
+    }
+}
+
+void serve_stdio(void (*run_job)(void)) {
+    serve_stream(stdin, stdout, run_job);
+}
+
+void serve_socket(const char* path, void (*run_job)(void)) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        failure("ERROR: socket path is too long: %s\n", path);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listener, LISTEN_BACKLOG) < 0) {
+        failure("ERROR: cannot listen on %s: %s.\n", path, strerror(errno));
+    }
+    // a client leaving before its answers are written must not stop the server
+    signal(SIGPIPE, SIG_IGN);
+
+    while (true) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            failure("ERROR: cannot accept a connection on %s: %s.\n", path, strerror(errno));
+        }
+        FILE* in = fdopen(connection, "r");
+        FILE* out = fdopen(dup(connection), "w");
+        if (in == NULL || out == NULL) {
+            failure("ERROR: cannot open the streams of a connection: %s.\n", strerror(errno));
+        }
+        serve_stream(in, out, run_job);
+        fclose(in);
+        fclose(out);
+    }
+}
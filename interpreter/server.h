@@ -0,0 +1,27 @@
+#ifndef __LAMA_SERVER__
+#define __LAMA_SERVER__
+
+// Batch mode: the program is loaded once and then run once per job of a stream.
+// A job is a decimal byte count and a newline followed by that many bytes, which
+// the program reads as its standard input. The answer to a job is
+// "<status> <output bytes> <error bytes>\n" followed by what the program has
+// written to its standard output and to its standard error. The status is 0, or
+// 255 (the exit code of a failed interpreter) if the program has failed, which
+// does not stop the server.
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Reads the input of the next job of `in` into a buffer the caller frees; false
+// at the end of the stream or if it does not hold a job
+bool read_job(FILE* in, char** input, size_t* length);
+
+// Runs `run_job` for each job read from the standard input and answers on the
+// standard output, until the input ends
+void serve_stdio(void (*run_job)(void));
+
+// Accepts connections to the Unix socket at `path` one at a time and serves the
+// jobs sent over each of them as serve_stdio does; never returns
+void serve_socket(const char* path, void (*run_job)(void));
+
+#endif
@@ -0,0 +1,112 @@
+#include "stacks.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../runtime/runtime.h"
+
+typedef struct {
+    uintptr_t begin;
+    uintptr_t end;
+    const char* message;
+} guard;
+
+// A stack overflows in the thread it belongs to, where the handler runs, so
+// every thread only keeps track of its own stacks: the operand stack and the
+// call stack of the machine, and the ones of its fibers
+static _Thread_local guard* guards = NULL;
+static _Thread_local int guards_count = 0;
+static _Thread_local int guards_capacity = 0;
+static pthread_once_t handler_installed = PTHREAD_ONCE_INIT;
+static struct sigaction previous_action;
+// the handler also runs when the native stack itself is exhausted
+static _Thread_local char handler_stack[1 << 16];
+
+static void write_message(const char* message) {
+    size_t length = strlen(message);
+    while (length > 0) {
+        ssize_t written = write(STDERR_FILENO, message, length);
+        if (written <= 0) {
+            return;
+        }
+        message += written, length -= written;
+    }
+}
+
+static void overflow_handler(int sig, siginfo_t* info, void* context) {
+    uintptr_t address = (uintptr_t)info->si_addr;
+    for (int i = 0; i < guards_count; i++) {
+        if (address >= guards[i].begin && address < guards[i].end) {
+            // only async-signal-safe calls from here: the message bypasses stdio,
+            // and the failure hook, when set, abandons the job with siglongjmp
+            write_message("*** FAILURE: ");
+            write_message(guards[i].message);
+            if (failure_hook) {
+                failure_hook();
+            }
+            _exit(255);
+        }
+    }
+    // not an overflow: pass the fault on to the previous handler (the runtime's)
+    // and stay installed for the next one
+    if (previous_action.sa_flags & SA_SIGINFO) {
+        previous_action.sa_sigaction(sig, info, context);
+    } else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN) {
+        previous_action.sa_handler(sig);
+    } else {
+        // the default action terminates the process once the faulting access
+        // is restarted, so there is nothing to stay installed for
+        signal(SIGSEGV, SIG_DFL);
+    }
+}
+
+static void install_handler(void) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = overflow_handler;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &previous_action) == -1) {
+        failure("ERROR: unable to install the stack overflow handler: %s\n", strerror(errno));
+    }
+}
+
+void* reserve_stack(size_t size, bool grows_down, const char* overflow_message) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size = (size + page - 1) / page * page;
+    if (guards_count == guards_capacity) {
+        guards_capacity = guards_capacity == 0 ? 2 : 2 * guards_capacity;
+        guards = realloc(guards, guards_capacity * sizeof(guard));
+        if (guards == NULL) {
+            failure("ERROR: too many virtual machine stacks.\n");
+        }
+    }
+
+    uint8_t* region = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) {
+        failure("ERROR: unable to reserve %zu bytes for a stack: %s\n", size, strerror(errno));
+    }
+    uint8_t* guard_page = grows_down ? region : region + size;
+    if (mprotect(guard_page, page, PROT_NONE) == -1) {
+        failure("ERROR: unable to protect the stack guard page: %s\n", strerror(errno));
+    }
+
+    if (guards_count == 0) {
+        // the signal stack is per thread, the handler is per process
+        stack_t stack = {.ss_sp = handler_stack, .ss_size = sizeof(handler_stack)};
+        if (sigaltstack(&stack, NULL) == -1) {
+            failure("ERROR: unable to set up the signal stack: %s\n", strerror(errno));
+        }
+        pthread_once(&handler_installed, install_handler);
+    }
+    guards[guards_count++] = (guard){
+        .begin = (uintptr_t)guard_page, .end = (uintptr_t)(guard_page + page), .message = overflow_message};
+    return grows_down ? region + page : region;
+}
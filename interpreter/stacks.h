@@ -0,0 +1,14 @@
+#ifndef __LAMA_STACKS__
+#define __LAMA_STACKS__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Reserves `size` bytes of address space for a virtual machine stack, committed
+// by the kernel page by page as the stack grows, and places an inaccessible
+// guard page right past its limit: below the stack if it `grows_down`, above it
+// otherwise. Any access to the guard page fails with `overflow_message`, so
+// pushes need no bounds checks. Returns the lowest address of the stack.
+void* reserve_stack(size_t size, bool grows_down, const char* overflow_message);
+
+#endif
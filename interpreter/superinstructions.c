@@ -0,0 +1,183 @@
+#include "superinstructions.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../runtime/runtime.h"
+
+static void mark(uint8_t* leaders, const program* p, const instruction* insn) {
+    leaders[insn - p->code] = 1;
+}
+
+uint8_t* find_block_leaders(const program* p) {
+    uint8_t* leaders = calloc(p->length + 1, 1);
+    if (!leaders) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+
+    leaders[0] = 1;
+    for (size_t i = 0; i < p->length; i += instruction_width(&p->code[i])) {
+        const instruction* insn = &p->code[i];
+        size_t next = i + instruction_width(insn);
+        switch (insn->opcode) {
+            case OP_BEGIN:
+            case OP_CBEGIN:
+                leaders[i] = 1;
+                break;
+            case OP_CJMPZ:
+            case OP_CJMPNZ:
+            case OP_REG_CJMPZ:
+            case OP_REG_CJMPNZ:
+            case OP_JMP:
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                mark(leaders, p, insn->a.target);
+                leaders[next] = 1;
+                break;
+            case OP_CALLC:
+            case OP_TAIL_CALLC:
+            case OP_END:
+            case OP_RET:
+            case OP_FAIL:
+                leaders[next] = 1;
+                break;
+        }
+    }
+    return leaders;
+}
+
+// Pattern element matching both LD_LOCAL and LD_ARGUMENT, which share the
+// fp-relative operand encoding
+#define LD_FRAME (-1)
+
+#define MAX_PATTERN_LENGTH 3
+
+typedef struct {
+    int32_t fused;
+    int length;
+    int32_t pattern[MAX_PATTERN_LENGTH];
+} superinstruction;
+
+// Candidates mined with the `ngrams` tool; longer sequences come first, as the
+// first matching one is taken
+static const superinstruction superinstructions[] = {
+    {OP_DUP_CONST_ELEM, 3, {OP_DUP, OP_CONST, OP_ELEM}},
+    {OP_DUP_TAG_CJMPZ, 3, {OP_DUP, OP_TAG, OP_CJMPZ}},
+    {OP_DUP_TAG_CJMPNZ, 3, {OP_DUP, OP_TAG, OP_CJMPNZ}},
+    {OP_DUP_ARRAY_CJMPZ, 3, {OP_DUP, OP_ARRAY, OP_CJMPZ}},
+    {OP_DUP_ARRAY_CJMPNZ, 3, {OP_DUP, OP_ARRAY, OP_CJMPNZ}},
+#define FUSED_BINOPS(n, op)                                             \
+    {OP_FRAME_FRAME_##n, 3, {LD_FRAME, LD_FRAME, OP_BINOP_##n}},        \
+    {OP_FRAME_CONST_##n, 3, {LD_FRAME, OP_CONST, OP_BINOP_##n}},
+    BINOPS(FUSED_BINOPS)
+#undef FUSED_BINOPS
+    {OP_CONST_ELEM, 2, {OP_CONST, OP_ELEM}},
+    {OP_DROP_DROP, 2, {OP_DROP, OP_DROP}},
+    {OP_ST_GLOBAL_DROP, 2, {OP_ST_GLOBAL, OP_DROP}},
+    {OP_ST_LOCAL_DROP, 2, {OP_ST_LOCAL, OP_DROP}},
+    {OP_ST_ARGUMENT_DROP, 2, {OP_ST_ARGUMENT, OP_DROP}},
+    {OP_ST_CLOSURE_DROP, 2, {OP_ST_CLOSURE, OP_DROP}},
+};
+
+static bool matches(const program* p, const uint8_t* leaders, size_t start, const superinstruction* s) {
+    if (start + s->length > p->length) {
+        return false;
+    }
+    for (int k = 0; k < s->length; k++) {
+        int32_t opcode = p->code[start + k].opcode;
+        if (k > 0 && leaders[start + k]) {
+            return false;
+        }
+        if (s->pattern[k] == LD_FRAME ? opcode != OP_LD_LOCAL && opcode != OP_LD_ARGUMENT
+                                      : opcode != s->pattern[k]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rewrites the first instruction of a matched sequence into the superinstruction
+static void fuse(instruction* insn, int32_t fused) {
+    switch (fused) {
+        case OP_DUP_CONST_ELEM:
+            insn->a.n = insn[1].a.n;
+            break;
+        case OP_DUP_TAG_CJMPZ:
+        case OP_DUP_TAG_CJMPNZ:
+            insn->a.n = insn[1].a.n;
+            insn->b.n = insn[1].b.n;
+            insn->c.target = insn[2].a.target;
+            break;
+        case OP_DUP_ARRAY_CJMPZ:
+        case OP_DUP_ARRAY_CJMPNZ:
+            insn->a.n = insn[1].a.n;
+            insn->c.target = insn[2].a.target;
+            break;
+        default:
+            if (fused >= OP_FRAME_FRAME_PLUS) {
+                // both FRAME_FRAME_<op> and FRAME_CONST_<op> take the second operand from the
+                // next instruction, be it a frame offset or a boxed constant
+                insn->b.n = insn[1].a.n;
+            }
+            // CONST_ELEM and ST_*_DROP keep the operands of their first instruction
+    }
+    insn->opcode = fused;
+}
+
+void fuse_superinstructions(program* p) {
+    uint8_t* leaders = find_block_leaders(p);
+    size_t n = sizeof(superinstructions) / sizeof(superinstructions[0]);
+
+    for (size_t i = 0; i < p->length;) {
+        const superinstruction* s = NULL;
+        for (size_t k = 0; k < n && !s; k++) {
+            if (matches(p, leaders, i, &superinstructions[k])) {
+                s = &superinstructions[k];
+            }
+        }
+        if (s) {
+            fuse(&p->code[i], s->fused);
+            i += s->length;
+        } else {
+            i += instruction_width(&p->code[i]);
+        }
+    }
+    free(leaders);
+}
+
+// Bound on the chain of jumps followed from a call to its END, which also stops
+// at jumps looping onto themselves
+#define MAX_JUMP_CHAIN 8
+
+void mark_tail_calls(program* p) {
+    // the arguments of the main function (the first one) are never pushed, as it
+    // is entered without a call, so there is nothing to move its callees' ones over
+    bool in_main = true;
+    for (size_t i = 0; i + 1 < p->length; i += instruction_width(&p->code[i])) {
+        instruction* insn = &p->code[i];
+        if (i > 0 && (insn->opcode == OP_BEGIN || insn->opcode == OP_CBEGIN)) {
+            in_main = false;
+        }
+        if (in_main || (insn->opcode != OP_CALL && insn->opcode != OP_CALLC)) {
+            continue;
+        }
+        const instruction* next = insn + 1;
+        for (int k = 0; k < MAX_JUMP_CHAIN && next->opcode == OP_JMP; k++) {
+            next = next->a.target;
+        }
+        if (next->opcode == OP_END) {
+            insn->opcode = insn->opcode == OP_CALL ? OP_TAIL_CALL : OP_TAIL_CALLC;
+        }
+    }
+}
+
+size_t fused_width(const instruction* insn) {
+    size_t n = sizeof(superinstructions) / sizeof(superinstructions[0]);
+    for (size_t k = 0; k < n; k++) {
+        if (superinstructions[k].fused == generic_opcode(insn->opcode)) {
+            return superinstructions[k].length;
+        }
+    }
+    return instruction_width(insn);
+}
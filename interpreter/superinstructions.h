@@ -0,0 +1,30 @@
+#ifndef __LAMA_SUPERINSTRUCTIONS__
+#define __LAMA_SUPERINSTRUCTIONS__
+
+#include <stdint.h>
+
+#include "decoder.h"
+
+// Returns one flag per decoded instruction, non-zero for instructions which
+// start a basic block: function entries, jump and call targets, return sites
+// and instructions following unconditional transfers of control.
+uint8_t* find_block_leaders(const program* p);
+
+// Replaces the most frequent instruction sequences of the decoded program with
+// superinstructions. A sequence never spans a block leader, so control can only
+// enter it at its first instruction: the first instruction is rewritten into the
+// fused one, the rest are left intact and skipped by the fused handler.
+void fuse_superinstructions(program* p);
+
+// Rewrites every CALL/CALLC whose result is immediately returned (it is followed
+// by END, possibly through unconditional jumps) into TAIL_CALL/TAIL_CALLC, which
+// reuse the frame of the caller instead of pushing a new one. Calls from the main
+// function are left as they are.
+void mark_tail_calls(program* p);
+
+// Number of decoded slots an instruction covers when it is executed: the
+// components of a superinstruction (quickened or not), the captured variable
+// descriptors of CLOSURE
+size_t fused_width(const instruction* insn);
+
+#endif
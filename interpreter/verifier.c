@@ -0,0 +1,590 @@
+#include "verifier.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../runtime/runtime.h"
+#include "decoder.h"
+#include "externs.h"
+
+enum { JUMP_TARGET, CALL_TARGET, CLOSURE_TARGET };
+
+typedef struct {
+    int32_t site;
+    int32_t target;
+    int32_t kind;
+    int32_t n_args;
+    // the index of the function the site belongs to
+    int32_t function;
+} code_reference;
+
+typedef struct {
+    int32_t offset;
+    int32_t n_args;
+    bool is_closure;
+    // the largest captured value index accessed inside the function body
+    int32_t max_captured_idx;
+} function_info;
+
+typedef struct {
+    const bytefile* bf;
+    const uint8_t* code_end;
+    const uint8_t* ip;
+    int32_t insn_offset;
+    // one byte per byte of code, non-zero at instruction starts
+    uint8_t* insn_starts;
+
+    function_info* functions;
+    size_t functions_count;
+    size_t functions_capacity;
+    function_info* current_function;
+    int32_t current_locals;
+
+    code_reference* references;
+    size_t references_count;
+    size_t references_capacity;
+} verifier;
+
+static void vreject(int32_t offset, const char* fmt, va_list args) {
+    char message[256];
+    vsnprintf(message, sizeof(message), fmt, args);
+    failure("ERROR: invalid bytecode at 0x%.8x: %s.\n", offset, message);
+}
+
+static void reject(verifier* v, const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vreject(v->insn_offset, fmt, args);
+    va_end(args);
+}
+
+static void* grow(void* array, size_t* capacity, size_t element_size) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    array = realloc(array, *capacity * element_size);
+    if (!array) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    return array;
+}
+
+static uint8_t read_byte(verifier* v) {
+    if (v->ip >= v->code_end) {
+        reject(v, "truncated instruction");
+    }
+    return *v->ip++;
+}
+
+static int32_t read_int(verifier* v) {
+    int32_t value;
+    if (v->code_end - v->ip < (ptrdiff_t)sizeof(int32_t)) {
+        reject(v, "truncated instruction");
+    }
+    memcpy(&value, v->ip, sizeof(int32_t));
+    v->ip += sizeof(int32_t);
+    return value;
+}
+
+static int32_t read_count(verifier* v, const char* what) {
+    int32_t value = read_int(v);
+    if (value < 0) {
+        reject(v, "negative %s %d", what, value);
+    }
+    return value;
+}
+
+static const char* read_string(verifier* v) {
+    int32_t pos = read_int(v);
+    if (pos < 0 || (uint32_t)pos >= v->bf->string_table_size) {
+        reject(v, "string pool offset %d is out of range", pos);
+    }
+    return &v->bf->string_ptr[pos];
+}
+
+static void read_extern(verifier* v) {
+    const char* name = read_string(v);
+    const extern_function* f = resolve_extern(name);
+    if (!f) {
+        reject(v, "unknown runtime function %s", name);
+    }
+    int32_t n_args = read_count(v, "arguments number");
+    if (f->kind != EXTERN_CALL && n_args != f->n_args) {
+        reject(v, "%s takes %d arguments, not %d", name, f->n_args, n_args);
+    }
+    if (n_args > MAX_EXTERN_ARGS) {
+        reject(v, "%d arguments passed to %s, at most %d are supported", n_args, name, MAX_EXTERN_ARGS);
+    }
+}
+
+static void add_reference(verifier* v, int32_t target, int32_t kind, int32_t n_args) {
+    if (v->references_count == v->references_capacity) {
+        v->references = grow(v->references, &v->references_capacity, sizeof(code_reference));
+    }
+    v->references[v->references_count++] =
+        (code_reference){.site = v->insn_offset,
+                         .target = target,
+                         .kind = kind,
+                         .n_args = n_args,
+                         .function = (int32_t)v->functions_count - 1};
+}
+
+static void enter_function(verifier* v, bool is_closure) {
+    int32_t n_args = read_count(v, "arguments number");
+    int32_t n_locals = read_count(v, "locals number");
+
+    if (v->functions_count == v->functions_capacity) {
+        v->functions = grow(v->functions, &v->functions_capacity, sizeof(function_info));
+    }
+    v->current_function = &v->functions[v->functions_count++];
+    *v->current_function = (function_info){
+        .offset = v->insn_offset, .n_args = n_args, .is_closure = is_closure, .max_captured_idx = -1};
+    v->current_locals = n_locals;
+}
+
+static void check_location(verifier* v, uint8_t location, int32_t idx) {
+    if (idx < 0) {
+        reject(v, "negative variable index %d", idx);
+    }
+    if (location == LOCATION_GLOBAL) {
+        if ((uint32_t)idx >= v->bf->global_area_size) {
+            reject(v, "global %d is out of the global area", idx);
+        }
+        return;
+    }
+
+    function_info* f = v->current_function;
+    if (!f) {
+        reject(v, "access to a frame variable outside of any function");
+    }
+    switch (location) {
+        case LOCATION_LOCAL:
+            if (idx >= v->current_locals) {
+                reject(v, "local %d is out of %d locals", idx, v->current_locals);
+            }
+            break;
+        case LOCATION_ARGUMENT:
+            if (idx >= f->n_args) {
+                reject(v, "argument %d is out of %d arguments", idx, f->n_args);
+            }
+            break;
+        case LOCATION_CLOSURE:
+            if (!f->is_closure) {
+                reject(v, "captured value %d is accessed outside of a closure", idx);
+            }
+            if (idx > f->max_captured_idx) {
+                f->max_captured_idx = idx;
+            }
+            break;
+        default:
+            reject(v, "unknown location %d", location);
+    }
+}
+
+static void check_closure(verifier* v) {
+    int32_t target = read_int(v);
+    int32_t n_captured = read_count(v, "captured values number");
+
+    add_reference(v, target, CLOSURE_TARGET, n_captured);
+    for (int32_t i = 0; i < n_captured; i++) {
+        uint8_t location = read_byte(v);
+        check_location(v, location, read_int(v));
+    }
+}
+
+// Checks a single instruction starting at v->ip and moves v->ip past it.
+// Returns false when the STOP marker is reached.
+static bool check_instruction(verifier* v) {
+    uint8_t opcode = read_byte(v);
+    uint8_t high = OPCODE_HIGH(opcode);
+    uint8_t low = OPCODE_LOW(opcode);
+
+    if (v->insn_offset == 0 && !(high == H5_OPS && (low == BEGIN || low == CBEGIN))) {
+        reject(v, "the code does not start with a function entry");
+    }
+    if (opcode == STOP_OPCODE) {
+        return false;
+    }
+
+    switch (high) {
+        case BINOP:
+            if (low < PLUS + 1 || low > OR + 1) {
+                reject(v, "unknown binary operator %d", low);
+            }
+            break;
+
+        case H1_OPS:
+            switch (low) {
+                case CONST:
+                    read_int(v);
+                    break;
+                case BSTRING:
+                    read_string(v);
+                    break;
+                case BSEXP:
+                    read_string(v);
+                    read_count(v, "s-expression size");
+                    break;
+                case JMP:
+                    add_reference(v, read_int(v), JUMP_TARGET, 0);
+                    break;
+                case STI:
+                case STA:
+                case END:
+                case RET:
+                case DROP:
+                case DUP:
+                case SWAP:
+                case ELEM:
+                    break;
+                default:
+                    reject(v, "invalid opcode %d-%d", high, low);
+            }
+            break;
+
+        case LD:
+        case LDA:
+        case ST:
+            check_location(v, low, read_int(v));
+            break;
+
+        case H5_OPS:
+            switch (low) {
+                case CJMPZ:
+                case CJMPNZ:
+                    add_reference(v, read_int(v), JUMP_TARGET, 0);
+                    break;
+                case BEGIN:
+                    enter_function(v, false);
+                    break;
+                case CBEGIN:
+                    enter_function(v, true);
+                    break;
+                case BCLOSURE:
+                    check_closure(v);
+                    break;
+                case CALLC:
+                    read_count(v, "arguments number");
+                    break;
+                case CALL: {
+                    int32_t target = read_int(v);
+                    add_reference(v, target, CALL_TARGET, read_count(v, "arguments number"));
+                    break;
+                }
+                case TAG:
+                    read_string(v);
+                    read_count(v, "s-expression size");
+                    break;
+                case ARRAY_KEY:
+                    read_count(v, "array size");
+                    break;
+                case FAIL:
+                    read_int(v);
+                    read_int(v);
+                    break;
+                case LINE:
+                    read_int(v);
+                    break;
+                default:
+                    reject(v, "invalid opcode %d-%d", high, low);
+            }
+            break;
+
+        case PATT:
+            if (low > closure_type) {
+                reject(v, "unknown pattern %d", low);
+            }
+            break;
+
+        case HI_BUILTIN:
+            switch (low) {
+                case BUILTIN_READ:
+                case BUILTIN_WRITE:
+                case BUILTIN_LENGTH:
+                case BUILTIN_STRING:
+                    break;
+                case BUILTIN_ARRAY:
+                    read_count(v, "array size");
+                    break;
+                case BUILTIN_EXTERN:
+                    read_extern(v);
+                    break;
+                default:
+                    reject(v, "invalid opcode %d-%d", high, low);
+            }
+            break;
+
+        default:
+            reject(v, "invalid opcode %d-%d", high, low);
+    }
+    return true;
+}
+
+static function_info* find_function(verifier* v, int32_t offset) {
+    size_t lo = 0, hi = v->functions_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v->functions[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < v->functions_count && v->functions[lo].offset == offset) {
+        return &v->functions[lo];
+    }
+    return NULL;
+}
+
+static bool is_instruction_start(verifier* v, int32_t offset) {
+    return offset >= 0 && offset < v->code_end - v->bf->code_ptr && v->insn_starts[offset];
+}
+
+static void check_references(verifier* v) {
+    for (size_t i = 0; i < v->references_count; i++) {
+        code_reference* r = &v->references[i];
+        v->insn_offset = r->site;
+        if (!is_instruction_start(v, r->target)) {
+            reject(v, "target 0x%.8x is not an instruction boundary", r->target);
+        }
+        if (r->kind == JUMP_TARGET) {
+            // a function spans the code up to the next BEGIN/CBEGIN
+            int32_t begin = v->functions[r->function].offset;
+            int32_t end = (size_t)r->function + 1 < v->functions_count ? v->functions[r->function + 1].offset
+                                                                        : v->code_end - v->bf->code_ptr;
+            if (r->target < begin || r->target >= end) {
+                reject(v, "jump target 0x%.8x is outside of the function at 0x%.8x", r->target, begin);
+            }
+            continue;
+        }
+
+        function_info* f = find_function(v, r->target);
+        if (!f) {
+            reject(v, "target 0x%.8x is not a function entry", r->target);
+        }
+        if (r->kind == CALL_TARGET && f->n_args != r->n_args) {
+            reject(v, "call with %d arguments of a function expecting %d", r->n_args, f->n_args);
+        }
+        if (r->kind == CALL_TARGET && f->max_captured_idx >= 0) {
+            reject(v, "direct call of a function accessing captured values");
+        }
+        if (r->kind == CLOSURE_TARGET && f->max_captured_idx >= r->n_args) {
+            reject(v,
+                   "closure with %d captured values of a function accessing captured value %d",
+                   r->n_args,
+                   f->max_captured_idx);
+        }
+    }
+}
+
+// Section sizes are already checked against the file by the loader
+static void check_header(verifier* v) {
+    const bytefile* bf = v->bf;
+
+    v->insn_offset = 0;
+    if (bf->string_table_size > 0 && bf->string_ptr[bf->string_table_size - 1] != '\0') {
+        reject(v, "string pool is not null-terminated");
+    }
+}
+
+static void check_public_symbols(verifier* v) {
+    for (unsigned int i = 0; i < v->bf->public_symbols_number; i++) {
+        int32_t name = v->bf->public_ptr[2 * i];
+        int32_t offset = v->bf->public_ptr[2 * i + 1];
+        if (name < 0 || (uint32_t)name >= v->bf->string_table_size) {
+            reject(v, "public symbol %u has an invalid name", i);
+        }
+        if (!is_instruction_start(v, offset)) {
+            reject(v, "public symbol %s does not point to an instruction", &v->bf->string_ptr[name]);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Stack depths
+
+// What a stack slot holds: a reference made by LDA, which STA pops along with the
+// value alone, or any other value
+enum { SLOT_VALUE, SLOT_REFERENCE };
+
+typedef struct {
+    const program* p;
+    // non-zero at function entries and jump targets
+    uint8_t* leaders;
+    // per leader: the depth of the stack on entry (-1 until a path reaches it),
+    // the kinds of its slots and whether it waits in the worklist
+    int32_t* depth;
+    uint8_t** kinds;
+    uint8_t* queued;
+    // the kinds of the slots of the block being simulated
+    uint8_t* stack;
+    size_t* worklist;
+    size_t pending;
+} depth_verifier;
+
+static void reject_at(const depth_verifier* d, size_t i, const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vreject(d->p->offsets[i], fmt, args);
+    va_end(args);
+}
+
+static void* allocate(size_t size) {
+    void* p = calloc(size, 1);
+    if (!p) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+    return p;
+}
+
+// Enters the block at `i` with the stack of the block being simulated: the first
+// path to reach it sets its depth, the others must agree on it. A slot holds a
+// reference on entry only if it does on every path, so the block is simulated
+// again when a path takes one away.
+static void enter_block(depth_verifier* d, size_t i, int32_t depth) {
+    bool changed = false;
+    if (d->depth[i] < 0) {
+        d->depth[i] = depth;
+        d->kinds[i] = allocate(depth + 1);
+        memcpy(d->kinds[i], d->stack, depth);
+        changed = true;
+    } else if (d->depth[i] != depth) {
+        reject_at(d, i, "the stack holds %d values on one path here and %d on another", d->depth[i], depth);
+    } else {
+        for (int32_t k = 0; k < depth; k++) {
+            if (d->kinds[i][k] == SLOT_REFERENCE && d->stack[k] != SLOT_REFERENCE) {
+                d->kinds[i][k] = SLOT_VALUE;
+                changed = true;
+            }
+        }
+    }
+    if (changed && !d->queued[i]) {
+        d->queued[i] = 1;
+        d->worklist[d->pending++] = i;
+    }
+}
+
+static void simulate_block(depth_verifier* d, size_t start, size_t end) {
+    const instruction* code = d->p->code;
+    int32_t depth = d->depth[start];
+    memcpy(d->stack, d->kinds[start], depth);
+
+    for (size_t i = start; i < end; i += instruction_width(&code[i])) {
+        if (i != start && d->leaders[i]) {
+            enter_block(d, i, depth);
+            return;
+        }
+        const instruction* insn = &code[i];
+        int32_t pops, pushes;
+        stack_effect(insn, depth >= 2 && d->stack[depth - 2] == SLOT_REFERENCE, &pops, &pushes);
+        // DUP and ST_* read the topmost value without popping it
+        int32_t group = insn->opcode - OP_ST_GLOBAL;
+        int32_t reads = insn->opcode == OP_DUP || (group >= 0 && group <= LOCATION_CLOSURE) ? 1 : pops;
+        if (reads > depth) {
+            reject_at(d, i, "%s needs %d values on a stack of %d", opcode_name(insn->opcode), reads, depth);
+        }
+
+        if (insn->opcode == OP_DUP) {
+            d->stack[depth] = d->stack[depth - 1];
+            depth++;
+        } else if (insn->opcode == OP_SWAP) {
+            uint8_t top = d->stack[depth - 1];
+            d->stack[depth - 1] = d->stack[depth - 2];
+            d->stack[depth - 2] = top;
+        } else {
+            depth -= pops;
+            for (int32_t k = 0; k < pushes; k++) {
+                bool reference = insn->opcode >= OP_LDA_GLOBAL && insn->opcode <= OP_LDA_CLOSURE;
+                d->stack[depth++] = reference ? SLOT_REFERENCE : SLOT_VALUE;
+            }
+        }
+
+        switch (insn->opcode) {
+            case OP_JMP:
+                enter_block(d, insn->a.target - code, depth);
+                return;
+            case OP_CJMPZ:
+            case OP_CJMPNZ:
+                enter_block(d, insn->a.target - code, depth);
+                break;
+            case OP_END:
+            case OP_RET:
+            case OP_FAIL:
+            case OP_STOP:
+                return;
+        }
+    }
+    reject_at(d, start, "the code runs past the end of its function");
+}
+
+void verify_stack_depths(const program* p) {
+    depth_verifier d = {
+        .p = p,
+        .leaders = allocate(p->length + 1),
+        .depth = allocate(p->length * sizeof(int32_t)),
+        .kinds = allocate(p->length * sizeof(uint8_t*)),
+        .queued = allocate(p->length),
+        .stack = allocate(p->length + 1),
+        .worklist = allocate(p->length * sizeof(size_t)),
+    };
+    for (size_t i = 0; i < p->length; i += instruction_width(&p->code[i])) {
+        const instruction* insn = &p->code[i];
+        d.depth[i] = -1;
+        if (insn->opcode == OP_BEGIN || insn->opcode == OP_CBEGIN) {
+            d.leaders[i] = 1;
+        } else if (insn->opcode == OP_JMP || insn->opcode == OP_CJMPZ || insn->opcode == OP_CJMPNZ) {
+            d.leaders[insn->a.target - p->code] = 1;
+        }
+    }
+
+    // every function is entered with an empty stack of its own
+    for (size_t begin = 0; begin < p->length;) {
+        size_t end = begin + 1;
+        while (end < p->length && p->code[end].opcode != OP_BEGIN && p->code[end].opcode != OP_CBEGIN) {
+            end += instruction_width(&p->code[end]);
+        }
+        enter_block(&d, begin, 0);
+        while (d.pending > 0) {
+            size_t start = d.worklist[--d.pending];
+            d.queued[start] = 0;
+            simulate_block(&d, start, end);
+        }
+        begin = end;
+    }
+
+    for (size_t i = 0; i < p->length; i++) {
+        free(d.kinds[i]);
+    }
+    free(d.leaders);
+    free(d.depth);
+    free(d.kinds);
+    free(d.queued);
+    free(d.stack);
+    free(d.worklist);
+}
+
+void verify_bytefile(const bytefile* bf) {
+    verifier v = {.bf = bf, .code_end = bf->code_end, .ip = bf->code_ptr};
+
+    check_header(&v);
+    v.insn_starts = calloc(bf->code_end - bf->code_ptr + 1, 1);
+    if (!v.insn_starts) {
+        failure("ERROR: unable to allocate memory.\n");
+    }
+
+    do {
+        v.insn_offset = v.ip - bf->code_ptr;
+        v.insn_starts[v.insn_offset] = 1;
+    } while (check_instruction(&v));
+
+    check_references(&v);
+    check_public_symbols(&v);
+
+    free(v.insn_starts);
+    free(v.functions);
+    free(v.references);
+}
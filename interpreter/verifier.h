@@ -0,0 +1,35 @@
+#ifndef __LAMA_VERIFIER__
+#define __LAMA_VERIFIER__
+
+#include <stdint.h>
+
+#include "decoder.h"
+#include "interpreter.h"
+
+// Checks the whole bytecode image once, right after it has been loaded:
+//  - the string pool is null-terminated (the loader has already checked that the
+//    public symbols table and the string pool fit in the file);
+//  - the code starts with a BEGIN/CBEGIN, every instruction is well-formed and
+//    lies inside the code area;
+//  - every jump lands on an instruction boundary of the function it is part of
+//    (up to the next BEGIN/CBEGIN), every CALL and CLOSURE refers to a
+//    BEGIN/CBEGIN with a matching arity, functions accessing captured values
+//    are only entered through closures;
+//  - every local/argument/global/closure index fits the enclosing function,
+//    the global area or the captured values of every closure built for it;
+//  - every string operand points into the string pool, every CALL_EXTERN names
+//    a function of the foreign call table (see externs.h).
+// Fails with a diagnostic on the first violation, so the interpreter is allowed
+// to run the image without per-instruction checks.
+void verify_bytefile(const bytefile* bf);
+
+// Checks the decoded form of a verified image, before any other pass: the stack
+// of every function starts empty at its BEGIN/CBEGIN and holds the same number
+// of values on every path to an instruction, no instruction takes more values
+// than there are, and no path runs past the end of its function. STA pops the
+// value and a reference made by LDA, or the value, an index and an aggregate;
+// it counts as the latter unless every path gives it a reference. The operand
+// stack pops need no checks afterwards.
+void verify_stack_depths(const program* p);
+
+#endif
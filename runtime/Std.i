@@ -60,3 +60,6 @@ F,flatCompare;
 F,tagHash;
 F,uppercase;
 F,lowercase;
+F,spawn;
+F,yield;
+F,join;
@@ -6,7 +6,10 @@
 
 #include <assert.h>
 #include <execinfo.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,27 +19,50 @@
 
 static const size_t INIT_HEAP_SIZE = MINIMUM_HEAP_CAPACITY;
 
+// Every thread has a heap and roots of its own, so that a host can run a
+// program on each of its threads
 #ifdef DEBUG_VERSION
-size_t cur_id = 0;
+_Thread_local size_t cur_id = 0;
 #endif
 
-static extra_roots_pool extra_roots;
+static _Thread_local extra_roots_pool extra_roots;
 
-size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
+_Thread_local size_t __gc_stack_top = 0, __gc_stack_bottom = 0;
+_Thread_local void (*__gc_extra_stacks) (stack_visitor visit, void *context) = NULL;
 #ifdef LAMA_ENV
 extern const size_t __start_custom_data, __stop_custom_data;
 #endif
 
 #ifdef DEBUG_VERSION
-memory_chunk heap;
+_Thread_local memory_chunk heap;
 #else
-static memory_chunk heap;
+static _Thread_local memory_chunk heap;
 #endif
 
 #ifdef DEBUG_VERSION
 void dump_heap ();
 #endif
 
+// the number of words of the nursery, 0 while the collections are not
+// generational (see gc.h)
+static size_t nursery_size = 0;
+
+_Thread_local size_t *__gc_young_begin = (size_t *)UINTPTR_MAX;
+
+// the remembered set: the fields of old objects assigned pointers to young ones
+// since the last collection, a field may be there more than once
+static _Thread_local size_t **remembered;
+static _Thread_local size_t   remembered_count, remembered_capacity;
+
+// the objects from `begin` on are young in the generational mode, none otherwise
+static size_t *young_objects_from (size_t *begin) {
+  return nursery_size ? begin : (size_t *)UINTPTR_MAX;
+}
+
+static inline bool is_young (const size_t *p) {
+  return !UNBOXED(p) && __gc_young_begin <= p && p < heap.current;
+}
+
 void handler (int sig) {
   void *array[10];
   int   size;
@@ -172,17 +198,34 @@ int files_cmp (FILE *f1, FILE *f2) {
 
 #endif
 
+// takes the given number of words at the top of the heap, which has room for them
+static void *bump_alloc (size_t size) {
+  void *p = (void *)heap.current;
+  heap.current += size;
+  memset(p, 0, size * sizeof(size_t));
+  return p;
+}
+
 void *gc_alloc_on_existing_heap (size_t size) {
-  if (heap.current + size <= heap.end) {
-    void *p = (void *)heap.current;
-    heap.current += size;
-    memset(p, 0, size * sizeof(size_t));
-    return p;
-  }
+  // a full nursery is collected before the heap is
+  size_t *limit = heap.end;
+  if (nursery_size && __gc_young_begin + nursery_size < limit) { limit = __gc_young_begin + nursery_size; }
+  if (heap.current + size <= limit) { return bump_alloc(size); }
   return NULL;
 }
 
 void *gc_alloc (size_t size) {
+  if (nursery_size) {
+    minor_phase();
+    // the old space grows until it leaves no room for a nursery; an object
+    // larger than the nursery is young all the same
+    if (heap.current + MAX(size, nursery_size) <= heap.end) { return bump_alloc(size); }
+  }
+  gc_full_collection(size + nursery_size);
+  return bump_alloc(size);
+}
+
+void gc_full_collection (size_t additional_size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has started\n");
 #endif
@@ -196,7 +239,10 @@ void *gc_alloc (size_t size) {
   FILE *heap_before_compaction = print_objects_traversal("after-mark", 1);
 #endif
 
-  compact_phase(size);
+  compact_phase(additional_size);
+  // the survivors are old, and so are the remembered fields
+  __gc_young_begin = young_objects_from(heap.current);
+  remembered_count = 0;
 #ifdef FULL_INVARIANT_CHECKS
   FILE *stack_after           = print_stack_content("stack-dump-after-compaction");
   FILE *heap_after_compaction = print_objects_traversal("after-compaction", 0);
@@ -219,16 +265,227 @@ void *gc_alloc (size_t size) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "===============================GC cycle has finished\n");
 #endif
-  return gc_alloc_on_existing_heap(size);
+}
+
+static void gc_root_scan_region (void *context, size_t *begin, size_t *end) {
+  for (size_t *p = begin; p < end; ++p) { gc_test_and_mark_root((size_t **)p); }
 }
 
 static void gc_root_scan_stack () {
-  for (size_t *p = (size_t *)(__gc_stack_top + 4); p < (size_t *)__gc_stack_bottom; ++p) {
-    gc_test_and_mark_root((size_t **)p);
+  gc_root_scan_region(NULL, (size_t *)(__gc_stack_top + 4), (size_t *)__gc_stack_bottom);
+  if (__gc_extra_stacks) { __gc_extra_stacks(gc_root_scan_region, NULL); }
+}
+
+// ============================================================================
+// Parallel marking: the roots are split into chunks of words, which the marking
+// threads take in turn. A thread marks the objects its chunks point to and the
+// ones they point to in turn, setting mark bits with an atomic or, so that every
+// object is traversed once, by the thread which has marked it. The objects yet
+// to traverse are on the mark stack of the thread; while another thread is
+// idle, it shares the oldest ones (the roots of the largest parts of the graph
+// left), which the idle threads steal half at a time.
+
+#define ROOT_CHUNK_WORDS 1024
+#define SHARED_MARK_CAPACITY 256
+
+static size_t mark_threads = 1;
+
+typedef struct {
+  size_t *begin;
+  size_t *end;
+} root_range;
+
+struct parallel_marking;
+
+typedef struct {
+  struct parallel_marking *marking;
+  pthread_t                thread;
+  // the objects to traverse are stack[bottom, top)
+  void                   **stack;
+  size_t                   bottom, top, capacity;
+  // the objects shared with the other threads, under `lock`
+  void                    *shared[SHARED_MARK_CAPACITY];
+  size_t                   shared_count;
+  int                      lock;
+} mark_worker;
+
+// the state of a collection shared by its marking threads, which cannot read
+// the thread-local heap
+typedef struct parallel_marking {
+  size_t      *heap_begin, *heap_current;
+  root_range  *roots;
+  size_t       roots_count, roots_capacity;
+  size_t       next_root;
+  mark_worker *workers;
+  size_t       workers_count;
+  size_t       idle;
+} parallel_marking;
+
+void __gc_set_mark_threads (size_t threads) { mark_threads = MAX(threads, 1); }
+
+static void add_root_range (void *context, size_t *begin, size_t *end) {
+  parallel_marking *m = context;
+  for (; begin < end; begin += ROOT_CHUNK_WORDS) {
+    if (m->roots_count == m->roots_capacity) {
+      m->roots_capacity = MAX(2 * m->roots_capacity, 64);
+      m->roots          = realloc(m->roots, m->roots_capacity * sizeof(root_range));
+      if (!m->roots) {
+        perror("ERROR: add_root_range: realloc failed\n");
+        exit(1);
+      }
+    }
+    m->roots[m->roots_count++] = (root_range){begin, MIN(begin + ROOT_CHUNK_WORDS, end)};
+  }
+}
+
+static void push_marked (mark_worker *w, void *obj) {
+  if (w->top == w->capacity) {
+    if (w->bottom > 0 && 2 * w->bottom >= w->capacity) {
+      memmove(w->stack, w->stack + w->bottom, (w->top - w->bottom) * sizeof(void *));
+      w->top -= w->bottom;
+      w->bottom = 0;
+    } else {
+      w->capacity = MAX(2 * w->capacity, 1024);
+      w->stack    = realloc(w->stack, w->capacity * sizeof(void *));
+      if (!w->stack) {
+        perror("ERROR: push_marked: realloc failed\n");
+        exit(1);
+      }
+    }
+  }
+  w->stack[w->top++] = obj;
+}
+
+static inline void mark_concurrently (mark_worker *w, void *obj) {
+  parallel_marking *m = w->marking;
+  if (UNBOXED(obj) || (size_t *)obj < m->heap_begin || (size_t *)obj > m->heap_current) { return; }
+  if (__atomic_fetch_or(&TO_DATA(obj)->forward_address, 1, __ATOMIC_RELAXED) & 1) { return; }
+  push_marked(w, obj);
+}
+
+static void lock_worker (mark_worker *w) {
+  while (__atomic_exchange_n(&w->lock, 1, __ATOMIC_ACQUIRE)) {
+    while (__atomic_load_n(&w->lock, __ATOMIC_RELAXED)) { }
+  }
+}
+
+static void unlock_worker (mark_worker *w) { __atomic_store_n(&w->lock, 0, __ATOMIC_RELEASE); }
+
+// moves up to the oldest half of the mark stack to the shared objects, if those
+// are gone
+static void share_marked (mark_worker *w) {
+  lock_worker(w);
+  if (w->shared_count == 0) {
+    size_t n = MIN((w->top - w->bottom) / 2, SHARED_MARK_CAPACITY);
+    memcpy(w->shared, w->stack + w->bottom, n * sizeof(void *));
+    w->bottom += n;
+    __atomic_store_n(&w->shared_count, n, __ATOMIC_RELAXED);
+  }
+  unlock_worker(w);
+}
+
+// takes half of the objects `victim` shares, all of them if it is the caller
+static bool steal_marked (mark_worker *w, mark_worker *victim) {
+  if (__atomic_load_n(&victim->shared_count, __ATOMIC_RELAXED) == 0) { return false; }
+  lock_worker(victim);
+  size_t n = victim == w ? victim->shared_count : victim->shared_count - victim->shared_count / 2;
+  __atomic_store_n(&victim->shared_count, victim->shared_count - n, __ATOMIC_RELAXED);
+  for (size_t i = 0; i < n; i++) { push_marked(w, victim->shared[victim->shared_count + i]); }
+  unlock_worker(victim);
+  return n > 0;
+}
+
+static bool steal_any_marked (mark_worker *w) {
+  parallel_marking *m     = w->marking;
+  size_t            index = w - m->workers;
+  for (size_t i = 0; i < m->workers_count; i++) {
+    if (steal_marked(w, &m->workers[(index + i) % m->workers_count])) { return true; }
+  }
+  return false;
+}
+
+static bool anything_shared (parallel_marking *m) {
+  for (size_t i = 0; i < m->workers_count; i++) {
+    if (__atomic_load_n(&m->workers[i].shared_count, __ATOMIC_RELAXED)) { return true; }
+  }
+  return false;
+}
+
+static void traverse_marked (mark_worker *w) {
+  parallel_marking *m = w->marking;
+  while (w->top > w->bottom) {
+    if (w->top - w->bottom > 1 && __atomic_load_n(&m->idle, __ATOMIC_RELAXED)
+        && __atomic_load_n(&w->shared_count, __ATOMIC_RELAXED) == 0) {
+      share_marked(w);
+    }
+    void *header_ptr = get_obj_header_ptr(w->stack[--w->top]);
+    for (obj_field_iterator field = ptr_field_begin_iterator(header_ptr); !field_is_done_iterator(&field);
+         obj_next_ptr_field_iterator(&field)) {
+      mark_concurrently(w, *(void **)field.cur_field);
+    }
+  }
+  w->bottom = w->top = 0;
+}
+
+static void *run_mark_worker (void *worker) {
+  mark_worker      *w = worker;
+  parallel_marking *m = w->marking;
+  size_t            i;
+  while ((i = __atomic_fetch_add(&m->next_root, 1, __ATOMIC_RELAXED)) < m->roots_count) {
+    for (size_t *p = m->roots[i].begin; p < m->roots[i].end; ++p) { mark_concurrently(w, (void *)*p); }
+    traverse_marked(w);
+  }
+  // a thread only shares objects while it is busy, so once all of them are
+  // idle there is nothing left to mark
+  for (;;) {
+    traverse_marked(w);
+    if (steal_any_marked(w)) { continue; }
+    __atomic_fetch_add(&m->idle, 1, __ATOMIC_ACQ_REL);
+    while (!anything_shared(m)) {
+      if (__atomic_load_n(&m->idle, __ATOMIC_ACQUIRE) == m->workers_count) { return NULL; }
+      sched_yield();
+    }
+    __atomic_fetch_sub(&m->idle, 1, __ATOMIC_ACQ_REL);
+  }
+}
+
+static void parallel_mark_phase (void) {
+  parallel_marking m = {
+      .heap_begin = heap.begin, .heap_current = heap.current, .workers_count = mark_threads};
+  add_root_range(&m, (size_t *)(__gc_stack_top + 4), (size_t *)__gc_stack_bottom);
+  if (__gc_extra_stacks) { __gc_extra_stacks(add_root_range, &m); }
+  for (int i = 0; i < extra_roots.current_free; i++) {
+    add_root_range(&m, (size_t *)extra_roots.roots[i], (size_t *)extra_roots.roots[i] + 1);
+  }
+#ifdef LAMA_ENV
+  add_root_range(&m, (size_t *)&__start_custom_data, (size_t *)&__stop_custom_data);
+#endif
+
+  m.workers = calloc(m.workers_count, sizeof(mark_worker));
+  if (!m.workers) {
+    perror("ERROR: parallel_mark_phase: calloc failed\n");
+    exit(1);
   }
+  for (size_t i = 0; i < m.workers_count; i++) { m.workers[i].marking = &m; }
+  for (size_t i = 1; i < m.workers_count; i++) {
+    if (pthread_create(&m.workers[i].thread, NULL, run_mark_worker, &m.workers[i]) != 0) {
+      perror("ERROR: parallel_mark_phase: pthread_create failed\n");
+      exit(1);
+    }
+  }
+  run_mark_worker(&m.workers[0]);
+  for (size_t i = 1; i < m.workers_count; i++) { pthread_join(m.workers[i].thread, NULL); }
+
+  for (size_t i = 0; i < m.workers_count; i++) { free(m.workers[i].stack); }
+  free(m.workers);
+  free(m.roots);
 }
 
 void mark_phase (void) {
+  if (mark_threads > 1 && (size_t)(heap.current - heap.begin) >= PARALLEL_MARK_MIN_HEAP) {
+    parallel_mark_phase();
+    return;
+  }
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "marking has started\n");
   fprintf(stderr,
@@ -398,6 +655,10 @@ void scan_and_fix_region_roots (memory_chunk *old_heap) {
 #endif
 }
 
+static void fix_stack_region (void *old_heap, size_t *begin, size_t *end) {
+  scan_and_fix_region((memory_chunk *)old_heap, begin, end);
+}
+
 void update_references (memory_chunk *old_heap) {
 #if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
   fprintf(stderr, "GC update_references started\n");
@@ -439,6 +700,7 @@ void update_references (memory_chunk *old_heap) {
   }
   // fix pointers from stack
   scan_and_fix_region(old_heap, (void *)__gc_stack_top + 4, (void *)__gc_stack_bottom + 4);
+  if (__gc_extra_stacks) { __gc_extra_stacks(fix_stack_region, old_heap); }
 
   // fix pointers from extra_roots
   scan_and_fix_region_roots(old_heap);
@@ -499,12 +761,19 @@ static inline void *queue_dequeue (heap_iterator *head_iter) {
   return value;
 }
 
-void mark (void *obj) {
-  if (!is_valid_heap_pointer(obj) || is_marked(obj)) { return; }
+// a pointer to an object of the heap from `space` on
+static inline bool is_in_space (const size_t *p, const size_t *space) {
+  return !UNBOXED(p) && (size_t)space <= (size_t)p && (size_t)p <= (size_t)heap.current;
+}
+
+// marks the objects reachable from `obj` among the ones from `space` on, the
+// others are neither marked nor traversed
+static void mark_space (void *obj, size_t *space) {
+  if (!is_in_space(obj, space) || is_marked(obj)) { return; }
 
   // TL;DR: [q_head_iter, q_tail_iter) q_head_iter -- current dequeue's victim, q_tail_iter -- place for next enqueue
   // in forward_address of corresponding element we store address of element to be removed after dequeue operation
-  heap_iterator q_head_iter = heap_begin_iterator();
+  heap_iterator q_head_iter = {.current = space};
   // iterator where we will write address of the element that is going to be enqueued
   heap_iterator q_tail_iter = q_head_iter;
   queue_enqueue(&q_tail_iter, obj);
@@ -520,8 +789,7 @@ void mark (void *obj) {
          !field_is_done_iterator(&ptr_field_it);
          obj_next_ptr_field_iterator(&ptr_field_it)) {
       void *field_value = *(void **)ptr_field_it.cur_field;
-      if (!is_valid_heap_pointer(field_value) || is_marked(field_value)
-          || is_enqueued(field_value)) {
+      if (!is_in_space(field_value, space) || is_marked(field_value) || is_enqueued(field_value)) {
         continue;
       }
       // if we came to this point it must be true that field_value is unmarked and not currently in queue
@@ -531,6 +799,8 @@ void mark (void *obj) {
   }
 }
 
+void mark (void *obj) { mark_space(obj, heap.begin); }
+
 void scan_extra_roots (void) {
   for (int i = 0; i < extra_roots.current_free; ++i) {
     // this dereferencing is safe since runtime is pushing correct pointers into extra_roots
@@ -559,13 +829,147 @@ extern void gc_test_and_mark_root (size_t **root) {
   mark((void *)*root);
 }
 
+// the extra roots which are neither on the stack nor in the global area, which
+// are scanned anyway
+static bool is_separate_extra_root (void **root) {
+  return !(root >= (void **)__gc_stack_top && root < (void **)__gc_stack_bottom)
+#ifdef LAMA_ENV
+         && !(root <= (void **)&__stop_custom_data && root >= (void **)&__start_custom_data)
+#endif
+      ;
+}
+
+static int compare_slots (const void *x, const void *y) {
+  size_t *a = *(size_t *const *)x, *b = *(size_t *const *)y;
+  return (a > b) - (a < b);
+}
+
+// drops the repeated fields of the remembered set
+static void unique_remembered (void) {
+  qsort(remembered, remembered_count, sizeof(size_t *), compare_slots);
+  size_t n = 0;
+  for (size_t i = 0; i < remembered_count; i++) {
+    if (n == 0 || remembered[n - 1] != remembered[i]) { remembered[n++] = remembered[i]; }
+  }
+  remembered_count = n;
+}
+
+void __gc_remember (void **slot) {
+  // a field of an old object already pointing to a young one is remembered
+  if ((size_t *)slot < heap.begin || is_young(*(size_t **)slot)) { return; }
+  if (remembered_count == remembered_capacity) {
+    unique_remembered();
+    if (2 * remembered_count >= remembered_capacity) {
+      remembered_capacity = MAX(2 * remembered_capacity, 1024);
+      remembered          = realloc(remembered, remembered_capacity * sizeof(size_t *));
+      if (!remembered) {
+        perror("ERROR: __gc_remember: realloc failed\n");
+        exit(1);
+      }
+    }
+  }
+  remembered[remembered_count++] = (size_t *)slot;
+}
+
+void __gc_set_nursery (size_t words) {
+  nursery_size     = words;
+  __gc_young_begin = young_objects_from(heap.current);
+  remembered_count = 0;
+}
+
+// calls `visit` on every root slot of a minor collection once: the roots of a
+// full one and the remembered fields
+static void visit_minor_roots (stack_visitor visit) {
+  visit(NULL, (size_t *)(__gc_stack_top + 4), (size_t *)__gc_stack_bottom);
+  if (__gc_extra_stacks) { __gc_extra_stacks(visit, NULL); }
+  for (int i = 0; i < extra_roots.current_free; i++) {
+    if (is_separate_extra_root(extra_roots.roots[i])) {
+      visit(NULL, (size_t *)extra_roots.roots[i], (size_t *)extra_roots.roots[i] + 1);
+    }
+  }
+#ifdef LAMA_ENV
+  visit(NULL, (size_t *)&__start_custom_data, (size_t *)&__stop_custom_data);
+#endif
+  for (size_t i = 0; i < remembered_count; i++) { visit(NULL, remembered[i], remembered[i] + 1); }
+}
+
+static void mark_young_region (void *context, size_t *begin, size_t *end) {
+  for (size_t *p = begin; p < end; ++p) { mark_space((void *)*p, __gc_young_begin); }
+}
+
+// points the slots to the locations the young objects are going to
+static void fix_young_region (void *context, size_t *begin, size_t *end) {
+  for (size_t *p = begin; p < end; ++p) {
+    if (is_young((size_t *)*p)) {
+      void *obj = (void *)*p;
+      *p        = get_forward_address(obj) + get_header_size(get_type_row_ptr(obj));
+    }
+  }
+}
+
+void minor_phase (void) {
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC minor_phase started\n");
+#endif
+  unique_remembered();
+  visit_minor_roots(mark_young_region);
+
+  // the same passes as compact_phase's, over the young objects only, which
+  // slide down to the end of the old space; the heap stays where it is
+  size_t *free_ptr = __gc_young_begin;
+  for (heap_iterator it = {.current = __gc_young_begin}; !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it)) {
+    void *obj_content = get_object_content_ptr(it.current);
+    if (is_marked(obj_content)) {
+      set_forward_address(obj_content, (size_t)free_ptr);
+      free_ptr += BYTES_TO_WORDS(obj_size_header_ptr(it.current));
+    }
+  }
+
+  for (heap_iterator it = {.current = __gc_young_begin}; !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it)) {
+    if (!is_marked(get_object_content_ptr(it.current))) { continue; }
+    for (obj_field_iterator field = ptr_field_begin_iterator(it.current);
+         !field_is_done_iterator(&field);
+         obj_next_ptr_field_iterator(&field)) {
+      fix_young_region(NULL, (size_t *)field.cur_field, (size_t *)field.cur_field + 1);
+    }
+  }
+  visit_minor_roots(fix_young_region);
+
+  heap_iterator from_iter = {.current = __gc_young_begin};
+  while (!heap_is_done_iterator(&from_iter)) {
+    void         *obj       = get_object_content_ptr(from_iter.current);
+    heap_iterator next_iter = from_iter;
+    heap_next_obj_iterator(&next_iter);
+    if (is_marked(obj)) {
+      size_t *to = (size_t *)get_forward_address(obj);
+      memmove(to, from_iter.current, obj_size_header_ptr(from_iter.current));
+      unmark_object(get_object_content_ptr(to));
+    }
+    from_iter = next_iter;
+  }
+
+  heap.current     = free_ptr;
+  __gc_young_begin = heap.current;
+  remembered_count = 0;
+#if defined(DEBUG_VERSION) && defined(DEBUG_PRINT)
+  fprintf(stderr, "GC minor_phase finished\n");
+#endif
+}
+
 void __gc_init (void) {
   __gc_stack_bottom = (size_t)__builtin_frame_address(1) + 4;
   __init();
 }
 
 void __init (void) {
-  signal(SIGSEGV, handler);
+  // the threads initialized later must not take over the handler of the host,
+  // which may fall back to this one
+  struct sigaction current;
+  if (sigaction(SIGSEGV, NULL, &current) == 0 && current.sa_handler == SIG_DFL) {
+    signal(SIGSEGV, handler);
+  }
   size_t space_size = INIT_HEAP_SIZE * sizeof(size_t);
 
   srandom(time(NULL));
@@ -576,9 +980,11 @@ void __init (void) {
     perror("ERROR: __init: mmap failed\n");
     exit(1);
   }
-  heap.end     = heap.begin + INIT_HEAP_SIZE;
-  heap.size    = INIT_HEAP_SIZE;
-  heap.current = heap.begin;
+  heap.end         = heap.begin + INIT_HEAP_SIZE;
+  heap.size        = INIT_HEAP_SIZE;
+  heap.current     = heap.begin;
+  __gc_young_begin = young_objects_from(heap.begin);
+  remembered_count = 0;
   clear_extra_roots();
 }
 
@@ -593,6 +999,58 @@ extern void __shutdown (void) {
   heap.current      = NULL;
   __gc_stack_top    = 0;
   __gc_stack_bottom = 0;
+  __gc_extra_stacks = NULL;
+  __gc_young_begin  = (size_t *)UINTPTR_MAX;
+  free(remembered);
+  remembered          = NULL;
+  remembered_count    = 0;
+  remembered_capacity = 0;
+}
+
+void __gc_reset (void) {
+#ifdef DEBUG_VERSION
+  cur_id = 0;
+#endif
+  heap.current     = heap.begin;
+  __gc_young_begin = young_objects_from(heap.begin);
+  remembered_count = 0;
+  clear_extra_roots();
+}
+
+void *__gc_objects (size_t *size) {
+  *size = WORDS_TO_BYTES(heap.current - heap.begin);
+  return heap.begin;
+}
+
+void *__gc_restore_objects (const void *objects, size_t size, size_t old_begin) {
+  size_t words = size / sizeof(size_t);
+  if (words > heap.size) {
+    heap.begin = mremap(heap.begin, WORDS_TO_BYTES(heap.size), WORDS_TO_BYTES(words), MREMAP_MAYMOVE);
+    if (heap.begin == MAP_FAILED) {
+      perror("ERROR: __gc_restore_objects: mremap failed\n");
+      exit(1);
+    }
+    heap.size = words;
+    heap.end  = heap.begin + words;
+  }
+  memcpy(heap.begin, objects, size);
+  heap.current = heap.begin + words;
+  // the restored objects are young: none of them has been remembered
+  __gc_young_begin = young_objects_from(heap.begin);
+  remembered_count = 0;
+  clear_extra_roots();
+
+  size_t delta = (size_t)heap.begin - old_begin;
+  for (heap_iterator it = heap_begin_iterator(); !heap_is_done_iterator(&it);
+       heap_next_obj_iterator(&it)) {
+    for (obj_field_iterator field = ptr_field_begin_iterator(it.current);
+         !field_is_done_iterator(&field);
+         obj_next_ptr_field_iterator(&field)) {
+      size_t *value = (size_t *)field.cur_field;
+      if (!UNBOXED(*value) && old_begin <= *value && *value < old_begin + size) { *value += delta; }
+    }
+  }
+  return heap.begin;
 }
 
 void clear_extra_roots (void) { extra_roots.current_free = 0; }
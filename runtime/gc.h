@@ -14,9 +14,13 @@
 // about marking. I would also recommend to pay attention to the fact that
 // marking is implemented without usage of any additional memory. Already
 // allocated space is sufficient (for details see 'void mark (void *obj)').
+// Large heaps may be marked by several threads instead, each with a mark stack
+// of its own (see __gc_set_mark_threads).
 //  - void compact_phase (size_t additional_size): the whole compaction phase
 // can be understood by looking at this piece of code plus couple of other
 // functions used in there. It is basically an implementation of LISP2.
+//  - void minor_phase (void): the collection of the young objects only, in
+// the generational mode (see "Generational collections" below).
 
 #ifndef __LAMA_GC__
 #define __LAMA_GC__
@@ -42,6 +46,13 @@
 #else
 #  define MINIMUM_HEAP_CAPACITY (1 << 2)
 #endif
+// heaps of fewer words are marked by the collecting thread alone, starting the
+// other threads would take longer than marking them
+#ifdef DEBUG_VERSION
+#  define PARALLEL_MARK_MIN_HEAP (0)
+#else
+#  define PARALLEL_MARK_MIN_HEAP (1 << 20)
+#endif
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -72,12 +83,18 @@ typedef struct {
 void *alloc(size_t);
 // takes number of words as a parameter
 void *gc_alloc(size_t);
+// collects the whole heap, whatever the mode, leaving room for the given number
+// of words
+void gc_full_collection(size_t);
 // takes number of words as a parameter
 void *gc_alloc_on_existing_heap(size_t);
 
 // specific for mark-and-compact_phase gc
 void mark (void *obj);
 void mark_phase (void);
+// sets the number of threads marking the heap in a full collection, 1 (the
+// default) to mark it on the collecting thread only
+void __gc_set_mark_threads (size_t threads);
 // marks each pointer from extra roots
 void scan_extra_roots (void);
 #ifdef LAMA_ENV
@@ -90,6 +107,8 @@ void compact_phase (size_t additional_size);
 size_t compute_locations ();
 void   update_references (memory_chunk *);
 void   physically_relocate (memory_chunk *);
+// collects the young objects into the old space
+void minor_phase (void);
 
 
 // ============================================================================
@@ -113,6 +132,42 @@ void push_extra_root (void **p);
 void pop_extra_root (void **p);
 
 
+// ============================================================================
+//                        Generational collections
+// ============================================================================
+// Once a nursery size is set, the heap is split at `__gc_young_begin`: the
+// objects below have survived a collection (the old space), the ones above have
+// been allocated since (the nursery, still bump-allocated at the top of the
+// heap). When the nursery is full, a minor collection marks the young objects
+// reachable from the roots and from the remembered fields of old objects,
+// slides them down to the end of the old space and makes them old; the whole
+// heap is only compacted once the old space leaves no room for a nursery.
+// Old objects are not scanned by a minor collection, so every store to a
+// field of an object that may be old must go through `__gc_write_barrier`
+// before it is done. The objects a runtime function has just allocated are
+// young until its next allocation.
+
+// sets the number of words the young objects may take before a minor
+// collection, 0 (the default) to collect the whole heap every time; the setting
+// is shared by the threads initialized later, the objects the calling thread has
+// allocated so far become old
+void __gc_set_nursery (size_t words);
+
+// the beginning of the young objects of the calling thread, the top of the
+// address space while the collections are not generational
+extern _Thread_local size_t *__gc_young_begin;
+
+// remembers `slot`, about to be assigned a pointer to a young object, if it is
+// a field of an old object
+void __gc_remember (void **slot);
+
+static inline void __gc_write_barrier (void *slot, void *value) {
+  if (!UNBOXED(value) && (size_t *)value >= __gc_young_begin && (size_t *)slot < __gc_young_begin) {
+    __gc_remember((void **)slot);
+  }
+}
+
+
 // ============================================================================
 //                   Implemented in GASM: see gc_runtime.s
 // ============================================================================
@@ -128,6 +183,27 @@ void __init (void);
 // to deallocate all object allocated via GC
 extern void __shutdown (void);
 
+// drops all objects at once, keeping the memory of the heap for the objects to
+// come; the roots must not point to the heap anymore
+void __gc_reset (void);
+
+// the objects allocated so far, as a block of `*size` bytes starting at the
+// returned address
+void *__gc_objects (size_t *size);
+
+// replaces the objects of the heap by a copy of `size` bytes of objects as
+// returned by `__gc_objects` when they started at `old_begin`, relocating the
+// pointers between them; returns where they start now, the roots are left for
+// the caller to relocate
+void *__gc_restore_objects (const void *objects, size_t size, size_t old_begin);
+
+// the stacks holding roots besides the one between __gc_stack_top and
+// __gc_stack_bottom (e.g. the ones of suspended fibers): if set, called by
+// every collection to call `visit (context, begin, end)` for every such range
+// of words; the ranges are scanned as the stack is
+typedef void (*stack_visitor) (void *context, size_t *begin, size_t *end);
+extern _Thread_local void (*__gc_extra_stacks) (stack_visitor visit, void *context);
+
 
 // ============================================================================
 //                    invoked from GASM: see gc_runtime.s
@@ -7,7 +7,7 @@
 #include "gc.h"
 #include "runtime_common.h"
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern _Thread_local size_t __gc_stack_top, __gc_stack_bottom;
 
 #define PRE_GC()                                                                                   \
   bool flag = false;                                                                               \
@@ -18,9 +18,16 @@ extern size_t __gc_stack_top, __gc_stack_bottom;
 #define POST_GC()                                                                                  \
   if (flag) { __gc_stack_top = 0; }
 
+_Thread_local void (*failure_hook) (void) = NULL;
+
+_Thread_local FILE *program_stdin = NULL, *program_stdout = NULL, *program_stderr = NULL;
+
+#define PROGRAM_STREAM(name) (program_##name ? program_##name : name)
+
 static void vfailure (char *s, va_list args) {
-  fprintf(stderr, "*** FAILURE: ");
-  vfprintf(stderr, s, args);   // vprintf (char *, va_list) <-> printf (char *, ...)
+  fprintf(PROGRAM_STREAM(stderr), "*** FAILURE: ");
+  vfprintf(PROGRAM_STREAM(stderr), s, args);   // vprintf (char *, va_list) <-> printf (char *, ...)
+  if (failure_hook) { failure_hook(); }
   exit(255);
 }
 
@@ -240,7 +247,7 @@ extern int LtagHash (char *s) {
 }
 
 char *de_hash (int n) {
-  static char buf[6] = {0, 0, 0, 0, 0, 0};
+  static _Thread_local char buf[6] = {0, 0, 0, 0, 0, 0};
   char       *p      = (char *)BOX(NULL);
   p                  = &buf[5];
 
@@ -260,7 +267,7 @@ typedef struct {
   int   len;
 } StringBuf;
 
-static StringBuf stringBuf;
+static _Thread_local StringBuf stringBuf;
 
 #define STRINGBUF_INIT 128
 
@@ -836,7 +843,7 @@ extern void *Barray (int bn, ...) {
 }
 
 #ifdef DEBUG_VERSION
-extern memory_chunk heap;
+extern _Thread_local memory_chunk heap;
 #endif
 
 extern void *Bsexp (int bn, ...) {
@@ -949,14 +956,17 @@ extern void *Bsta (void *v, int i, void *x) {
         break;
       }
       case SEXP_TAG: {
+        __gc_write_barrier(&((int *)x)[UNBOX(i) + 1], v);
         ((int *)x)[UNBOX(i) + 1] = (int)v;
         break;
       }
       default: {
+        __gc_write_barrier(&((int *)x)[UNBOX(i)], v);
         ((int *)x)[UNBOX(i)] = (int)v;
       }
     }
   } else {
+    __gc_write_barrier(x, v);
     *(void **)x = v;
   }
 
@@ -1089,9 +1099,11 @@ extern void Lprintf (char *s, ...) {
   va_start(args, s);
   fix_unboxed(s, args);
 
-  if (vprintf(s, args) < 0) { failure("fprintf (...): %s\n", strerror(errno)); }
+  if (vfprintf(PROGRAM_STREAM(stdout), s, args) < 0) {
+    failure("fprintf (...): %s\n", strerror(errno));
+  }
 
-  fflush(stdout);
+  fflush(PROGRAM_STREAM(stdout));
 }
 
 extern FILE *Lfopen (char *f, char *m) {
@@ -1116,10 +1128,10 @@ extern void Lfclose (FILE *f) {
 extern void *LreadLine () {
   char *buf;
 
-  if (scanf("%m[^\n]", &buf) == 1) {
+  if (fscanf(PROGRAM_STREAM(stdin), "%m[^\n]", &buf) == 1) {
     void *s = Bstring(buf);
 
-    getchar();
+    fgetc(PROGRAM_STREAM(stdin));
 
     free(buf);
     return s;
@@ -1191,9 +1203,9 @@ extern void *Ltl (void *v) { return Belem(v, BOX(1)); }
 extern int Lread () {
   int result = BOX(0);
 
-  printf("> ");
-  fflush(stdout);
-  scanf("%d", &result);
+  fprintf(PROGRAM_STREAM(stdout), "> ");
+  fflush(PROGRAM_STREAM(stdout));
+  fscanf(PROGRAM_STREAM(stdin), "%d", &result);
 
   return BOX(result);
 }
@@ -1210,8 +1222,8 @@ extern int Lbinoperror2 (void) {
 
 /* Lwrite is an implementation of the "write" construct */
 extern int Lwrite (int n) {
-  printf("%d\n", UNBOX(n));
-  fflush(stdout);
+  fprintf(PROGRAM_STREAM(stdout), "%d\n", UNBOX(n));
+  fflush(PROGRAM_STREAM(stdout));
 
   return 0;
 }
@@ -1232,6 +1244,22 @@ extern int Ltime () {
   return BOX(t.tv_sec * 1000000 + t.tv_nsec / 1000);
 }
 
+/* Fibers are run by the iterative interpreter, which implements these itself */
+extern int Lspawn (void *f) {
+  failure("spawn: fibers are only supported by the iterative interpreter\n");
+  return 0;
+}
+
+extern int Lyield () {
+  failure("yield: fibers are only supported by the iterative interpreter\n");
+  return 0;
+}
+
+extern int Ljoin (int fiber) {
+  failure("join: fibers are only supported by the iterative interpreter\n");
+  return 0;
+}
+
 extern void set_args (int argc, char *argv[]) {
   data *a;
   int   n = argc;
@@ -1243,7 +1271,12 @@ extern void set_args (int argc, char *argv[]) {
   p = LmakeArray(BOX(n));
   push_extra_root((void **)&p);
 
-  for (i = 0; i < n; i++) { ((int *)p)[i] = (int)Bstring(argv[i]); }
+  // the array is old once a string has been allocated after it
+  for (i = 0; i < n; i++) {
+    int s = (int)Bstring(argv[i]);
+    __gc_write_barrier(&p[i], (void *)s);
+    p[i] = s;
+  }
 
   pop_extra_root((void **)&p);
   POST_GC();
@@ -17,4 +17,14 @@
 
 void failure (char *s, ...);
 
+// If set, called after a failure has been reported instead of exiting; it must
+// not return (e.g. it may longjmp to let a host survive the failed program).
+// Like the rest of the state of the runtime and of the collector, it belongs to
+// the calling thread, so that a host can run a program on each of its threads.
+extern _Thread_local void (*failure_hook) (void);
+
+// The standard streams of the program running on the calling thread, the ones
+// of the process while unset
+extern _Thread_local FILE *program_stdin, *program_stdout, *program_stderr;
+
 #endif
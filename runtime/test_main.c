@@ -15,8 +15,9 @@ extern void *Bsexp (int n, ...);
 extern void *Barray (int bn, ...);
 extern void *Bstring (void *);
 extern void *Bclosure (int bn, void *entry, ...);
+extern void *Bsta (void *v, int i, void *x);
 
-extern size_t __gc_stack_top, __gc_stack_bottom;
+extern _Thread_local size_t __gc_stack_top, __gc_stack_bottom;
 
 void test_correct_structure_sizes (void) {
   // something like induction base
@@ -167,6 +168,180 @@ void test_alive_are_not_reclaimed (void) {
   cleanup_test(st);
 }
 
+void test_reset_drops_all_objects (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(1)));
+  vstack_pop(st);
+  __gc_reset();
+
+  const int N = 10;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 0));
+
+  // the heap is usable right away
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc"));
+  alive = objects_snapshot(ids, N);
+  assert((alive == 1));
+
+  cleanup_test(st);
+}
+
+void test_restore_objects_relocates_pointers (void) {
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc"));
+  vstack_push(st,
+              call_runtime_function(
+                  vstack_top(st) - 4, Barray, 2, BOX(1), vstack_kth_from_start(st, 0)));
+  size_t size;
+  char  *begin = __gc_objects(&size);
+  char  *saved = malloc(size);
+  memcpy(saved, begin, size);
+  size_t array_offset = (char *)vstack_kth_from_start(st, 1) - begin;
+
+  // as if the objects had been saved at another address
+  __gc_reset();
+  size_t old_begin = (size_t)begin + 4096;
+  *(size_t *)(saved + array_offset) += 4096;
+  char *restored = __gc_restore_objects(saved, size, old_begin);
+  free(saved);
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 2));
+  char **array = (char **)(restored + array_offset);
+  assert((strcmp(array[0], "abc") == 0));
+
+  cleanup_test(st);
+}
+
+static size_t extra_stack[2];
+
+static void visit_extra_stack (stack_visitor visit, void *context) {
+  visit(context, extra_stack, extra_stack + 2);
+}
+
+void test_extra_stacks_are_roots (void) {
+  virt_stack *st = init_test();
+  __gc_extra_stacks = visit_extra_stack;
+
+  // an object dead by the time of the collection comes first, so that the
+  // live string moves
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "aaaaaaaaaaaaaaaaaaaa"));
+  extra_stack[0] = BOX(1);
+  extra_stack[1] = call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc");
+  size_t before = extra_stack[1];
+  vstack_pop(st);
+  force_gc_cycle(st);
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 1));
+  assert((extra_stack[1] != before));
+  assert((strcmp((char *)extra_stack[1], "abc") == 0));
+
+  cleanup_test(st);
+}
+
+void test_minor_collection_promotes_survivors (void) {
+  __gc_set_nursery(64);
+  virt_stack *st = init_test();
+
+  call_runtime_function(vstack_top(st) - 4, Bstring, 1, "aaaaaaaaaaaaaaaaaaaa");
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc"));
+  assert(((size_t *)vstack_kth_from_start(st, 0) >= __gc_young_begin));
+  force_gc_cycle(st);
+
+  // the survivor has slid down over the garbage and is old now
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 1));
+  assert(((size_t *)vstack_kth_from_start(st, 0) < __gc_young_begin));
+  assert((strcmp((char *)vstack_kth_from_start(st, 0), "abc") == 0));
+
+  cleanup_test(st);
+  __gc_set_nursery(0);
+}
+
+void test_write_barrier_keeps_young_objects (void) {
+  __gc_set_nursery(64);
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Barray, 2, BOX(1), BOX(1)));
+  force_gc_cycle(st);
+  // the young string is only reachable from the old array
+  void *s = (void *)call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc");
+  Bsta(s, BOX(0), (void *)vstack_kth_from_start(st, 0));
+  force_gc_cycle(st);
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 2));
+  char **array = (char **)vstack_kth_from_start(st, 0);
+  assert(((size_t *)array[0] < __gc_young_begin));
+  assert((strcmp(array[0], "abc") == 0));
+
+  cleanup_test(st);
+  __gc_set_nursery(0);
+}
+
+void test_write_barrier_keeps_closure_captures (void) {
+  __gc_set_nursery(64);
+  virt_stack *st = init_test();
+
+  vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bclosure, 3, BOX(1), NULL, BOX(1)));
+  force_gc_cycle(st);
+  // the interpreter stores through a reference to the captured variable (LDA_CLOSURE)
+  void  *s    = (void *)call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc");
+  void **cell = (void **)vstack_kth_from_start(st, 0) + 1;
+  __gc_write_barrier(cell, s);
+  *cell = s;
+  force_gc_cycle(st);
+
+  const int N = 10;
+  int       ids[N];
+  assert((objects_snapshot(ids, N) == 2));
+  char **closure = (char **)vstack_kth_from_start(st, 0);
+  assert(((size_t *)closure[1] < __gc_young_begin));
+  assert((strcmp(closure[1], "abc") == 0));
+
+  cleanup_test(st);
+  __gc_set_nursery(0);
+}
+
+void test_parallel_mark_keeps_reachable (void) {
+  __gc_set_mark_threads(4);
+  virt_stack *st = init_test();
+
+  for (int i = 0; i < 16; ++i) {
+    call_runtime_function(vstack_top(st) - 4, Bstring, 1, "garbage");
+    vstack_push(st, call_runtime_function(vstack_top(st) - 4, Bstring, 1, "abc"));
+  }
+  // the strings are reachable from the array as well
+  vstack_push(st,
+              call_runtime_function(vstack_top(st) - 4,
+                                    Barray,
+                                    3,
+                                    BOX(2),
+                                    vstack_kth_from_start(st, 0),
+                                    vstack_kth_from_start(st, 15)));
+  force_gc_cycle(st);
+
+  const int N = 32;
+  int       ids[N];
+  size_t    alive = objects_snapshot(ids, N);
+  assert((alive == 17));
+  for (int i = 0; i < alive - 1; ++i) { assert((ids[i] < ids[i + 1])); }
+  char **array = (char **)vstack_kth_from_start(st, 16);
+  assert((array[0] == (char *)vstack_kth_from_start(st, 0)));
+  assert((strcmp(array[1], "abc") == 0));
+
+  cleanup_test(st);
+  __gc_set_mark_threads(1);
+}
+
 void test_small_tree_compaction (void) {
   virt_stack *st = init_test();
   // this one will increase heap size
@@ -193,7 +368,7 @@ void test_small_tree_compaction (void) {
   cleanup_test(st);
 }
 
-extern size_t cur_id;
+extern _Thread_local size_t cur_id;
 
 size_t generate_random_obj_forest (virt_stack *st, int cnt, int seed) {
   srand(seed);
@@ -261,6 +436,13 @@ int main (int argc, char **argv) {
   test_single_object_allocation_with_collection_virtual_stack();
   test_garbage_is_reclaimed();
   test_alive_are_not_reclaimed();
+  test_reset_drops_all_objects();
+  test_restore_objects_relocates_pointers();
+  test_extra_stacks_are_roots();
+  test_minor_collection_promotes_survivors();
+  test_write_barrier_keeps_young_objects();
+  test_write_barrier_keeps_closure_captures();
+  test_parallel_mark_keeps_reachable();
   test_small_tree_compaction();
 
   time_t start, end;
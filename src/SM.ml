@@ -175,6 +175,16 @@ module ByteCode = struct
     let add_public l = pubs := S.add l !pubs in
     let add_import l = imports := S.add l !imports in
     let add_fixup l = fixups := (Buffer.length code, l) :: !fixups in
+    let labels =
+      List.fold_left
+        (fun ls -> function
+          | LABEL s | FLABEL s | SLABEL s -> S.add s ls
+          | _ -> ls)
+        S.empty insns
+    in
+    (* the runtime functions of the foreign call table of the interpreter,
+       see interpreter/externs.def *)
+    let externs = S.of_list Externs.names in
     let add_bytes = List.iter (fun x -> Buffer.add_char code @@ Char.chr x) in
     let add_ints =
       List.iter (fun x -> Buffer.add_int32_ne code @@ Int32.of_int x)
@@ -276,6 +286,17 @@ module ByteCode = struct
       | CALL (".array", n, _) ->
           add_bytes [ (7 * 16) + 4 ];
           add_ints [ n ]
+      (* 0x75 s:32 n:32       *)
+      | CALL (fn, n, _) when not (S.mem fn labels) ->
+          if not (S.mem fn externs) then
+            failwith
+              (Printf.sprintf
+                 "ERROR: '%s' is neither defined in the unit nor a runtime \
+                  function of the interpreter"
+                 fn);
+          add_bytes [ (7 * 16) + 5 ];
+          add_strings [ fn ];
+          add_ints [ n ]
       (* 0x52 n:32 n:32       *)
       | BEGIN (_, a, l, [], _, _) ->
           add_bytes [ (5 * 16) + 2 ];
@@ -985,7 +985,7 @@ let build cmd prog =
   cmd#dump_file "i" (Interface.gen prog);
   let inc = get_std_path () in
   let compiler = "gcc" in
-  let flags = "-no-pie -m32" in
+  let flags = "-no-pie -m32 -pthread" in
   match cmd#get_mode with
   | `Default ->
       let objs = find_objects (fst @@ fst prog) cmd#get_include_paths in